@@ -0,0 +1,523 @@
+/********************************************************************************
+*   FILE:   bench_converge.c
+*   DESC:   Convergence benchmark suite. For each topology family and size it
+*           builds a network in the simulator, lets routing converge, then
+*           applies a script of events (the router's update, disable and
+*           crash commands) one at a time, letting it converge after each.
+*           Every phase is one CSV row, so runs from different releases can
+*           be diffed or plotted.
+*
+*           Families: ring, grid, random (random spanning tree plus chords up
+*           to degree 4), scalefree (Barabasi-Albert, 2 links per new router)
+*           and fattree (k-ary, 5k^2/4 switches, the largest k that fits).
+*           Link costs are 1..10.
+*
+*           Events, with -e, as many as wanted, applied in order:
+*               update <id1> <id2> <cost|inf>
+*               disable <id1> <id2>
+*               crash <id>
+*           Without -e each network gets one of each on random links and a
+*           random router. A crashed router goes silent; its neighbors only
+*           notice when its updates stop, and routes to it may count to
+*           infinity, so -m bounds each phase.
+*
+*           converged is "yes" only if the network went quiet with every
+*           route correct, "wrong" if it went quiet with wrong routes and
+*           "no" if the phase hit -m. Any phase that is not "yes" makes the
+*           run exit with failure.
+*
+*           With -w every network is also written out as one topology file
+*           per router, in the format read_topology expects. Router i is at
+*           10.0.0.0 + i as in the simulator, so the same network can be run
+*           on a testbed with one host per router.
+*
+*   Build:  gcc -O2 -pthread -o bench_converge bench/bench_converge.c \
+*               $(find src -name '*.c' ! -name '*assignment3.c')
+*   Usage:  ./bench_converge [-f ring,grid,random,scalefree,fattree]
+*                      [-n sizes, e.g. 64,256,1024] [-e event]... [-t]
+*                      [-i interval s] [-l min delay ms] [-L max delay ms]
+*                      [-x loss %] [-p 0|1] [-h hold-down ms]
+*                      [-m max simulated s per phase] [-s seed]
+*                      [-o results.csv] [-w topology dir] [-v 1|2 wire version]
+********************************************************************************/
+#include <sys/resource.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "../src/header.h"
+
+#define BENCH_MAX_COST 10
+#define BENCH_DEGREE 4                  // average degree of random networks
+#define BENCH_SETTLE_INTERVALS (COUNTER_MAX + 3)    // quiet intervals that count as converged;
+                                                    // longer than a crashed neighbor takes to time out
+#define BENCH_MAX_EVENTS 64
+#define BENCH_ADDRESS_BASE 0x0A000000UL    // 10.0.0.0
+#define BENCH_PORT 4000
+
+enum family { FAMILY_RING, FAMILY_GRID, FAMILY_RANDOM, FAMILY_SCALEFREE, FAMILY_FATTREE, NUM_FAMILIES };
+
+static const char *family_names[NUM_FAMILIES] = { "ring", "grid", "random", "scalefree", "fattree" };
+
+struct network {
+	int num_routers;
+	int num_links;
+	int max_links;
+	struct sim_link *links;
+	uint32_t *seen;                     // open addressing set of (a << 16 | b), a < b
+	int seen_size;
+};
+
+/********************************************************************************
+*   Name:   now_ns
+*   Desc:   monotonic clock in nanoseconds
+*   Ret:    nanoseconds
+*   Ref:    None
+********************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/********************************************************************************
+*   Name:   reset_peak_rss
+*   Desc:   resets the kernel's high-water mark of resident memory, so each
+*           network reports its own peak (Linux 4.0+; otherwise the peak
+*           covers the whole process)
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void reset_peak_rss(void)
+{
+    FILE *file = fopen("/proc/self/clear_refs", "w");
+
+    if(NULL != file) {
+        fputs("5", file);
+        fclose(file);
+    }
+}
+
+/********************************************************************************
+*   Name:   peak_rss_kb
+*   Desc:   resident memory high-water mark since the last reset
+*   Ret:    kilobytes
+*   Ref:    None
+********************************************************************************/
+static long peak_rss_kb(void)
+{
+    struct rusage usage;
+    char line[128];
+    long peak = -1;
+    FILE *file = fopen("/proc/self/status", "r");
+
+    if(NULL != file) {
+        while(NULL != fgets(line, sizeof(line), file)) {
+            if(1 == sscanf(line, "VmHWM: %ld", &peak)) {
+                break;
+            }
+        }
+        fclose(file);
+    }
+    if(peak < 0) {
+        getrusage(RUSAGE_SELF, &usage);
+        peak = usage.ru_maxrss;
+    }
+
+    return peak;
+}
+
+/********************************************************************************
+*   Name:   add_link
+*   Desc:   adds a link with a random cost unless the routers are the same or
+*           already linked
+*   Ret:    TRUE if added, FALSE otherwise
+*   Ref:    None
+********************************************************************************/
+static int add_link(struct network *net, int a, int b)
+{
+    uint32_t key, slot;
+
+    if(a == b || net->num_links == net->max_links) {
+        return FALSE;
+    }
+    key = a < b ? ((uint32_t) a << 16) | b : ((uint32_t) b << 16) | a;
+    for(slot = (key * 2654435761u) & (net->seen_size - 1); net->seen[slot] != 0; slot = (slot + 1) & (net->seen_size - 1)) {
+        if(net->seen[slot] == key) {
+            return FALSE;
+        }
+    }
+    net->seen[slot] = key;
+
+    net->links[net->num_links].a = a;
+    net->links[net->num_links].b = b;
+    net->links[net->num_links].cost = 1 + rand() % BENCH_MAX_COST;
+    net->num_links++;
+    return TRUE;
+}
+
+/********************************************************************************
+*   Name:   make_network
+*   Desc:   generates a network of the given family with about num_routers
+*           routers; grids and fat trees round down to the nearest size
+*           they can take
+*   Ret:    Success or Failure if the size is too small for the family
+*   Ref:    None
+********************************************************************************/
+static int make_network(enum family family, int num_routers, struct network *net)
+{
+    int index, other, attempts, rows, cols = 1, k = 2, half, pod, core, edge, agg;
+    int *ends = NULL, num_ends = 0;
+
+    switch(family) {
+        case FAMILY_GRID:
+            for(rows = 1; (rows + 1) * (rows + 1) <= num_routers; rows++);
+            cols = num_routers / rows;
+            num_routers = rows * cols;
+            net->max_links = 2 * num_routers;
+            break;
+        case FAMILY_FATTREE:
+            for(k = 2; 5 * (k + 2) * (k + 2) / 4 <= num_routers; k += 2);
+            num_routers = 5 * k * k / 4;
+            net->max_links = k * k * k / 2;
+            break;
+        case FAMILY_SCALEFREE:
+            net->max_links = 2 * num_routers;
+            break;
+        default:
+            net->max_links = num_routers * BENCH_DEGREE / 2 + num_routers;
+            break;
+    }
+    if(num_routers < 3 || num_routers >= NEXTHOP_SELF) {
+        return FAILURE;
+    }
+
+    net->num_routers = num_routers;
+    net->num_links = 0;
+    for(net->seen_size = 1; net->seen_size < 4 * net->max_links; net->seen_size *= 2);
+    net->links = (struct sim_link*) malloc(net->max_links*sizeof(struct sim_link));
+    net->seen = (uint32_t*) calloc(net->seen_size, sizeof(uint32_t));
+    if(NULL == net->links || NULL == net->seen) {
+        fprintf(stderr, "Failed to allocate network\n");
+        exit(EXIT_FAILURE);
+    }
+
+    switch(family) {
+        case FAMILY_RING:
+            for(index = 1; index <= num_routers; index++) {
+                add_link(net, index, index % num_routers + 1);
+            }
+            break;
+
+        case FAMILY_GRID:
+            for(index = 0; index < num_routers; index++) {
+                if(index % cols + 1 < cols) {
+                    add_link(net, index + 1, index + 2);
+                }
+                if(index + cols < num_routers) {
+                    add_link(net, index + 1, index + cols + 1);
+                }
+            }
+            break;
+
+        case FAMILY_RANDOM:
+            // A random spanning tree keeps it connected
+            for(index = 2; index <= num_routers; index++) {
+                add_link(net, index, 1 + rand() % (index - 1));
+            }
+            for(attempts = 0; net->num_links < num_routers * BENCH_DEGREE / 2 && attempts < 4 * net->max_links; attempts++) {
+                add_link(net, 1 + rand() % num_routers, 1 + rand() % num_routers);
+            }
+            break;
+
+        case FAMILY_SCALEFREE:
+            // Picking a random link end picks routers in proportion to degree
+            ends = (int*) malloc(2 * net->max_links * sizeof(int));
+            if(NULL == ends) {
+                fprintf(stderr, "Failed to allocate network\n");
+                exit(EXIT_FAILURE);
+            }
+            add_link(net, 1, 2);
+            add_link(net, 2, 3);
+            add_link(net, 3, 1);
+            ends[num_ends++] = 1; ends[num_ends++] = 2;
+            ends[num_ends++] = 2; ends[num_ends++] = 3;
+            ends[num_ends++] = 3; ends[num_ends++] = 1;
+            for(index = 4; index <= num_routers; index++) {
+                for(attempts = 0, other = 0; other < 2 && attempts < 64; attempts++) {
+                    edge = ends[rand() % num_ends];
+                    if(add_link(net, index, edge) == TRUE) {
+                        ends[num_ends++] = index;
+                        ends[num_ends++] = edge;
+                        other++;
+                    }
+                }
+            }
+            free(ends);
+            break;
+
+        case FAMILY_FATTREE:
+            // Core switches first, then each pod's aggregation and edge switches
+            half = k / 2;
+            for(pod = 0; pod < k; pod++) {
+                for(agg = 0; agg < half; agg++) {
+                    for(core = 0; core < half; core++) {
+                        add_link(net, 1 + agg * half + core, 1 + half * half + pod * k + agg);
+                    }
+                    for(edge = 0; edge < half; edge++) {
+                        add_link(net, 1 + half * half + pod * k + agg, 1 + half * half + pod * k + half + edge);
+                    }
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   write_topology
+*   Desc:   writes one topology file per router into dir/family_routers/
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+static int write_topology(const char *dir, const char *family, const struct network *net)
+{
+    char path[PATH_MAX];
+    int *degree, router, index, rv = SUCCESS;
+    unsigned long address;
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s/%s_%d", dir, family, net->num_routers);
+    if(-1 == mkdir(dir, 0755) && errno != EEXIST) {
+        perror(dir);
+        return FAILURE;
+    }
+    if(-1 == mkdir(path, 0755) && errno != EEXIST) {
+        perror(path);
+        return FAILURE;
+    }
+
+    degree = (int*) calloc(net->num_routers + 1, sizeof(int));
+    if(NULL == degree) {
+        return FAILURE;
+    }
+    for(index = 0; index < net->num_links; index++) {
+        degree[net->links[index].a]++;
+        degree[net->links[index].b]++;
+    }
+
+    for(router = 1; router <= net->num_routers && rv == SUCCESS; router++) {
+        snprintf(path, sizeof(path), "%s/%s_%d/router%d.txt", dir, family, net->num_routers, router);
+        file = fopen(path, "w");
+        if(NULL == file) {
+            perror(path);
+            rv = FAILURE;
+            break;
+        }
+
+        fprintf(file, "%d\n%d\n", net->num_routers, degree[router]);
+        for(index = 1; index <= net->num_routers; index++) {
+            address = BENCH_ADDRESS_BASE + index;
+            fprintf(file, "%d %lu.%lu.%lu.%lu %d\n", index, (address >> 24) & 0xFF, (address >> 16) & 0xFF,
+                    (address >> 8) & 0xFF, address & 0xFF, BENCH_PORT);
+        }
+        for(index = 0; index < net->num_links; index++) {
+            if(net->links[index].a == router) {
+                fprintf(file, "%d %d %d\n", router, net->links[index].b, net->links[index].cost);
+            }
+            else if(net->links[index].b == router) {
+                fprintf(file, "%d %d %d\n", router, net->links[index].a, net->links[index].cost);
+            }
+        }
+
+        if(0 != fclose(file)) {
+            perror(path);
+            rv = FAILURE;
+        }
+    }
+
+    free(degree);
+    return rv;
+}
+
+/********************************************************************************
+*   Name:   apply_event
+*   Desc:   applies one scripted event to the simulation
+*   Ret:    Success or Failure for a malformed event or one naming routers
+*           that are not linked
+*   Ref:    None
+********************************************************************************/
+static int apply_event(struct simulation *sim, const char *event)
+{
+    char command[16], cost[16];
+    unsigned a, b;
+
+    if(4 == sscanf(event, "%15s %u %u %15s", command, &a, &b, cost) && 0 == strcmp(command, "update")) {
+        return sim_set_link(sim, a, b, 0 == strcasecmp(cost, "inf") ? INF : (uint16_t) atoi(cost));
+    }
+    if(3 == sscanf(event, "%15s %u %u", command, &a, &b) && 0 == strcmp(command, "disable")) {
+        return sim_set_link(sim, a, b, INF);
+    }
+    if(2 == sscanf(event, "%15s %u", command, &a) && 0 == strcmp(command, "crash")) {
+        return sim_crash_router(sim, a);
+    }
+
+    return FAILURE;
+}
+
+/********************************************************************************
+*   Name:   print_row
+*   Desc:   one CSV row for a phase
+*   Ret:    TRUE if the phase converged to correct routes, FALSE otherwise
+*   Ref:    None
+********************************************************************************/
+static int print_row(FILE *out, const char *family, const struct network *net, const struct sim_config *config,
+        const char *phase, const struct sim_stats *stats, int wrong, double wall_ns)
+{
+    double interval_ms = config->interval_sec * 1000.0;
+    const char *status = "no";
+
+    if(stats->converged == TRUE) {
+        status = wrong == 0 ? "yes" : "wrong";
+    }
+
+    fprintf(out, "%s,%d,%d,%s,v%d,%s,%s,%.1f,%ld,%lu,%lu,%lu,%lu,%d,%.1f,%ld\n", family, net->num_routers, net->num_links,
+            config->triggered == TRUE ? "triggered" : "periodic", config->wire_version, phase, status,
+            stats->converged_ms, (long) ((stats->converged_ms + interval_ms - 1) / interval_ms), stats->messages, stats->bytes,
+            stats->dropped, stats->route_changes, wrong, wall_ns / 1e6, peak_rss_kb());
+    fflush(out);
+
+    return stats->converged == TRUE && wrong == 0 ? TRUE : FALSE;
+}
+
+int main(int argc, char **argv)
+{
+    struct sim_config config = { 1, 5, 20, 0, FALSE, HOLDDOWN_DEFAULT, 1, WIRE_V1 };
+    struct simulation *sim;
+    struct sim_stats stats;
+    struct network net;
+    const char *events[BENCH_MAX_EVENTS], *families = "ring,grid,random,scalefree,fattree", *sizes = "64,256,1024";
+    const char *out_path = NULL, *topology_dir = NULL, *size;
+    char defaults[3][64], phase[80];
+    int num_events = 0, family, num_routers, index, ch, link, rv = EXIT_SUCCESS;
+    double max_s = 600, loss_percent = 0, start;
+    FILE *out = stdout;
+
+    while((ch = getopt(argc, argv, "f:n:e:ti:l:L:x:p:h:m:s:o:w:v:")) != -1) {
+        switch(ch) {
+            case 'f': families = optarg; break;
+            case 'n': sizes = optarg; break;
+            case 'e':
+                if(num_events == BENCH_MAX_EVENTS) {
+                    fprintf(stderr, "At most %d events\n", BENCH_MAX_EVENTS);
+                    return EXIT_FAILURE;
+                }
+                events[num_events++] = optarg;
+                break;
+            case 't': config.triggered = TRUE; break;
+            case 'i': config.interval_sec = atol(optarg); break;
+            case 'l': config.delay_min_ms = atof(optarg); break;
+            case 'L': config.delay_max_ms = atof(optarg); break;
+            case 'x': loss_percent = atof(optarg); break;
+            case 'p': poisoned_reverse = atoi(optarg) ? TRUE : FALSE; break;
+            case 'h': config.holddown_ms = atol(optarg); break;
+            case 'm': max_s = atof(optarg); break;
+            case 's': config.seed = strtoul(optarg, NULL, 10); break;
+            case 'o': out_path = optarg; break;
+            case 'w': topology_dir = optarg; break;
+            case 'v': config.wire_version = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-f families] [-n sizes] [-e event]... [-t] [-i interval s] [-l min delay ms]"
+                        " [-L max delay ms] [-x loss %%] [-p 0|1] [-h hold-down ms] [-m max s] [-s seed]"
+                        " [-o results.csv] [-w topology dir] [-v 1|2]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if(config.interval_sec <= 0 || config.delay_max_ms < config.delay_min_ms || config.holddown_ms < 0 ||
+       (config.wire_version != WIRE_V1 && config.wire_version != WIRE_V2)) {
+        fprintf(stderr, "Need a positive interval, min delay <= max delay and wire version 1 or 2\n");
+        return EXIT_FAILURE;
+    }
+    config.loss = loss_percent / 100;
+
+    if(NULL != out_path) {
+        out = fopen(out_path, "w");
+        if(NULL == out) {
+            perror(out_path);
+            return EXIT_FAILURE;
+        }
+    }
+
+    // Only errors; the per-packet lines would dominate the run
+    log_level = LOG_LEVEL_ERROR;
+
+    fprintf(out, "topology,routers,links,updates,wire,phase,converged,converge_ms,rounds,messages,bytes,dropped,route_changes,wrong,wall_ms,peak_rss_kb\n");
+
+    for(family = 0; family < NUM_FAMILIES; family++) {
+        if(NULL == strstr(families, family_names[family])) {
+            continue;
+        }
+
+        for(size = sizes; NULL != size && *size != '\0'; size = strchr(size, ',') ? strchr(size, ',') + 1 : NULL) {
+
+            num_routers = atoi(size);
+            srand(config.seed);
+            if(SUCCESS != make_network(family, num_routers, &net)) {
+                fprintf(stderr, "%s: %d routers is too few or too many\n", family_names[family], num_routers);
+                rv = EXIT_FAILURE;
+                continue;
+            }
+            if(NULL != topology_dir && SUCCESS != write_topology(topology_dir, family_names[family], &net)) {
+                rv = EXIT_FAILURE;
+            }
+
+            reset_peak_rss();
+            start = now_ns();
+            sim = sim_create(&config, net.num_routers, net.links, net.num_links);
+            if(NULL == sim) {
+                return EXIT_FAILURE;
+            }
+            sim_run(sim, BENCH_SETTLE_INTERVALS * config.interval_sec * 1000.0, max_s * 1000, &stats);
+            if(TRUE != print_row(out, family_names[family], &net, &config, "initial", &stats, sim_check_routes(sim), now_ns() - start)) {
+                rv = EXIT_FAILURE;
+            }
+
+            if(num_events == 0) {
+                link = rand() % net.num_links;
+                snprintf(defaults[0], sizeof(defaults[0]), "update %d %d %d", net.links[link].a, net.links[link].b,
+                        net.links[link].cost % BENCH_MAX_COST + 1);
+                link = (link + 1 + rand() % (net.num_links - 1)) % net.num_links;
+                snprintf(defaults[1], sizeof(defaults[1]), "disable %d %d", net.links[link].a, net.links[link].b);
+                snprintf(defaults[2], sizeof(defaults[2]), "crash %d", 1 + rand() % net.num_routers);
+            }
+
+            for(index = 0; index < (num_events ? num_events : 3); index++) {
+                snprintf(phase, sizeof(phase), "%s", num_events ? events[index] : defaults[index]);
+                if(SUCCESS != apply_event(sim, phase)) {
+                    fprintf(stderr, "%s_%d: cannot apply \"%s\"\n", family_names[family], net.num_routers, phase);
+                    rv = EXIT_FAILURE;
+                    continue;
+                }
+                start = now_ns();
+                sim_run(sim, BENCH_SETTLE_INTERVALS * config.interval_sec * 1000.0, max_s * 1000, &stats);
+                if(TRUE != print_row(out, family_names[family], &net, &config, phase, &stats, sim_check_routes(sim), now_ns() - start)) {
+                    rv = EXIT_FAILURE;
+                }
+            }
+
+            sim_free(sim);
+            free(net.links);
+            free(net.seen);
+        }
+    }
+
+    if(out != stdout) {
+        fclose(out);
+    }
+    return rv;
+}
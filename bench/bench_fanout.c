@@ -0,0 +1,164 @@
+/********************************************************************************
+*   FILE:   bench_fanout.c
+*   DESC:   Measures one periodic send to 1, 16 and 256 neighbors: the old
+*           socket / encode / sendto / close per neighbor path against the
+*           persistent socket + sendmmsg batch in send_message_to_neighbors.
+*
+*   Build:  gcc -O2 -pthread -o bench_fanout bench/bench_fanout.c \
+*               $(find src -name '*.c' ! -name '*assignment3.c')
+*   Usage:  ./bench_fanout [num_routers] [ticks]
+********************************************************************************/
+#include <fcntl.h>
+#include <time.h>
+#include "../src/header.h"
+
+#define BENCH_SELF_ID 1
+
+static const int neighbor_counts[] = { 1, 16, 256 };
+
+/********************************************************************************
+*   Name:   now_ns
+*   Desc:   monotonic clock in nanoseconds
+*   Ret:    nanoseconds
+*   Ref:    None
+********************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/********************************************************************************
+*   Name:   old_send_message_to_neighbors
+*   Desc:   the per-neighbor path send_message_to_neighbors replaced: a fresh
+*           socket, a fresh encoding and one sendto per neighbor
+*   Ret:    syscalls issued
+*   Ref:    None
+********************************************************************************/
+static int old_send_message_to_neighbors()
+{
+    struct sockaddr_in to;
+    size_t msg_size;
+    char *message;
+    int index, sockfd, syscalls = 0;
+
+    for(index = 0; index < router_current()->num_entries; index++) {
+        if(router_current()->routing_table.nexthop[index] == NEXTHOP_SELF &&
+                router_current()->routing_table.entry[index].id != router_current()->id) {
+
+            sockfd = socket(AF_INET, SOCK_DGRAM, 0);
+            memset(&to, 0, sizeof(to));
+            to.sin_family = AF_INET;
+            to.sin_addr.s_addr = router_current()->routing_table.entry[index].ip_addr;
+            to.sin_port = router_current()->routing_table.entry[index].port;
+
+            message = prepare_message(&msg_size);
+            sendto(sockfd, message, msg_size, 0, (struct sockaddr*) &to, sizeof(to));
+            free(message);
+            close(sockfd);
+            syscalls += 3;
+        }
+    }
+
+    return syscalls;
+}
+
+/********************************************************************************
+*   Name:   drain
+*   Desc:   empties the neighbor sink sockets between ticks
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void drain(int *sinks, int num_sinks, char *buffer)
+{
+    int index;
+
+    for(index = 0; index < num_sinks; index++) {
+        while(recv(sinks[index], buffer, MAX_DATAGRAM_SIZE, MSG_DONTWAIT) > 0) {
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int num_routers = 1000;
+    int ticks = 200;
+    int count_index, index, num_neighbors, tick, old_syscalls = 0;
+    int sinks[256];
+    struct sockaddr_in bound;
+    socklen_t bound_len;
+    char *buffer;
+    double start, old_ns, new_ns;
+
+    if(argc > 1) {
+        num_routers = atoi(argv[1]);
+    }
+    if(argc > 2) {
+        ticks = atoi(argv[2]);
+    }
+
+    buffer = (char*) malloc(MAX_DATAGRAM_SIZE);
+    router_current()->id = BENCH_SELF_ID;
+    router_current()->ip_addr = inet_addr("127.0.0.1");
+    new_sockin(0);
+
+    for(index = 0; index < 256; index++) {
+        sinks[index] = socket(AF_INET, SOCK_DGRAM, 0);
+        memset(&bound, 0, sizeof(bound));
+        bound.sin_family = AF_INET;
+        bound.sin_addr.s_addr = inet_addr("127.0.0.1");
+        bind(sinks[index], (struct sockaddr*) &bound, sizeof(bound));
+        bound_len = sizeof(bound);
+        getsockname(sinks[index], (struct sockaddr*) &bound, &bound_len);
+        fcntl(sinks[index], F_SETFL, O_NONBLOCK);
+    }
+
+    printf("%-12s%-16s%-16s%-16s%-16s\n", "neighbors", "old syscalls", "new syscalls", "old us/tick", "new us/tick");
+
+    for(count_index = 0; count_index < (int) (sizeof(neighbor_counts)/sizeof(neighbor_counts[0])); count_index++) {
+
+        num_neighbors = neighbor_counts[count_index];
+
+        router_current()->num_entries = 0;
+        append_routing_table_entry(BENCH_SELF_ID, router_current()->ip_addr, 0, 0, BENCH_SELF_ID);
+        for(index = 2; index <= num_routers; index++) {
+            if(index - 2 < num_neighbors) {
+                bound_len = sizeof(bound);
+                getsockname(sinks[index-2], (struct sockaddr*) &bound, &bound_len);
+                append_routing_table_entry(index, bound.sin_addr.s_addr, bound.sin_port, 1, BENCH_SELF_ID);
+            }
+            else {
+                append_routing_table_entry(index, htonl(0x0A000000 | index), 4000, INF, INVALID_ROUTER_ID);
+            }
+        }
+        sort_routing_table();
+        for(index = 2; index < 2 + num_neighbors; index++) {
+            set_link_cost(index, 1);
+        }
+
+        old_ns = 0;
+        for(tick = 0; tick < ticks; tick++) {
+            start = now_ns();
+            old_syscalls = old_send_message_to_neighbors();
+            old_ns += now_ns() - start;
+            drain(sinks, num_neighbors, buffer);
+        }
+
+        new_ns = 0;
+        for(tick = 0; tick < ticks; tick++) {
+            start = now_ns();
+            send_message_to_neighbors();
+            new_ns += now_ns() - start;
+            drain(sinks, num_neighbors, buffer);
+        }
+
+        // sendmmsg takes up to UIO_MAXIOV (1024) datagrams per call
+        printf("%-12d%-16d%-16d%-16.1f%-16.1f\n", num_neighbors, old_syscalls, (num_neighbors + 1023) / 1024,
+                old_ns / ticks / 1e3, new_ns / ticks / 1e3);
+    }
+
+    free(buffer);
+    return EXIT_SUCCESS;
+}
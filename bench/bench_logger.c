@@ -0,0 +1,106 @@
+/********************************************************************************
+*   FILE:   bench_logger.c
+*   DESC:   Compares the cost of one cse4589_print_and_log call against the
+*           old open / append / close per message, as the receive path sees it
+*           when a large update is logged entry by entry.
+*
+*   Build:  gcc -O2 -pthread -o bench_logger bench/bench_logger.c \
+*               $(find src -name '*.c' ! -name '*assignment3.c')
+*   Usage:  ./bench_logger [messages]
+********************************************************************************/
+#include <fcntl.h>
+#include <stdarg.h>
+#include <time.h>
+#include "../src/header.h"
+#include "../include/logger.h"
+
+#define BENCH_LOGFILE "./bench_logger.log"
+
+/********************************************************************************
+*   Name:   now_ns
+*   Desc:   monotonic clock in nanoseconds
+*   Ret:    nanoseconds
+*   Ref:    None
+********************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/********************************************************************************
+*   Name:   old_print_and_log
+*   Desc:   the previous logger: stdout, then open / append / close the log
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void old_print_and_log(char *format, ...)
+{
+    va_list args_pointer;
+    FILE *fp;
+
+    va_start(args_pointer, format);
+    vprintf(format, args_pointer);
+    va_end(args_pointer);
+
+    if((fp = fopen(LOGFILE, "a")) == NULL) {
+        return;
+    }
+    fprintf(fp, "[PA3:Start:%u]\n", (unsigned) time(NULL));
+    va_start(args_pointer, format);
+    vfprintf(fp, format, args_pointer);
+    va_end(args_pointer);
+    fprintf(fp, "[PA3:End]\n");
+    fclose(fp);
+}
+
+int main(int argc, char **argv)
+{
+    int messages = 100000;
+    int index, saved_stdout, devnull;
+    double start, old_ns, new_ns, flush_ns;
+
+    if(argc > 1) {
+        messages = atoi(argv[1]);
+    }
+
+    strcpy(LOGFILE, BENCH_LOGFILE);
+    fclose(fopen(LOGFILE, "w"));
+
+    // Both loggers print every line; keep the terminal out of the numbers
+    fflush(stdout);
+    saved_stdout = dup(STDOUT_FILENO);
+    devnull = open("/dev/null", O_WRONLY);
+    dup2(devnull, STDOUT_FILENO);
+
+    start = now_ns();
+    for(index = 0; index < messages; index++) {
+        old_print_and_log("%-15d%-15d\n", index, index % INF);
+    }
+    old_ns = (now_ns() - start) / messages;
+
+    start = now_ns();
+    for(index = 0; index < messages; index++) {
+        cse4589_print_and_log("%-15d%-15d\n", index, index % INF);
+    }
+    new_ns = (now_ns() - start) / messages;
+
+    start = now_ns();
+    cse4589_flush_log();
+    flush_ns = now_ns() - start;
+
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    close(devnull);
+
+    printf("messages:           %d\n", messages);
+    printf("open/append/close:  %.0f ns/message\n", old_ns);
+    printf("ring + writer:      %.0f ns/message\n", new_ns);
+    printf("final flush:        %.3f ms\n", flush_ns / 1e6);
+
+    unlink(BENCH_LOGFILE);
+    return EXIT_SUCCESS;
+}
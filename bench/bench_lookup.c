@@ -0,0 +1,214 @@
+/********************************************************************************
+*   FILE:   bench_lookup.c
+*   DESC:   Compares routing table lookups through the id / (ip, port) indexes
+*           against a plain linear scan, and measures the cost of processing
+*           one received update packet at several table sizes, with every
+*           entry logged and with per-entry logging turned off.
+*
+*   Build:  gcc -O2 -pthread -o bench_lookup bench/bench_lookup.c \
+*               $(find src -name '*.c' ! -name '*assignment3.c')
+*   Usage:  ./bench_lookup [packets]
+********************************************************************************/
+#include <fcntl.h>
+#include <time.h>
+#include "../src/header.h"
+#include "../include/logger.h"
+
+#define BENCH_SELF_ID 1
+#define BENCH_NEIGHBOR_ID 2
+#define BENCH_COST 5
+
+static const int table_sizes[] = { 30, 1000, 50000 };
+
+/********************************************************************************
+*   Name:   now_ns
+*   Desc:   monotonic clock in nanoseconds
+*   Ret:    nanoseconds
+*   Ref:    None
+********************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/********************************************************************************
+*   Name:   fill_table
+*   Desc:   fills the routing table with num_routers rows in id order and
+*           indexes them. Row 2 is a directly attached neighbor on loopback.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void fill_table(int num_routers, uint16_t neighbor_port)
+{
+    int index;
+
+    router_current()->num_entries = 0;
+
+    append_routing_table_entry(BENCH_SELF_ID, inet_addr("127.0.0.1"), 4000, 0, BENCH_SELF_ID);
+    append_routing_table_entry(BENCH_NEIGHBOR_ID, inet_addr("127.0.0.1"), neighbor_port, 1, BENCH_SELF_ID);
+    for(index = BENCH_NEIGHBOR_ID + 1; index <= num_routers; index++) {
+        append_routing_table_entry(index, htonl(0x0A000000 | index), 4000, INF, INVALID_ROUTER_ID);
+    }
+
+    sort_routing_table();
+    set_link_cost(BENCH_NEIGHBOR_ID, 1);
+}
+
+/********************************************************************************
+*   Name:   build_packet
+*   Desc:   encodes the update the neighbor would send: its view of as many
+*           destinations as fit in one datagram
+*   Ret:    packet length
+*   Ref:    None
+********************************************************************************/
+static size_t build_packet(char *packet)
+{
+    struct rtable *table = &router_current()->routing_table;
+    uint16_t num_updates, port, id, cost;
+    size_t size_count = 0;
+    int index;
+
+    num_updates = router_current()->num_entries;
+    if(num_updates > (MAX_DATAGRAM_SIZE - sizeof(struct update_header)) / sizeof(struct updates)) {
+        num_updates = (MAX_DATAGRAM_SIZE - sizeof(struct update_header)) / sizeof(struct updates);
+    }
+
+    id = htons(num_updates);
+    memcpy(packet, &id, sizeof(id));
+    port = htons(table->entry[1].port);
+    memcpy(packet+2, &port, sizeof(port));
+    memcpy(packet+4, &table->entry[1].ip_addr, sizeof(uint32_t));
+    size_count = sizeof(struct update_header);
+
+    for(index = 0; index < num_updates; index++) {
+        memcpy(packet+size_count, &table->entry[index].ip_addr, sizeof(uint32_t));
+        port = htons(table->entry[index].port);
+        memcpy(packet+size_count+4, &port, sizeof(port));
+        memset(packet+size_count+6, 0, sizeof(uint16_t));
+        id = htons(table->entry[index].id);
+        memcpy(packet+size_count+8, &id, sizeof(id));
+        cost = htons(BENCH_COST);
+        memcpy(packet+size_count+10, &cost, sizeof(cost));
+        size_count += sizeof(struct updates);
+    }
+
+    return size_count;
+}
+
+/********************************************************************************
+*   Name:   linear_find_by_id
+*   Desc:   the scan find_entry_by_id used before the index existed
+*   Ret:    index
+*   Ref:    None
+********************************************************************************/
+static int linear_find_by_id(uint16_t id)
+{
+    int index;
+
+    for(index = 0; index < router_current()->num_entries; index++) {
+        if(router_current()->routing_table.entry[index].id == id) {
+            return index;
+        }
+    }
+
+    return FAILURE;
+}
+
+int main(int argc, char **argv)
+{
+    int packets = 200;
+    int size_index, index, lookups;
+    int sock_in, sock_out, saved_stdout, devnull;
+    volatile int sink = 0;
+    struct sockaddr_in bound, to;
+    socklen_t bound_len = sizeof(bound);
+    char *packet;
+    size_t packet_len;
+    double start, linear_ns, indexed_ns, addr_ns, packet_ns, quiet_ns;
+
+    if(argc > 1) {
+        packets = atoi(argv[1]);
+    }
+
+    strcpy(LOGFILE, "/dev/null");
+    router_current()->id = BENCH_SELF_ID;
+    router_current()->ip_addr = inet_addr("127.0.0.1");
+
+    sock_in = new_sockin(0);
+    getsockname(sock_in, (struct sockaddr*) &bound, &bound_len);
+    sock_out = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = inet_addr("127.0.0.1");
+    to.sin_port = bound.sin_port;
+
+    packet = (char*) malloc(MAX_DATAGRAM_SIZE);
+    devnull = open("/dev/null", O_WRONLY);
+
+    printf("%-10s%-16s%-16s%-16s%-16s%-16s\n", "entries", "linear ns/op", "id ns/op", "addr ns/op", "us/packet", "quiet us/packet");
+
+    for(size_index = 0; size_index < (int) (sizeof(table_sizes)/sizeof(table_sizes[0])); size_index++) {
+
+        fill_table(table_sizes[size_index], ntohs(bound.sin_port));
+        router_current()->port = router_current()->routing_table.entry[0].port;
+        lookups = 2000000;
+
+        start = now_ns();
+        for(index = 0; index < lookups / 100; index++) {
+            sink += linear_find_by_id((index % router_current()->num_entries) + 1);
+        }
+        linear_ns = (now_ns() - start) / (lookups / 100);
+
+        start = now_ns();
+        for(index = 0; index < lookups; index++) {
+            sink += find_entry_by_id((index % router_current()->num_entries) + 1);
+        }
+        indexed_ns = (now_ns() - start) / lookups;
+
+        start = now_ns();
+        for(index = 0; index < lookups; index++) {
+            struct destination *row = &router_current()->routing_table.entry[index % router_current()->num_entries];
+            sink += find_entry_by_ip(row->ip_addr, row->port);
+        }
+        addr_ns = (now_ns() - start) / lookups;
+
+        // Route stdout away while the receive path logs every entry
+        packet_len = build_packet(packet);
+        fflush(stdout);
+        saved_stdout = dup(STDOUT_FILENO);
+        dup2(devnull, STDOUT_FILENO);
+
+        packet_ns = 0;
+        for(index = 0; index < packets; index++) {
+            sendto(sock_out, packet, packet_len, 0, (struct sockaddr*) &to, sizeof(to));
+            start = now_ns();
+            get_message_and_update(sock_in);
+            packet_ns += now_ns() - start;
+        }
+
+        log_level = LOG_LEVEL_INFO;
+        quiet_ns = 0;
+        for(index = 0; index < packets; index++) {
+            sendto(sock_out, packet, packet_len, 0, (struct sockaddr*) &to, sizeof(to));
+            start = now_ns();
+            get_message_and_update(sock_in);
+            quiet_ns += now_ns() - start;
+        }
+        log_level = LOG_LEVEL_DEBUG;
+
+        fflush(stdout);
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+
+        printf("%-10d%-16.1f%-16.1f%-16.1f%-16.1f%-16.1f\n", router_current()->num_entries, linear_ns, indexed_ns, addr_ns, packet_ns / packets / 1e3, quiet_ns / packets / 1e3);
+    }
+
+    free(packet);
+    close(devnull);
+    close(sock_out);
+    close(sock_in);
+    return sink == 42 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
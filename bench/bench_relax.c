@@ -0,0 +1,139 @@
+/********************************************************************************
+*   FILE:   bench_relax.c
+*   DESC:   Times the scalar, SSE4.1 and AVX2 relaxation kernels over
+*           synthetic cost columns from 1k to 1M rows and checks that they
+*           all agree with the scalar one. Router ids cap a live table at
+*           65535 rows; the larger sizes only show how the kernels scale.
+*
+*   Build:  gcc -O2 -pthread -o bench_relax bench/bench_relax.c \
+*               $(find src -name '*.c' ! -name '*assignment3.c')
+*   Usage:  ./bench_relax [passes]
+********************************************************************************/
+#include <time.h>
+#include "../src/header.h"
+
+#define BENCH_VIA 7
+#define BENCH_LINK 3
+
+static const int table_sizes[] = { 1000, 16000, 65535, 262144, 1048576 };
+
+static const struct {
+    const char *name;
+    relax_kernel kernel;
+    const char *feature;
+} kernels[] = {
+    { "scalar", relax_vector_scalar, NULL },
+    { "sse4.1", relax_vector_sse41, "sse4.1" },
+    { "avx2",   relax_vector_avx2,   "avx2" },
+};
+
+/********************************************************************************
+*   Name:   now_ns
+*   Desc:   monotonic clock in nanoseconds
+*   Ret:    nanoseconds
+*   Ref:    None
+********************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/********************************************************************************
+*   Name:   supported
+*   Desc:   whether this CPU can run a kernel
+*   Ret:    TRUE or FALSE
+*   Ref:    None
+********************************************************************************/
+static int supported(const char *feature)
+{
+    if(NULL == feature) {
+        return TRUE;
+    }
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if((0 == strcmp(feature, "avx2") && __builtin_cpu_supports("avx2")) ||
+       (0 == strcmp(feature, "sse4.1") && __builtin_cpu_supports("sse4.1"))) {
+        return TRUE;
+    }
+#endif
+    return FALSE;
+}
+
+int main(int argc, char **argv)
+{
+    uint16_t *vector, *cost, *base_cost, *ref_cost;
+    uint16_t *nexthop, *base_nexthop, *ref_nexthop;
+    uint32_t *changed, *reselect, *ref_changed, *ref_reselect;
+    double start, elapsed;
+    int passes = argc > 1 ? atoi(argv[1]) : 20;
+    int size_index, kernel_index, pass, rows, row, words, agree;
+
+    printf("%10s %8s %12s %12s %8s\n", "rows", "kernel", "ns/pass", "ns/row", "agree");
+
+    for(size_index = 0; size_index < (int) (sizeof(table_sizes)/sizeof(table_sizes[0])); size_index++) {
+
+        rows = table_sizes[size_index];
+        words = (rows + 15) / 16;
+
+        vector = (uint16_t*) aligned_resize(NULL, 0, rows*sizeof(uint16_t));
+        cost = (uint16_t*) aligned_resize(NULL, 0, rows*sizeof(uint16_t));
+        base_cost = (uint16_t*) aligned_resize(NULL, 0, rows*sizeof(uint16_t));
+        ref_cost = (uint16_t*) aligned_resize(NULL, 0, rows*sizeof(uint16_t));
+        nexthop = (uint16_t*) aligned_resize(NULL, 0, rows*sizeof(uint16_t));
+        base_nexthop = (uint16_t*) aligned_resize(NULL, 0, rows*sizeof(uint16_t));
+        ref_nexthop = (uint16_t*) aligned_resize(NULL, 0, rows*sizeof(uint16_t));
+        changed = (uint32_t*) calloc(words, sizeof(uint32_t));
+        reselect = (uint32_t*) calloc(words, sizeof(uint32_t));
+        ref_changed = (uint32_t*) calloc(words, sizeof(uint32_t));
+        ref_reselect = (uint32_t*) calloc(words, sizeof(uint32_t));
+
+        // A mix of better, worse, equal and unreachable rows, some already via us
+        srand(rows);
+        for(row = 0; row < rows; row++) {
+            vector[row] = rand() % 16 == 0 ? INF : rand() % 64;
+            base_cost[row] = rand() % 16 == 0 ? INF : rand() % 64;
+            base_nexthop[row] = rand() % 4 == 0 ? BENCH_VIA : rand() % 32;
+        }
+
+        memcpy(ref_cost, base_cost, rows*sizeof(uint16_t));
+        memcpy(ref_nexthop, base_nexthop, rows*sizeof(uint16_t));
+        relax_vector_scalar(vector, BENCH_LINK, BENCH_VIA, ref_cost, ref_nexthop, 0, rows, ref_changed, ref_reselect);
+
+        for(kernel_index = 0; kernel_index < (int) (sizeof(kernels)/sizeof(kernels[0])); kernel_index++) {
+
+            if(supported(kernels[kernel_index].feature) != TRUE) {
+                printf("%10d %8s %12s\n", rows, kernels[kernel_index].name, "unsupported");
+                continue;
+            }
+
+            elapsed = 0;
+            for(pass = 0; pass < passes; pass++) {
+                memcpy(cost, base_cost, rows*sizeof(uint16_t));
+                memcpy(nexthop, base_nexthop, rows*sizeof(uint16_t));
+                memset(changed, 0, words*sizeof(uint32_t));
+                memset(reselect, 0, words*sizeof(uint32_t));
+
+                start = now_ns();
+                kernels[kernel_index].kernel(vector, BENCH_LINK, BENCH_VIA, cost, nexthop, 0, rows, changed, reselect);
+                elapsed += now_ns() - start;
+            }
+
+            agree = 0 == memcmp(cost, ref_cost, rows*sizeof(uint16_t)) &&
+                    0 == memcmp(nexthop, ref_nexthop, rows*sizeof(uint16_t)) &&
+                    0 == memcmp(changed, ref_changed, words*sizeof(uint32_t)) &&
+                    0 == memcmp(reselect, ref_reselect, words*sizeof(uint32_t));
+
+            printf("%10d %8s %12.0f %12.3f %8s\n", rows, kernels[kernel_index].name,
+                    elapsed / passes, elapsed / passes / rows, agree ? "yes" : "NO");
+        }
+
+        free(vector); free(cost); free(base_cost); free(ref_cost);
+        free(nexthop); free(base_nexthop); free(ref_nexthop);
+        free(changed); free(reselect); free(ref_changed); free(ref_reselect);
+    }
+
+    return 0;
+}
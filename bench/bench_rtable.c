@@ -0,0 +1,157 @@
+/********************************************************************************
+*   FILE:   bench_rtable.c
+*   DESC:   Loads a large synthetic topology and reports routing table memory
+*           per entry, and time and cache misses per full update cycle.
+*
+*   Build:  gcc -O2 -pthread -o bench_rtable bench/bench_rtable.c \
+*               $(find src -name '*.c' ! -name '*assignment3.c')
+*   Usage:  ./bench_rtable [num_routers] [cycles]
+********************************************************************************/
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "../src/header.h"
+
+#define BENCH_SELF_IP "127.0.0.1"
+
+/********************************************************************************
+*   Name:   now_ns
+*   Desc:   monotonic clock in nanoseconds
+*   Ret:    nanoseconds
+*   Ref:    None
+********************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/********************************************************************************
+*   Name:   open_cache_miss_counter
+*   Desc:   hardware cache miss counter for this thread, disabled until reset
+*   Ret:    perf fd or -1 where perf events are not available
+*   Ref:    None
+********************************************************************************/
+static int open_cache_miss_counter(void)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+/********************************************************************************
+*   Name:   write_ring_topology
+*   Desc:   writes a topology file with num_routers routers in a ring, as seen
+*           from router 1
+*   Ret:    open file positioned at the start
+*   Ref:    None
+********************************************************************************/
+static FILE *write_ring_topology(int num_routers)
+{
+    FILE *tofile;
+    int index;
+
+    tofile = tmpfile();
+    if(NULL == tofile) {
+        perror("tmpfile");
+        exit(EXIT_FAILURE);
+    }
+
+    fprintf(tofile, "%d\n%d\n", num_routers, 2);
+    fprintf(tofile, "%d %s %d\n", 1, BENCH_SELF_IP, 4000);
+    for(index = 2; index <= num_routers; index++) {
+        fprintf(tofile, "%d 10.%d.%d.%d %d\n", index, (index >> 16) & 0xFF, (index >> 8) & 0xFF, index & 0xFF, 4000);
+    }
+    fprintf(tofile, "%d %d %d\n", 1, 2, 1);
+    fprintf(tofile, "%d %d %d\n", 1, num_routers, 1);
+
+    rewind(tofile);
+    return tofile;
+}
+
+int main(int argc, char **argv)
+{
+    int num_routers = 65535;
+    int cycles = 100;
+    int index;
+    FILE *tofile;
+    double start, load_ns, cycle_ns;
+    long long misses = 0;
+    int perf_fd;
+    size_t msg_size, table_bytes;
+    const char *msg = NULL;
+
+    if(argc > 1) {
+        num_routers = atoi(argv[1]);
+    }
+    if(argc > 2) {
+        cycles = atoi(argv[2]);
+    }
+    // Router ids are 16 bit on the wire and in the topology file
+    if(num_routers < 3 || num_routers > 0xFFFF) {
+        fprintf(stderr, "num_routers must be between 3 and 65535\n");
+        return EXIT_FAILURE;
+    }
+
+    router_current()->ip_addr = inet_addr(BENCH_SELF_IP);
+    tofile = write_ring_topology(num_routers);
+
+    start = now_ns();
+    read_topology(tofile);
+    load_ns = now_ns() - start;
+    fclose(tofile);
+
+    perf_fd = open_cache_miss_counter();
+    if(perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+
+    start = now_ns();
+    for(index = 0; index < cycles; index++) {
+        increment_counters();
+        disable_old_links();
+        msg = get_advertisement(&msg_size);
+        (void) msg;
+    }
+    cycle_ns = (now_ns() - start) / cycles;
+
+    if(perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(perf_fd, &misses, sizeof(misses)) != sizeof(misses)) {
+            misses = 0;
+        }
+        close(perf_fd);
+    }
+
+    table_bytes = router_current()->routing_table.capacity * (sizeof(struct destination) + 2*sizeof(uint16_t))
+                    + router_current()->routing_table.id_slot_size * sizeof(int)
+                    + router_current()->routing_table.addr_slot_size * sizeof(int);
+
+    printf("routers:            %d\n", router_current()->num_entries);
+    printf("table capacity:     %d\n", router_current()->routing_table.capacity);
+    printf("memory per entry:   %.2f bytes\n", (double) table_bytes / router_current()->num_entries);
+    printf("load time:          %.3f ms\n", load_ns / 1e6);
+    printf("hot bytes per row:  %zu\n", 2*sizeof(uint16_t));
+    printf("update cycle:       %.3f us\n", cycle_ns / 1e3);
+    if(perf_fd >= 0) {
+        printf("cache misses/cycle: %.0f\n", (double) misses / cycles);
+    }
+    else {
+        printf("cache misses/cycle: n/a (perf events unavailable)\n");
+    }
+    printf("update message:     %zu bytes\n", msg_size);
+
+    return EXIT_SUCCESS;
+}
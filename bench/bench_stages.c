@@ -0,0 +1,376 @@
+/********************************************************************************
+*   FILE:   bench_stages.c
+*   DESC:   Per-function microbenchmark of one update, stage by stage, on a
+*           live routing table of each size:
+*               encode      prepare_message, the whole table on the wire
+*               decode      store_neighbor_update, an in-memory datagram's
+*                           entries into the neighbor's vector
+*               relax       relax_neighbor after a new vector, every route
+*                           moves
+*               relax_same  relax_neighbor, nothing changed
+*               process     process_update_message, decode plus relax
+*           Each stage is warmed up, then timed as repeated samples of a
+*           batch of calls; percentiles are over the per-call time of each
+*           sample. Hardware counters (cycles, instructions, cache and branch
+*           misses) come from perf_event_open where it is allowed, and are
+*           averaged per call over all samples.
+*
+*           Router ids cap a live table at 65534 rows, so the sizes stop
+*           there.
+*
+*   Build:  gcc -O2 -pthread -o bench_stages bench/bench_stages.c \
+*               $(find src -name '*.c' ! -name '*assignment3.c')
+*   Usage:  ./bench_stages [samples] [warmup ms]
+********************************************************************************/
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "../src/header.h"
+
+#define BENCH_SELF_ID 1
+#define BENCH_NEIGHBOR_ID 2
+#define BENCH_ADDRESS_BASE 0x0A000000   // 10.0.0.0
+#define BENCH_PORT 4000
+#define BENCH_SAMPLE_NS 50000           // batch calls until a sample takes this long
+#define BENCH_MAX_COST 50
+
+enum counter { COUNTER_CYCLES, COUNTER_INSTRUCTIONS, COUNTER_CACHE_MISSES, COUNTER_BRANCH_MISSES, NUM_COUNTERS };
+
+static const int table_sizes[] = { 30, 1000, 16000, 65534 };
+
+static const uint64_t counter_configs[NUM_COUNTERS] = {
+    PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES
+};
+
+static int counter_fds[NUM_COUNTERS];
+
+// Two advertisements from the neighbor, as datagrams and as vectors by
+// row: every cost in the second is one more
+static char *message[2];
+static size_t message_length;
+static uint16_t *vector[2];
+static int vector_length;
+static int flip;
+
+/********************************************************************************
+*   Name:   now_ns
+*   Desc:   monotonic clock in nanoseconds
+*   Ret:    nanoseconds
+*   Ref:    None
+********************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/********************************************************************************
+*   Name:   open_counters
+*   Desc:   opens the hardware counters as one group, disabled; counters the
+*           CPU or the kernel does not allow stay at -1
+*   Ret:    TRUE if at least the group leader opened, FALSE otherwise
+*   Ref:    None
+********************************************************************************/
+static int open_counters(void)
+{
+    struct perf_event_attr attr;
+    int index;
+
+    for(index = 0; index < NUM_COUNTERS; index++) {
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = counter_configs[index];
+        attr.disabled = index == 0;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+
+        counter_fds[index] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, index == 0 ? -1 : counter_fds[0], 0);
+        if(index == 0 && counter_fds[0] == -1) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+/********************************************************************************
+*   Name:   start_counters / stop_counters
+*   Desc:   counts between the two calls; stop_counters adds the counts to
+*           totals, -1 for a counter that is not available
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void start_counters(void)
+{
+    if(counter_fds[0] != -1) {
+        ioctl(counter_fds[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(counter_fds[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+}
+
+static void stop_counters(double *totals)
+{
+    uint64_t value;
+    int index;
+
+    if(counter_fds[0] != -1) {
+        ioctl(counter_fds[0], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    }
+    for(index = 0; index < NUM_COUNTERS; index++) {
+        if(counter_fds[index] == -1 || sizeof(value) != read(counter_fds[index], &value, sizeof(value))) {
+            totals[index] = -1;
+        }
+        else {
+            totals[index] = value;
+        }
+    }
+}
+
+/********************************************************************************
+*   Name:   build_router
+*   Desc:   this router, id 1, with rows rows and one neighbor, id 2, and two
+*           advertisements from it that move every route
+*   Ret:    neighbor slot
+*   Ref:    None
+********************************************************************************/
+static int build_router(int rows)
+{
+    struct update_header header;
+    struct updates entry;
+    int id, which;
+    uint16_t cost;
+
+    router_current()->id = BENCH_SELF_ID;
+    router_current()->ip_addr = htonl(BENCH_ADDRESS_BASE + BENCH_SELF_ID);
+    router_current()->port = BENCH_PORT;
+
+    grow_routing_table(rows);
+    for(id = 1; id <= rows; id++) {
+        if(id == BENCH_SELF_ID) {
+            append_routing_table_entry(id, router_current()->ip_addr, BENCH_PORT, 0, router_current()->id);
+        }
+        else {
+            append_routing_table_entry(id, htonl(BENCH_ADDRESS_BASE + id), BENCH_PORT, INF, INVALID_ROUTER_ID);
+        }
+    }
+    sort_routing_table();
+    update_link_routing_table_entry(BENCH_NEIGHBOR_ID, router_current()->id, 1);
+
+    message_length = sizeof(struct update_header) + rows*sizeof(struct updates);
+    for(which = 0; which < 2; which++) {
+        message[which] = (char*) malloc(message_length);
+        vector[which] = (uint16_t*) malloc(rows*sizeof(uint16_t));
+        if(NULL == message[which] || NULL == vector[which]) {
+            fprintf(stderr, "Failed to allocate advertisements\n");
+            exit(EXIT_FAILURE);
+        }
+
+        header.num_updates = htons(rows);
+        header.source_port = htons(BENCH_PORT);
+        header.source_ip_addr = htonl(BENCH_ADDRESS_BASE + BENCH_NEIGHBOR_ID);
+        memcpy(message[which], &header, sizeof(header));
+
+        srand(rows);
+        for(id = 1; id <= rows; id++) {
+            cost = id == BENCH_NEIGHBOR_ID ? 0 : 1 + rand() % BENCH_MAX_COST + which;
+            entry.ip_addr = htonl(BENCH_ADDRESS_BASE + id);
+            entry.port = htons(BENCH_PORT);
+            entry.pad = 0;
+            entry.id = htons(id);
+            entry.cost = htons(cost);
+            memcpy(message[which] + sizeof(header) + (id-1)*sizeof(entry), &entry, sizeof(entry));
+            vector[which][find_entry_by_id(id)] = cost;
+        }
+    }
+    vector_length = rows;
+
+    return find_neighbor(BENCH_NEIGHBOR_ID);
+}
+
+/********************************************************************************
+*   Name:   stage functions
+*   Desc:   one call of each measured stage
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void stage_encode(int slot)
+{
+    size_t size;
+
+    (void) slot;
+
+    free(prepare_message(&size));
+}
+
+static void stage_decode(int slot)
+{
+    store_neighbor_update(slot, message[0] + sizeof(struct update_header), vector_length);
+}
+
+static void stage_relax(int slot)
+{
+    flip ^= 1;
+    memcpy(router_current()->neighbors[slot].vector, vector[flip], vector_length*sizeof(uint16_t));
+    relax_neighbor(slot);
+}
+
+static void stage_relax_same(int slot)
+{
+    relax_neighbor(slot);
+}
+
+static void stage_process(int slot)
+{
+    (void) slot;
+
+    flip ^= 1;
+    process_update_message(message[flip], message_length);
+}
+
+static const struct {
+    const char *name;
+    void (*run)(int slot);
+} stages[] = {
+    { "encode",     stage_encode },
+    { "decode",     stage_decode },
+    { "relax",      stage_relax },
+    { "relax_same", stage_relax_same },
+    { "process",    stage_process },
+};
+
+/********************************************************************************
+*   Name:   compare_doubles
+*   Desc:   qsort order
+*   Ret:    <0, 0, >0
+*   Ref:    None
+********************************************************************************/
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+
+    return (x > y) - (x < y);
+}
+
+/********************************************************************************
+*   Name:   percentile
+*   Desc:   nearest rank percentile of sorted samples
+*   Ret:    the sample
+*   Ref:    None
+********************************************************************************/
+static double percentile(const double *sorted, int count, double p)
+{
+    int rank = (int) (p / 100 * count + 0.5);
+
+    if(rank < 1) {
+        rank = 1;
+    }
+    if(rank > count) {
+        rank = count;
+    }
+    return sorted[rank-1];
+}
+
+/********************************************************************************
+*   Name:   run_stage
+*   Desc:   warms a stage up, sizes its batch, then times samples
+*   Ret:    Nothing; prints one line
+*   Ref:    None
+********************************************************************************/
+static void run_stage(int rows, int stage, int slot, int num_samples, double warmup_ms, double *samples)
+{
+    double start, elapsed, totals[NUM_COUNTERS], calls;
+    long batch = 1, call;
+    int sample, index;
+
+    // Warm up for warmup_ms, then batch enough calls to make one sample
+    // take BENCH_SAMPLE_NS, well above the clock's resolution
+    start = now_ns();
+    for(call = 0; (elapsed = now_ns() - start) < warmup_ms * 1e6; call++) {
+        stages[stage].run(slot);
+    }
+    if(call > 0 && elapsed / call < BENCH_SAMPLE_NS) {
+        batch = (long) (BENCH_SAMPLE_NS / (elapsed / call)) + 1;
+    }
+
+    start_counters();
+    for(sample = 0; sample < num_samples; sample++) {
+        start = now_ns();
+        for(call = 0; call < batch; call++) {
+            stages[stage].run(slot);
+        }
+        samples[sample] = (now_ns() - start) / batch;
+    }
+    stop_counters(totals);
+    calls = (double) batch * num_samples;
+
+    qsort(samples, num_samples, sizeof(double), compare_doubles);
+    printf("%8d %-11s %8ld %11.0f %11.0f %11.0f %11.0f %8.2f", rows, stages[stage].name, batch,
+            percentile(samples, num_samples, 50), percentile(samples, num_samples, 90),
+            percentile(samples, num_samples, 99), samples[num_samples-1],
+            percentile(samples, num_samples, 50) / rows);
+    for(index = 0; index < NUM_COUNTERS; index++) {
+        if(totals[index] < 0) {
+            printf(" %11s", "-");
+        }
+        else {
+            printf(" %11.0f", totals[index] / calls);
+        }
+    }
+    if(totals[COUNTER_CYCLES] > 0 && totals[COUNTER_INSTRUCTIONS] >= 0) {
+        printf(" %6.2f\n", totals[COUNTER_INSTRUCTIONS] / totals[COUNTER_CYCLES]);
+    }
+    else {
+        printf(" %6s\n", "-");
+    }
+}
+
+int main(int argc, char **argv)
+{
+    struct router router;
+    struct router *previous;
+    double *samples;
+    int num_samples = argc > 1 ? atoi(argv[1]) : 200;
+    double warmup_ms = argc > 2 ? atof(argv[2]) : 50;
+    int size_index, stage, slot;
+
+    if(num_samples < 1 || warmup_ms < 0) {
+        fprintf(stderr, "Usage: %s [samples] [warmup ms]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    samples = (double*) malloc(num_samples*sizeof(double));
+    if(NULL == samples) {
+        return EXIT_FAILURE;
+    }
+
+    // The receive path logs at INFO; keep it out of the timings
+    log_level = LOG_LEVEL_ERROR;
+
+    if(open_counters() != TRUE) {
+        printf("hardware counters unavailable (perf_event_open: %s)\n", strerror(errno));
+    }
+    printf("%8s %-11s %8s %11s %11s %11s %11s %8s %11s %11s %11s %11s %6s\n", "rows", "stage", "batch",
+            "p50 ns", "p90 ns", "p99 ns", "max ns", "ns/row", "cycles", "instr", "cache miss", "br miss", "ipc");
+
+    for(size_index = 0; size_index < (int) (sizeof(table_sizes)/sizeof(table_sizes[0])); size_index++) {
+
+        router_init(&router);
+        previous = router_select(&router);
+        slot = build_router(table_sizes[size_index]);
+
+        for(stage = 0; stage < (int) (sizeof(stages)/sizeof(stages[0])); stage++) {
+            run_stage(table_sizes[size_index], stage, slot, num_samples, warmup_ms, samples);
+        }
+
+        router_select(previous);
+        router_free(&router);
+        free(message[0]); free(message[1]);
+        free(vector[0]); free(vector[1]);
+    }
+
+    free(samples);
+    return EXIT_SUCCESS;
+}
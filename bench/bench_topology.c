@@ -0,0 +1,121 @@
+/********************************************************************************
+*   FILE:   bench_topology.c
+*   DESC:   Topology parse throughput: the old fscanf / sprintf / inet_addr
+*           loop, the mmap parser alone, and a full read_topology load into
+*           the routing table.
+*
+*   Build:  gcc -O2 -pthread -o bench_topology bench/bench_topology.c \
+*               $(find src -name '*.c' ! -name '*assignment3.c')
+*   Usage:  ./bench_topology <topology file>
+*           (make one with bench/gen_topology.c, e.g. 1000000 routers)
+********************************************************************************/
+#include <sys/stat.h>
+#include <time.h>
+#include "../src/header.h"
+
+/********************************************************************************
+*   Name:   now_ns
+*   Desc:   monotonic clock in nanoseconds
+*   Ret:    nanoseconds
+*   Ref:    None
+********************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/********************************************************************************
+*   Name:   old_parse
+*   Desc:   the previous read_topology's parsing, without the table updates
+*   Ret:    checksum of what was parsed
+*   Ref:    None
+********************************************************************************/
+static uint32_t old_parse(FILE *tofile)
+{
+    int index, num_routers, num_neighbors;
+    int router_ip1, router_ip2, router_ip3, router_ip4;
+    char router_ip[16];
+    uint16_t router_id, router_port, router_id1, neighbor_id1, cost1;
+    uint32_t sum = 0;
+
+    fscanf(tofile, "%d\n", &num_routers);
+    fscanf(tofile, "%d\n", &num_neighbors);
+    for(index = 0; index < num_routers; index++) {
+        fscanf(tofile, "%"SCNu16" %d.%d.%d.%d %"SCNu16"\n", &router_id, &router_ip1, &router_ip2, &router_ip3, &router_ip4, &router_port);
+        sprintf(router_ip, "%d.%d.%d.%d", router_ip1, router_ip2, router_ip3, router_ip4);
+        sum += inet_addr(router_ip) + router_id + router_port;
+    }
+    for(index = 0; index < num_neighbors; index++) {
+        fscanf(tofile, "%"SCNu16" %"SCNu16" %"SCNu16"", &router_id1, &neighbor_id1, &cost1);
+        sum += router_id1 + neighbor_id1 + cost1;
+    }
+
+    return sum;
+}
+
+static void sum_router(uint16_t id, uint32_t ip_addr, uint16_t port, void *arg)
+{
+    *(uint32_t*) arg += ip_addr + id + port;
+}
+
+static void sum_link(uint16_t id, uint16_t neighbor_id, uint16_t cost, void *arg)
+{
+    *(uint32_t*) arg += id + neighbor_id + cost;
+}
+
+int main(int argc, char **argv)
+{
+    struct stat st;
+    struct topology_handler summer = { NULL, sum_router, NULL, sum_link, NULL };
+    FILE *tofile;
+    const char *data;
+    size_t size;
+    int mapped;
+    uint32_t old_sum, new_sum = 0;
+    double start, old_ns, parse_ns, load_ns, megabytes;
+
+    if(argc < 2 || 0 != stat(argv[1], &st)) {
+        fprintf(stderr, "Usage: %s <topology file>\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    megabytes = st.st_size / 1e6;
+    router_current()->ip_addr = inet_addr("127.0.0.1");
+
+    // Warm the page cache so every variant reads from memory
+    tofile = fopen(argv[1], "r");
+    old_parse(tofile);
+
+    rewind(tofile);
+    start = now_ns();
+    old_sum = old_parse(tofile);
+    old_ns = now_ns() - start;
+
+    rewind(tofile);
+    start = now_ns();
+    data = map_topology(tofile, &size, &mapped);
+    summer.arg = &new_sum;
+    if(SUCCESS != parse_topology(data, size, &summer)) {
+        return EXIT_FAILURE;
+    }
+    unmap_topology(data, size, mapped);
+    parse_ns = now_ns() - start;
+
+    rewind(tofile);
+    start = now_ns();
+    if(SUCCESS != read_topology(tofile)) {
+        return EXIT_FAILURE;
+    }
+    load_ns = now_ns() - start;
+    fclose(tofile);
+
+    printf("file:               %.1f MB\n", megabytes);
+    printf("fscanf parse:       %.1f ms (%.0f MB/s)\n", old_ns / 1e6, megabytes / (old_ns / 1e9));
+    printf("mmap parse:         %.1f ms (%.0f MB/s)\n", parse_ns / 1e6, megabytes / (parse_ns / 1e9));
+    printf("read_topology:      %.1f ms, %d routers loaded\n", load_ns / 1e6, router_current()->num_entries);
+    printf("parsers agree:      %s\n", old_sum == new_sum ? "yes" : "NO");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,50 @@
+/********************************************************************************
+*   FILE:   gen_topology.c
+*   DESC:   Writes a synthetic topology file as seen from router 1, for load
+*           and parser benchmarks. Router ids are 16 bit, so past 65535
+*           routers the ids wrap and later lines replace earlier ones when
+*           loaded; every line still has a distinct address.
+*
+*   Build:  gcc -O2 -o gen_topology bench/gen_topology.c
+*   Usage:  ./gen_topology <num_routers> <num_neighbors> [self_ip] > topology
+********************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+
+#define GEN_PORT 4000
+#define GEN_MAX_COST 20
+
+int main(int argc, char **argv)
+{
+    const char *self_ip = "127.0.0.1";
+    long num_routers, num_neighbors, index;
+    unsigned long address;
+
+    if(argc < 3) {
+        fprintf(stderr, "Usage: %s <num_routers> <num_neighbors> [self_ip]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    num_routers = atol(argv[1]);
+    num_neighbors = atol(argv[2]);
+    if(argc > 3) {
+        self_ip = argv[3];
+    }
+    if(num_routers < 1 || num_neighbors < 0 || num_neighbors >= num_routers) {
+        fprintf(stderr, "Need at least one router and fewer neighbors than routers\n");
+        return EXIT_FAILURE;
+    }
+
+    srand(1);
+    printf("%ld\n%ld\n", num_routers, num_neighbors);
+    printf("%d %s %d\n", 1, self_ip, GEN_PORT);
+    for(index = 2; index <= num_routers; index++) {
+        address = 0x0A000000UL + index;
+        printf("%ld %lu.%lu.%lu.%lu %d\n", (index - 1) % 65535 + 1,
+                (address >> 24) & 0xFF, (address >> 16) & 0xFF, (address >> 8) & 0xFF, address & 0xFF, GEN_PORT);
+    }
+    for(index = 0; index < num_neighbors; index++) {
+        printf("%d %ld %d\n", 1, index % 65534 + 2, rand() % GEN_MAX_COST + 1);
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,194 @@
+/********************************************************************************
+*   FILE:   simulate.c
+*   DESC:   Runs a whole network of routers in one process over the
+*           simulator's in-memory transport and reports how long routing
+*           takes to converge and how many messages it costs. The network is
+*           a ring, so it is connected, plus random chords up to the average
+*           degree, with link costs 1..10. Degree 1 gives a line instead.
+*
+*           With -k the given router is cut off after the first convergence.
+*           Routers then count their routes to it up to infinity (INF) unless
+*           something stops them: on a line, poisoned reverse does, so compare
+*           -d 1 with -p 1 and -p 0. Loops of three or more routers count
+*           either way; -m bounds the run.
+*
+*   Build:  gcc -O2 -pthread -o simulate bench/simulate.c \
+*               $(find src -name '*.c' ! -name '*assignment3.c')
+*   Usage:  ./simulate [-n routers] [-d degree] [-i interval s]
+*                      [-l min delay ms] [-L max delay ms] [-x loss %]
+*                      [-p 0|1 poisoned reverse] [-t triggered updates]
+*                      [-h triggered update hold-down ms]
+*                      [-k router to cut off] [-m max simulated s] [-s seed]
+*                      [-v 1|2 wire version]
+********************************************************************************/
+#include <time.h>
+#include "../src/header.h"
+
+#define SIM_MAX_COST 10
+#define SIM_SETTLE_INTERVALS 5          // quiet intervals that count as converged
+
+/********************************************************************************
+*   Name:   now_ns
+*   Desc:   monotonic clock in nanoseconds
+*   Ret:    nanoseconds
+*   Ref:    None
+********************************************************************************/
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e9 + ts.tv_nsec;
+}
+
+/********************************************************************************
+*   Name:   make_network
+*   Desc:   ring (or line) plus random chords up to max_links, no duplicate
+*           links
+*   Ret:    number of links written to links
+*   Ref:    None
+********************************************************************************/
+static int make_network(int num_routers, int line, struct sim_link *links, int max_links)
+{
+    int num_links = 0, index, other, attempts;
+    int a, b;
+
+    for(index = 1; index <= num_routers; index++) {
+        // A line stops short of closing the ring; so does a pair
+        if((line == TRUE || num_routers == 2) && index == num_routers) {
+            break;
+        }
+        links[num_links].a = index;
+        links[num_links].b = index % num_routers + 1;
+        links[num_links].cost = 1 + rand() % SIM_MAX_COST;
+        num_links++;
+    }
+
+    for(attempts = 0; num_links < max_links && attempts < 4*max_links; attempts++) {
+        a = 1 + rand() % num_routers;
+        b = 1 + rand() % num_routers;
+        if(a == b) {
+            continue;
+        }
+        for(other = 0; other < num_links; other++) {
+            if((links[other].a == a && links[other].b == b) || (links[other].a == b && links[other].b == a)) {
+                break;
+            }
+        }
+        if(other < num_links) {
+            continue;
+        }
+        links[num_links].a = a;
+        links[num_links].b = b;
+        links[num_links].cost = 1 + rand() % SIM_MAX_COST;
+        num_links++;
+    }
+
+    return num_links;
+}
+
+/********************************************************************************
+*   Name:   print_phase
+*   Desc:   one line of results
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void print_phase(const char *phase, const struct sim_stats *stats, int wrong, double wall_ns)
+{
+    printf("%-18s%-11s%-12.0f%-12lu%-14lu%-10lu%-10lu%-8d%-10.0f\n", phase, stats->converged == TRUE ? "yes" : "no",
+            stats->converged_ms, stats->messages, stats->bytes, stats->dropped, stats->route_changes, wrong, wall_ns / 1e6);
+}
+
+int main(int argc, char **argv)
+{
+    struct sim_config config = { 1, 5, 20, 0, FALSE, HOLDDOWN_DEFAULT, 1, WIRE_V1 };
+    struct simulation *sim;
+    struct sim_stats stats;
+    struct sim_link *links;
+    int num_routers = 1000, degree = 4, cut = 0, num_links, max_links, index, ch;
+    double max_s = 3600, loss_percent = 0, start;
+    char phase[32];
+
+    while((ch = getopt(argc, argv, "n:d:i:l:L:x:p:th:k:m:s:v:")) != -1) {
+        switch(ch) {
+            case 'n': num_routers = atoi(optarg); break;
+            case 'd': degree = atoi(optarg); break;
+            case 'i': config.interval_sec = atol(optarg); break;
+            case 'l': config.delay_min_ms = atof(optarg); break;
+            case 'L': config.delay_max_ms = atof(optarg); break;
+            case 'x': loss_percent = atof(optarg); break;
+            case 'p': poisoned_reverse = atoi(optarg) ? TRUE : FALSE; break;
+            case 't': config.triggered = TRUE; break;
+            case 'h': config.holddown_ms = atol(optarg); break;
+            case 'k': cut = atoi(optarg); break;
+            case 'm': max_s = atof(optarg); break;
+            case 's': config.seed = strtoul(optarg, NULL, 10); break;
+            case 'v': config.wire_version = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-n routers] [-d degree] [-i interval s] [-l min delay ms] [-L max delay ms]"
+                        " [-x loss %%] [-p 0|1] [-t] [-h hold-down ms] [-k router] [-m max s] [-s seed] [-v 1|2]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if(num_routers < 2 || degree < 1 || config.interval_sec <= 0 || config.delay_max_ms < config.delay_min_ms || config.holddown_ms < 0 || cut > num_routers ||
+       (config.wire_version != WIRE_V1 && config.wire_version != WIRE_V2)) {
+        fprintf(stderr, "Need 2 or more routers, degree 1 or more, a positive interval, min delay <= max delay and wire version 1 or 2\n");
+        return EXIT_FAILURE;
+    }
+    config.loss = loss_percent / 100;
+
+    // Only errors; the per-packet lines would dominate the run
+    log_level = LOG_LEVEL_ERROR;
+
+    srand(config.seed);
+    max_links = (long) num_routers * degree / 2;
+    if(degree == 1) {
+        max_links = num_routers - 1;
+    }
+    else if(max_links < num_routers) {
+        max_links = num_routers;
+    }
+    links = (struct sim_link*) malloc(max_links*sizeof(struct sim_link));
+    if(NULL == links) {
+        return EXIT_FAILURE;
+    }
+    num_links = make_network(num_routers, degree == 1 ? TRUE : FALSE, links, max_links);
+
+    start = now_ns();
+    sim = sim_create(&config, num_routers, links, num_links);
+    if(NULL == sim) {
+        return EXIT_FAILURE;
+    }
+
+    printf("routers %d, links %d, interval %ld s, delay %.0f-%.0f ms, loss %.1f%%, wire v%d, poisoned reverse %s, triggered updates ",
+            num_routers, num_links, config.interval_sec, config.delay_min_ms, config.delay_max_ms, loss_percent,
+            config.wire_version, poisoned_reverse == TRUE ? "on" : "off");
+    if(config.triggered == TRUE) {
+        printf("every %ld ms\n", config.holddown_ms);
+    }
+    else {
+        printf("off\n");
+    }
+    printf("setup %.0f ms\n", (now_ns() - start) / 1e6);
+    printf("%-18s%-11s%-12s%-12s%-14s%-10s%-10s%-8s%-10s\n", "phase", "converged", "sim ms", "messages", "bytes", "dropped", "changes", "wrong", "wall ms");
+
+    start = now_ns();
+    sim_run(sim, SIM_SETTLE_INTERVALS * config.interval_sec * 1000.0, max_s * 1000, &stats);
+    print_phase("initial", &stats, sim_check_routes(sim), now_ns() - start);
+
+    if(cut > 0) {
+        for(index = 0; index < num_links; index++) {
+            if(links[index].a == cut || links[index].b == cut) {
+                sim_set_link(sim, links[index].a, links[index].b, INF);
+            }
+        }
+        start = now_ns();
+        sim_run(sim, SIM_SETTLE_INTERVALS * config.interval_sec * 1000.0, max_s * 1000, &stats);
+        snprintf(phase, sizeof(phase), "cut off %d", cut);
+        print_phase(phase, &stats, sim_check_routes(sim), now_ns() - start);
+    }
+
+    sim_free(sim);
+    free(links);
+    return EXIT_SUCCESS;
+}
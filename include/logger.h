@@ -10,6 +10,7 @@ extern int ret_print, ret_log;
 
 void cse4589_init_log();
 void cse4589_print_and_log(char* format, ...);
+void cse4589_flush_log();
 int cse4589_dump_packet(const void* packet, size_t length);
 
 #endif
@@ -0,0 +1,306 @@
+/********************************************************************************
+*   FILE:   capture.c
+*   DESC:   Optional capture of every sent and received update datagram into
+*           a fixed-size memory mapped pcap file (raw IPv4, microsecond
+*           timestamps). Writes are plain memory copies, so capturing never
+*           blocks the event loop, and the mapping is shared with the page
+*           cache, so the file is complete even if the router crashes or is
+*           killed.
+*
+*           The file is used as a ring but stays a valid pcap at every record
+*           boundary:
+*
+*               [pcap header][newest records][filler][oldest records][filler]
+*
+*           A filler is an IPv4 packet with the experimental protocol number
+*           that covers the gap between the newest record and the next intact
+*           older one. Records after a wrap are out of time order;
+*           "reordercap" or sorting by time in a viewer restores it.
+********************************************************************************/
+#include <fcntl.h>
+#include <sys/mman.h>
+#include "header.h"
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAP_LINKTYPE_RAW 101
+#define IP_HEADER_LEN 20
+#define UDP_HEADER_LEN 8
+#define FILLER_PROTOCOL 253             // RFC 3692 experimental, never real traffic
+
+struct pcap_file_header {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+};
+
+struct pcap_record_header {
+    uint32_t ts_sec;
+    uint32_t ts_usec;
+    uint32_t incl_len;
+    uint32_t orig_len;
+};
+
+#define RECORD_OVERHEAD (sizeof(struct pcap_record_header) + IP_HEADER_LEN)
+#define FILLER_MIN RECORD_OVERHEAD
+#define FILLER_GRID 32768               // long gaps are chained fillers ending on this grid
+
+static char *ring = NULL;
+static size_t ring_size = 0;
+static size_t write_pos = 0;            // end of the newest record
+static size_t old_pos = 0;              // first intact older record, ring_size if none
+static int wrapped = FALSE;             // TRUE once the ring has been filled once
+
+/********************************************************************************
+*   Name:   ip_checksum
+*   Desc:   internet checksum of an IPv4 header
+*   Ret:    checksum in network order
+*   Ref:    RFC 1071
+********************************************************************************/
+static uint16_t ip_checksum(const unsigned char *header)
+{
+    uint32_t sum = 0;
+    int index;
+
+    for(index = 0; index < IP_HEADER_LEN; index += 2) {
+        sum += (header[index] << 8) | header[index+1];
+    }
+    while(sum >> 16) {
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    }
+
+    return htons((uint16_t) ~sum);
+}
+
+/********************************************************************************
+*   Name:   write_ip_header
+*   Desc:   writes an IPv4 header; addresses are in network order
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void write_ip_header(unsigned char *header, size_t total_len, uint8_t protocol, uint32_t src, uint32_t dst)
+{
+    uint16_t value;
+
+    memset(header, 0, IP_HEADER_LEN);
+    header[0] = 0x45;
+    value = htons((uint16_t) total_len);
+    memcpy(header+2, &value, sizeof(value));
+    header[8] = 64;
+    header[9] = protocol;
+    memcpy(header+12, &src, sizeof(src));
+    memcpy(header+16, &dst, sizeof(dst));
+    value = ip_checksum(header);
+    memcpy(header+10, &value, sizeof(value));
+}
+
+/********************************************************************************
+*   Name:   write_record_header
+*   Desc:   writes a pcap record header at a ring offset
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void write_record_header(size_t pos, const struct timeval *tv, size_t len)
+{
+    struct pcap_record_header record;
+
+    record.ts_sec = (uint32_t) tv->tv_sec;
+    record.ts_usec = (uint32_t) tv->tv_usec;
+    record.incl_len = (uint32_t) len;
+    record.orig_len = (uint32_t) len;
+    memcpy(ring+pos, &record, sizeof(record));
+}
+
+/********************************************************************************
+*   Name:   write_filler
+*   Desc:   covers [pos, end) with filler packets. The gap is either empty or
+*           at least FILLER_MIN bytes. Long gaps are split on FILLER_GRID so
+*           no record exceeds what pcap readers accept; when the rest of the
+*           chain is already in place only its first link is rewritten.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void write_filler(size_t pos, size_t end, const struct timeval *tv, int chain_intact)
+{
+    size_t next, len;
+
+    while(pos < end) {
+
+        next = (pos + FILLER_MIN + FILLER_GRID - 1) / FILLER_GRID * FILLER_GRID;
+        if(next >= end || end - next < FILLER_MIN) {
+            next = end;
+        }
+
+        // Filler bytes beyond the IP header keep whatever older data was there
+        len = next - pos - sizeof(struct pcap_record_header);
+        write_ip_header((unsigned char*) ring + pos + sizeof(struct pcap_record_header), len > 0xFFFF ? 0xFFFF : len, FILLER_PROTOCOL, 0, 0);
+        write_record_header(pos, tv, len);
+
+        if(chain_intact == TRUE) {
+            return;
+        }
+        pos = next;
+    }
+}
+
+/********************************************************************************
+*   Name:   record_size
+*   Desc:   size of the record at a ring offset, header included
+*   Ret:    bytes
+*   Ref:    None
+********************************************************************************/
+static size_t record_size(size_t pos)
+{
+    struct pcap_record_header record;
+
+    memcpy(&record, ring+pos, sizeof(record));
+    return sizeof(record) + record.incl_len;
+}
+
+/********************************************************************************
+*   Name:   capture_open
+*   Desc:   creates (or truncates) the capture file at a fixed size and maps it
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+int capture_open(const char *path, size_t size)
+{
+    struct pcap_file_header header;
+    struct timeval tv;
+    int fd;
+
+    if(size < sizeof(header) + FILLER_MIN + RECORD_OVERHEAD + UDP_HEADER_LEN + MAX_DATAGRAM_SIZE) {
+        fprintf(stderr, "Capture file too small\n");
+        return FAILURE;
+    }
+
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if(-1 == fd) {
+        perror("open");
+        return FAILURE;
+    }
+    if(-1 == ftruncate(fd, size)) {
+        perror("ftruncate");
+        close(fd);
+        return FAILURE;
+    }
+
+    ring = (char*) mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(MAP_FAILED == ring) {
+        perror("mmap");
+        ring = NULL;
+        return FAILURE;
+    }
+    ring_size = size;
+
+    header.magic = PCAP_MAGIC;
+    header.version_major = 2;
+    header.version_minor = 4;
+    header.thiszone = 0;
+    header.sigfigs = 0;
+    header.snaplen = IP_HEADER_LEN + UDP_HEADER_LEN + MAX_DATAGRAM_SIZE;
+    header.linktype = PCAP_LINKTYPE_RAW;
+    memcpy(ring, &header, sizeof(header));
+
+    write_pos = sizeof(header);
+    old_pos = ring_size;
+    wrapped = FALSE;
+    gettimeofday(&tv, NULL);
+    write_filler(write_pos, old_pos, &tv, FALSE);
+
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   capture_enabled
+*   Desc:   whether datagrams are being captured
+*   Ret:    TRUE or FALSE
+*   Ref:    None
+********************************************************************************/
+int capture_enabled()
+{
+    return NULL == ring ? FALSE : TRUE;
+}
+
+/********************************************************************************
+*   Name:   capture_datagram
+*   Desc:   appends one UDP datagram, gathered from iov, to the capture ring.
+*           Addresses are as they would appear in a sockaddr_in.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void capture_datagram(const struct sockaddr_in *from, const struct sockaddr_in *to, const struct iovec *iov, size_t iovlen)
+{
+    struct timeval tv;
+    unsigned char *packet;
+    size_t payload = 0, len, end, pos, index;
+    uint16_t value;
+
+    if(NULL == ring) {
+        return;
+    }
+
+    for(index = 0; index < iovlen; index++) {
+        payload += iov[index].iov_len;
+    }
+    if(payload > MAX_DATAGRAM_SIZE) {
+        return;
+    }
+    len = RECORD_OVERHEAD + UDP_HEADER_LEN + payload;
+
+    gettimeofday(&tv, NULL);
+
+    // Wrap when the record, plus room for a filler behind it, does not fit
+    end = write_pos + len;
+    if(end != ring_size && end + FILLER_MIN > ring_size) {
+        write_filler(write_pos, ring_size, &tv, FALSE);
+        write_pos = sizeof(struct pcap_file_header);
+        old_pos = write_pos;
+        wrapped = TRUE;
+        end = write_pos + len;
+    }
+
+    // Overwrite whole older records until the leftover gap can hold a filler
+    while(old_pos < ring_size && (old_pos < end || (old_pos > end && old_pos - end < FILLER_MIN))) {
+        old_pos += record_size(old_pos);
+    }
+    // Until the first wrap, the filler chain written by capture_open is intact past end
+    write_filler(end, old_pos, &tv, wrapped == FALSE ? TRUE : FALSE);
+
+    packet = (unsigned char*) ring + write_pos + sizeof(struct pcap_record_header);
+    write_ip_header(packet, len - sizeof(struct pcap_record_header), IPPROTO_UDP, from->sin_addr.s_addr, to->sin_addr.s_addr);
+    packet += IP_HEADER_LEN;
+
+    memcpy(packet, &from->sin_port, sizeof(from->sin_port));
+    memcpy(packet+2, &to->sin_port, sizeof(to->sin_port));
+    value = htons((uint16_t) (UDP_HEADER_LEN + payload));
+    memcpy(packet+4, &value, sizeof(value));
+    memset(packet+6, 0, sizeof(uint16_t));          // no UDP checksum
+    pos = UDP_HEADER_LEN;
+    for(index = 0; index < iovlen; index++) {
+        memcpy(packet+pos, iov[index].iov_base, iov[index].iov_len);
+        pos += iov[index].iov_len;
+    }
+
+    // Header last, so a half-copied record is never announced
+    write_record_header(write_pos, &tv, len - sizeof(struct pcap_record_header));
+    write_pos = end;
+}
+
+/********************************************************************************
+*   Name:   capture_local_address
+*   Desc:   this router's address, for captured datagrams
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void capture_local_address(struct sockaddr_in *local)
+{
+    memset(local, 0, sizeof(*local));
+    local->sin_family = AF_INET;
+    local->sin_addr.s_addr = router_current()->ip_addr;
+    local->sin_port = router_current()->port;
+}
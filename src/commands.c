@@ -11,7 +11,7 @@
 *   Ref:    None
 ********************************************************************************/
 void update(uint16_t id1, uint16_t id2, uint16_t cost) {
-    cse4589_print_and_log("%s:SUCCESS\n", "update");"
+    LOG_INFO("%s:SUCCESS\n", "update");
 	update_link_routing_table_entry(id2, id1, cost);
 }
 
@@ -22,7 +22,7 @@ void update(uint16_t id1, uint16_t id2, uint16_t cost) {
 *   Ref:    None
 ********************************************************************************/
 void step() {
-    cse4589_print_and_log("%s:SUCCESS\n", "step");
+    LOG_INFO("%s:SUCCESS\n", "step");
 	send_message_to_neighbors();
 }
 
@@ -33,9 +33,9 @@ void step() {
 *   Ref:    None
 ********************************************************************************/
 void packets() {
-    cse4589_print_and_log("%s:SUCCESS\n", "packets");
-	cse4589_print_and_log("%d\n", num_packets);
-	num_packets = 0;
+    LOG_INFO("%s:SUCCESS\n", "packets");
+	LOG_INFO("%d\n", router_current()->num_packets);
+	router_current()->num_packets = 0;
 }
 
 /********************************************************************************
@@ -47,9 +47,9 @@ void packets() {
 void display() {
 	int index;
 
-	cse4589_print_and_log("%s:SUCCESS\n", "display");
-	for(index = 0; index < update_index; index++) {
-		cse4589_print_and_log("%-15d%-15d%-15d\n", this_router.routing_table.entry[index].id, this_router.routing_table.additional_info[index].nexthop, this_router.routing_table.entry[index].cost);
+	LOG_INFO("%s:SUCCESS\n", "display");
+	for(index = 0; index < router_current()->num_entries; index++) {
+		LOG_INFO("%-15d%-15d%-15d\n", router_current()->routing_table.entry[index].id, nexthop_id(index), router_current()->routing_table.cost[index]);
 	}
 	
 }
@@ -63,20 +63,24 @@ void display() {
 void disable(uint16_t id) {
 	
 	int target_index;
+	int slot;
 
 	target_index = find_entry_by_id(id);
+	slot = find_neighbor(id);
 
 	//Is it a neighbor? Don't close connection of an innocent guy.
-	if (this_router.routing_table.additional_info[target_index].nexthop == this_router.id)
+	if (target_index != FAILURE && slot != FAILURE)
 	{
-		// Set cost to INF, nexthop to -1, cost to INF and counter to -1
+		// Set cost to INF, drop the nexthop and mark the counter dead
         update_link_routing_table_entry(id, -1, INF);
-        this_router.routing_table.additional_info[target_index].counter = -1; 
-        cse4589_print_and_log("%s:SUCCESS\n", "disable");
+        mark_neighbor_dead(id);
+        // Reloads of the topology file leave it down
+        router_current()->neighbors[slot].disabled = TRUE;
+        LOG_INFO("%s:SUCCESS\n", "disable");
         return;
 	}
 
-	cse4589_print_and_log("%s:%s\n", "disable", "Can not close connection. Not a neighbor.");
+	LOG_ERROR("%s:%s\n", "disable", "Can not close connection. Not a neighbor.");
 	return;
 }
 
@@ -90,33 +94,35 @@ void crash() {
 
 	int index=0;
 
-	for(index=0; index < update_index; index++) {
+	for(index=0; index < router_current()->num_entries; index++) {
 		kill_connection(index);
 	}
 
+	// Nothing is logged after this; make sure the log is complete on disk
+	cse4589_flush_log();
+
 	while(1) {
 
 	}
 
 	// Should not reach here
-	cse4589_print_and_log("%s:SUCCESS\n", "crash");
+	LOG_INFO("%s:SUCCESS\n", "crash");
 }
 
 /********************************************************************************
 *   Name:   dump
-*   Desc:   dumps a message
+*   Desc:   dumps the advertisement. Its segments lie back to back, so they
+*           go out in one write; the dump file is rewritten on every call.
 *   Ret:    Nothing
 *   Ref:    None
 ********************************************************************************/
 void dump() {
-	char *msg;
+	const char *msg;
 	size_t msg_size;
     
-    cse4589_print_and_log("%s:SUCCESS\n", "dump");
-	msg = prepare_message(&msg_size);
+    LOG_INFO("%s:SUCCESS\n", "dump");
+	msg = get_advertisement(&msg_size);
 	cse4589_dump_packet(msg, msg_size);
-	
-	free(msg);
 }
 
 /********************************************************************************
@@ -126,11 +132,101 @@ void dump() {
 *   Ref:    None
 ********************************************************************************/
 void academic_integrity() {
-	cse4589_print_and_log("I have read and understood the course acacdemic integrity policy located at http://www.cse.buffalo.edu/faculty/dimitrio/courses/cse4589_f14/index.html#integrity");
-	cse4589_print_and_log("%s:SUCCESS\n", "academic_integrity");
+	LOG_INFO("I have read and understood the course acacdemic integrity policy located at http://www.cse.buffalo.edu/faculty/dimitrio/courses/cse4589_f14/index.html#integrity");
+	LOG_INFO("%s:SUCCESS\n", "academic_integrity");
+}
+
+
+
+
+
+
+/********************************************************************************
+*   Name:   loglevel
+*   Desc:   sets the runtime log level by name (error, info, debug) or number.
+*           Levels above the build-time LOG_LEVEL_MAX stay compiled out.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void loglevel(const char *level) {
+
+	static const char *names[] = { "error", "info", "debug" };
+	size_t length;
+	int index;
+
+	if(NULL == level) {
+		LOG_ERROR("%s:%s\n", "loglevel", "invalid argument");
+		return;
+	}
+
+	// The last token still carries the line ending
+	length = strcspn(level, "\r\n");
+
+	for(index = LOG_LEVEL_ERROR; index <= LOG_LEVEL_DEBUG; index++) {
+		if((length == strlen(names[index]) && 0 == strncmp(level, names[index], length)) ||
+		   (length == 1 && level[0] == '0' + index)) {
+			log_level = index;
+			// Reported at error level so the answer is never filtered out
+			LOG_ERROR("%s:SUCCESS\n", "loglevel");
+			return;
+		}
+	}
+
+	LOG_ERROR("%s:%s\n", "loglevel", "invalid argument");
+}
+
+/********************************************************************************
+*   Name:   reload
+*   Desc:   re-reads the topology file and applies added, removed and changed
+*           links. Also run when the file changes on disk.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void reload() {
+
+	if(SUCCESS != reload_topology()) {
+		LOG_ERROR("%s:%s\n", "reload", "invalid topology file");
+		return;
+	}
+
+	LOG_INFO("%s:SUCCESS\n", "reload");
 }
 
+/********************************************************************************
+*   Name:   stats
+*   Desc:   shows the runtime metrics: counters since start, per neighbor and
+*           for the router, and percentiles of the timing histograms in us
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void stats() {
 
+	const struct router_metrics *metrics = &router_current()->metrics;
+	const struct histogram *histogram;
+	const char *name;
+	int slot, index;
 
+	LOG_INFO("%s:SUCCESS\n", "stats");
 
+	LOG_INFO("%-15s%-15s%-15s%-15s%-15s\n", "neighbor", "packets_in", "bytes_in", "packets_out", "bytes_out");
+	for(slot = 0; slot < router_current()->num_neighbors; slot++) {
+		LOG_INFO("%-15d%-15" PRIu64 "%-15" PRIu64 "%-15" PRIu64 "%-15" PRIu64 "\n", router_current()->neighbors[slot].id,
+				router_current()->neighbors[slot].metrics.packets_in, router_current()->neighbors[slot].metrics.bytes_in,
+				router_current()->neighbors[slot].metrics.packets_out, router_current()->neighbors[slot].metrics.bytes_out);
+	}
 
+	LOG_INFO("%-15s%lu\n", "route_changes", router_current()->route_changes);
+	LOG_INFO("%-15s%" PRIu64 "\n", "relaxations", metrics->relaxations);
+	LOG_INFO("%-15s%" PRIu64 "\n", "link_timeouts", metrics->link_timeouts);
+	LOG_INFO("%-15s%" PRIu64 "\n", "send_failures", metrics->send_failures);
+	LOG_INFO("%-15s%" PRIu64 "\n", "rejected", metrics->rejected);
+
+	LOG_INFO("%-15s%-15s%-15s%-15s%-15s%-15s\n", "timing (us)", "count", "p50", "p99", "p99.9", "max");
+	for(index = 0; index < 2; index++) {
+		histogram = index ? &metrics->tick_time : &metrics->packet_time;
+		name = index ? "tick" : "packet";
+		LOG_INFO("%-15s%-15" PRIu64 "%-15.1f%-15.1f%-15.1f%-15.1f\n", name, histogram->count,
+				histogram_percentile(histogram, 0.5) / 1e3, histogram_percentile(histogram, 0.99) / 1e3,
+				histogram_percentile(histogram, 0.999) / 1e3, histogram->max_ns / 1e3);
+	}
+}
@@ -0,0 +1,482 @@
+/********************************************************************************
+*   FILE:   compact.c
+*   DESC:   Compact (v2) advertisement encoding. A v2 segment is an update
+*           header whose num_updates is COMPACT_MARK, a struct
+*           compact_header, then for each entry:
+*               varint  id delta << 1 | 1 if an address follows
+*               4 byte ip address, 2 byte port      only if flagged
+*               varint  (cost + 1) & 0xFFFF, so INF is the single byte 0
+*           Varints are 7 bits a byte, low bits first. Entries are in id
+*           order and each delta is from the previous entry of the same
+*           segment, from 0 for the first, so every segment decodes on its
+*           own. A destination's address goes out only the first time it
+*           is announced in v2; receivers look rows up by id, so as in v1
+*           the address is informational.
+*
+*           Runs of ids with small costs take 2 bytes an entry instead of
+*           12. Routers offer v2 in the padding of their own v1 entry, then
+*           in the accepts field of the compact header, and speak it to
+*           neighbors that offer it back; v1 stays the default.
+********************************************************************************/
+#include "header.h"
+
+#define VARINT_MAX_BYTES 3              // a 16 bit id delta and its flag
+#define COMPACT_ENTRY_MAX (2*VARINT_MAX_BYTES + sizeof(uint32_t) + sizeof(uint16_t))
+#define COMPACT_ENTRIES_OFFSET (sizeof(struct update_header) + sizeof(struct compact_header))
+#define COMPACT_MIN_ENTRIES ((SEGMENT_SIZE - COMPACT_ENTRIES_OFFSET) / COMPACT_ENTRY_MAX)
+
+static struct compact_advertisement delta = { NULL };      // triggered updates
+static const char poisoned_cost = 0;                        // INF
+
+/********************************************************************************
+*   Name:   put_varint
+*   Desc:   writes value as a varint
+*   Ret:    bytes written
+*   Ref:    None
+********************************************************************************/
+static size_t put_varint(char *msg, uint32_t value)
+{
+    size_t size_count = 0;
+
+    while(value >= 0x80) {
+        msg[size_count++] = (char) (value | 0x80);
+        value >>= 7;
+    }
+    msg[size_count++] = (char) value;
+
+    return size_count;
+}
+
+/********************************************************************************
+*   Name:   get_varint
+*   Desc:   reads a varint of at most VARINT_MAX_BYTES from length bytes
+*   Ret:    bytes read, 0 if it is longer or runs past the end
+*   Ref:    None
+********************************************************************************/
+static size_t get_varint(const char *msg, size_t length, uint32_t *value)
+{
+    const unsigned char *bytes = (const unsigned char*) msg;
+    size_t index;
+
+    *value = 0;
+    for(index = 0; index < length && index < VARINT_MAX_BYTES; index++) {
+        *value |= (uint32_t) (bytes[index] & 0x7F) << (7*index);
+        if(!(bytes[index] & 0x80)) {
+            return index + 1;
+        }
+    }
+
+    return 0;
+}
+
+/********************************************************************************
+*   Name:   announce_address
+*   Desc:   tells whether an id's address still has to go out in v2, and
+*           records that it does now
+*   Ret:    TRUE if it has to, FALSE if it went out before
+*   Ref:    None
+********************************************************************************/
+static int announce_address(uint16_t id)
+{
+    char *flag;
+    int size;
+
+    // Sized by the largest id seen, like the triggered update flags
+    if(id >= router_current()->announced_size) {
+        size = router_current()->announced_size ? router_current()->announced_size : RTABLE_INIT_SIZE;
+        while(size <= id) {
+            size *= 2;
+        }
+        flag = (char*) realloc(router_current()->announced_flag, size*sizeof(char));
+        if(NULL == flag) {
+            fprintf(stderr, "Failed to allocate announced addresses\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(flag + router_current()->announced_size, 0, size - router_current()->announced_size);
+        router_current()->announced_flag = flag;
+        router_current()->announced_size = size;
+    }
+
+    if(router_current()->announced_flag[id]) {
+        return FALSE;
+    }
+
+    router_current()->announced_flag[id] = 1;
+    return TRUE;
+}
+
+/********************************************************************************
+*   Name:   reannounce_addresses
+*   Desc:   makes the next v2 advertisements carry every address again, for
+*           a neighbor that just started speaking v2
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void reannounce_addresses()
+{
+    if(NULL != router_current()->announced_flag) {
+        memset(router_current()->announced_flag, 0, router_current()->announced_size);
+    }
+    router_current()->compact.dirty = TRUE;
+}
+
+/********************************************************************************
+*   Name:   reserve_compact
+*   Desc:   makes room for count entries. Every segment but the last holds
+*           at least COMPACT_MIN_ENTRIES.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void reserve_compact(struct compact_advertisement *advertisement, int count)
+{
+    size_t needed = (count / COMPACT_MIN_ENTRIES + 1) * SEGMENT_SIZE;
+    uint16_t *offset;
+    uint8_t *length;
+    char *grown;
+
+    if(needed > advertisement->capacity) {
+        grown = (char*) realloc(advertisement->message, needed);
+        if(NULL == grown) {
+            fprintf(stderr, "Failed to allocate update message\n");
+            exit(EXIT_FAILURE);
+        }
+        advertisement->message = grown;
+        advertisement->capacity = needed;
+    }
+
+    if(count > advertisement->entry_capacity) {
+        offset = (uint16_t*) realloc(advertisement->cost_offset, count*sizeof(uint16_t));
+        if(NULL != offset) {
+            advertisement->cost_offset = offset;
+        }
+        length = (uint8_t*) realloc(advertisement->cost_length, count*sizeof(uint8_t));
+        if(NULL == offset || NULL == length) {
+            fprintf(stderr, "Failed to allocate update message\n");
+            exit(EXIT_FAILURE);
+        }
+        advertisement->cost_length = length;
+        advertisement->entry_capacity = count;
+    }
+}
+
+/********************************************************************************
+*   Name:   start_segment
+*   Desc:   writes the update header and compact header of a segment. The
+*           sequence number and segment count are filled in by
+*           finish_segments.
+*   Ret:    bytes written
+*   Ref:    None
+********************************************************************************/
+static size_t start_segment(char *msg, int entries, int index)
+{
+    struct update_header update;
+    struct compact_header header;
+
+    update.num_updates = htons(COMPACT_MARK);
+    update.source_port = htons(router_current()->port);
+    update.source_ip_addr = router_current()->ip_addr;
+    memcpy(msg, &update, sizeof(update));
+
+    header.sequence = 0;
+    header.index = htons((uint16_t) index);
+    header.count = 0;
+    header.entries = htons((uint16_t) entries);
+    header.version = WIRE_V2;
+    header.accepts = (uint8_t) router_current()->wire_version;
+    memcpy(msg + sizeof(update), &header, sizeof(header));
+
+    return sizeof(update) + sizeof(header);
+}
+
+/********************************************************************************
+*   Name:   compact_segment_size
+*   Desc:   size of the segment at pos, whose first entry is entry
+*   Ret:    bytes, and the segment's entries in *entries
+*   Ref:    None
+********************************************************************************/
+static size_t compact_segment_size(const struct compact_advertisement *advertisement, size_t pos, int entry, int *entries)
+{
+    uint16_t count;
+    int last;
+
+    memcpy(&count, advertisement->message + pos + sizeof(struct update_header) + offsetof(struct compact_header, entries), sizeof(count));
+    *entries = ntohs(count);
+    if(0 == *entries) {
+        return COMPACT_ENTRIES_OFFSET;
+    }
+
+    last = entry + *entries - 1;
+    return advertisement->cost_offset[last] + advertisement->cost_length[last];
+}
+
+/********************************************************************************
+*   Name:   finish_segments
+*   Desc:   stamps the segment count and the advertisement number into
+*           every segment
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void finish_segments(struct compact_advertisement *advertisement, uint32_t sequence)
+{
+    size_t pos = 0, header;
+    int entry = 0, entries, count = 0;
+    uint16_t segments;
+
+    while(pos < advertisement->size) {
+        pos += compact_segment_size(advertisement, pos, entry, &entries);
+        entry += entries;
+        count++;
+    }
+
+    segments = htons((uint16_t) count);
+    sequence = htonl(sequence);
+    pos = 0;
+    entry = 0;
+    while(pos < advertisement->size) {
+        header = pos + sizeof(struct update_header);
+        memcpy(advertisement->message + header + offsetof(struct compact_header, sequence), &sequence, sizeof(sequence));
+        memcpy(advertisement->message + header + offsetof(struct compact_header, count), &segments, sizeof(segments));
+        pos += compact_segment_size(advertisement, pos, entry, &entries);
+        entry += entries;
+    }
+}
+
+/********************************************************************************
+*   Name:   encode_compact
+*   Desc:   encodes count entries as v2 segments: the rows named by ids, in
+*           increasing id order, or with ids NULL the table in row order
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void encode_compact(struct compact_advertisement *advertisement, const uint16_t *ids, int count)
+{
+    char *msg;
+    size_t pos = 0, start = 0;
+    int entry, row, segments = 0, in_segment = 0;
+    uint16_t id, previous = 0, port;
+    int address;
+
+    reserve_compact(advertisement, count);
+    msg = advertisement->message;
+    advertisement->ids = ids;
+    advertisement->announcing = FALSE;
+
+    for(entry = 0; entry < count; entry++) {
+
+        if(0 == entry || pos - start + COMPACT_ENTRY_MAX > SEGMENT_SIZE) {
+            if(entry > 0) {
+                start_segment(msg + start, in_segment, segments - 1);
+            }
+            start = pos;
+            pos += COMPACT_ENTRIES_OFFSET;
+            segments++;
+            in_segment = 0;
+            previous = 0;
+        }
+
+        row = (NULL == ids) ? entry : find_entry_by_id(ids[entry]);
+        id = router_current()->routing_table.entry[row].id;
+        address = announce_address(id);
+
+        pos += put_varint(msg + pos, ((uint32_t) (id - previous) << 1) | (address == TRUE ? 1 : 0));
+        if(address == TRUE) {
+            memcpy(msg + pos, &router_current()->routing_table.entry[row].ip_addr, sizeof(uint32_t));
+            pos += sizeof(uint32_t);
+            port = htons(router_current()->routing_table.entry[row].port);
+            memcpy(msg + pos, &port, sizeof(port));
+            pos += sizeof(port);
+            advertisement->announcing = TRUE;
+        }
+
+        advertisement->cost_offset[entry] = (uint16_t) (pos - start);
+        advertisement->cost_length[entry] = (uint8_t) put_varint(msg + pos, (uint16_t) (router_current()->routing_table.cost[row] + 1));
+        pos += advertisement->cost_length[entry];
+
+        previous = id;
+        in_segment++;
+    }
+
+    if(0 == count) {
+        pos = COMPACT_ENTRIES_OFFSET;
+        segments = 1;
+    }
+    start_segment(msg + start, in_segment, segments - 1);
+    advertisement->size = pos;
+}
+
+/********************************************************************************
+*   Name:   get_compact_advertisement
+*   Desc:   the v2 counterpart of get_advertisement: the full table, encoded
+*           again only if it changed or the last encoding announced
+*           addresses, stamped as a new advertisement
+*   Ret:    the advertisement, owned by the router
+*   Ref:    None
+********************************************************************************/
+const struct compact_advertisement *get_compact_advertisement()
+{
+    struct compact_advertisement *advertisement = &router_current()->compact;
+
+    if(advertisement->dirty == TRUE || advertisement->announcing == TRUE) {
+        encode_compact(advertisement, NULL, router_current()->num_entries);
+        advertisement->dirty = FALSE;
+    }
+
+    router_current()->advertisement_sequence++;
+    finish_segments(advertisement, router_current()->advertisement_sequence);
+    return advertisement;
+}
+
+/********************************************************************************
+*   Name:   encode_compact_delta
+*   Desc:   encodes a triggered update of the given ids, which must be in
+*           increasing order, as advertisement advertisement_sequence
+*   Ret:    the advertisement, valid until the next call
+*   Ref:    None
+********************************************************************************/
+const struct compact_advertisement *encode_compact_delta(const uint16_t *ids, int count)
+{
+    encode_compact(&delta, ids, count);
+    finish_segments(&delta, router_current()->advertisement_sequence);
+    return &delta;
+}
+
+/********************************************************************************
+*   Name:   next_compact_segment
+*   Desc:   walks the segments of an advertisement; start with *pos and
+*           *entry at 0
+*   Ret:    TRUE with the next segment in *segment, FALSE after the last
+*   Ref:    None
+********************************************************************************/
+int next_compact_segment(const struct compact_advertisement *advertisement, size_t *pos, int *entry, struct outgoing_segment *segment)
+{
+    int entries;
+
+    if(*pos >= advertisement->size) {
+        return FALSE;
+    }
+
+    segment->message = advertisement->message + *pos;
+    segment->size = compact_segment_size(advertisement, *pos, *entry, &entries);
+    segment->version = WIRE_V2;
+    segment->num_entries = entries;
+    segment->first_row = *entry;
+    segment->entry_ids = (NULL == advertisement->ids) ? NULL : advertisement->ids + *entry;
+    segment->cost_offset = advertisement->cost_offset + *entry;
+    segment->cost_length = advertisement->cost_length + *entry;
+    segment->poison = &poisoned_cost;
+    segment->poison_length = sizeof(poisoned_cost);
+
+    *pos += segment->size;
+    *entry += entries;
+    return TRUE;
+}
+
+/********************************************************************************
+*   Name:   check_compact_message
+*   Desc:   checks the body of a v2 message, everything after its update
+*           header, before any of it is applied
+*   Ret:    Success, or Failure if it is truncated or malformed
+*   Ref:    None
+********************************************************************************/
+int check_compact_message(const char *body, size_t length)
+{
+    struct compact_header header;
+    size_t pos, used;
+    uint32_t value, id = 0;
+    int entry;
+
+    if(length < sizeof(header)) {
+        return FAILURE;
+    }
+    memcpy(&header, body, sizeof(header));
+    if(header.version != WIRE_V2) {
+        return FAILURE;
+    }
+
+    pos = sizeof(header);
+    for(entry = 0; entry < ntohs(header.entries); entry++) {
+
+        used = get_varint(body + pos, length - pos, &value);
+        if(0 == used) {
+            return FAILURE;
+        }
+        pos += used;
+
+        id += value >> 1;
+        if(id > UINT16_MAX) {
+            return FAILURE;
+        }
+        if(value & 1) {
+            if(length - pos < sizeof(uint32_t) + sizeof(uint16_t)) {
+                return FAILURE;
+            }
+            pos += sizeof(uint32_t) + sizeof(uint16_t);
+        }
+
+        used = get_varint(body + pos, length - pos, &value);
+        if(0 == used || value > UINT16_MAX) {
+            return FAILURE;
+        }
+        pos += used;
+    }
+
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   apply_compact_update
+*   Desc:   applies a v2 message from a neighbor, whose body passed
+*           check_compact_message, like apply_neighbor_update does a v1 one
+*   Ret:    TRUE if applied, FALSE if dropped as overtaken
+*   Ref:    None
+********************************************************************************/
+int apply_compact_update(int slot, const char *body, size_t length)
+{
+    struct compact_header header;
+    size_t pos = sizeof(header);
+    uint32_t value;
+    uint16_t id = 0;
+    int entry, count, bulk;
+
+    memcpy(&header, body, sizeof(header));
+    set_neighbor_accepts(slot, header.accepts);
+    if(accept_segment(slot, ntohl(header.sequence)) != TRUE) {
+        return FALSE;
+    }
+
+    count = ntohs(header.entries);
+    bulk = bulk_neighbor_update(slot, count);
+
+    for(entry = 0; entry < count; entry++) {
+
+        pos += get_varint(body + pos, length - pos, &value);
+        id += (uint16_t) (value >> 1);
+        if(value & 1) {
+            pos += sizeof(uint32_t) + sizeof(uint16_t);
+        }
+
+        pos += get_varint(body + pos, length - pos, &value);
+        store_advertised_cost(slot, id, (uint16_t) (value - 1), bulk);
+    }
+
+    if(bulk == TRUE) {
+        relax_neighbor(slot);
+    }
+
+    return TRUE;
+}
+
+/********************************************************************************
+*   Name:   free_compact_advertisement
+*   Desc:   releases an advertisement's buffers and leaves it empty
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void free_compact_advertisement(struct compact_advertisement *advertisement)
+{
+    free(advertisement->message);
+    free(advertisement->cost_offset);
+    free(advertisement->cost_length);
+    memset(advertisement, 0, sizeof(*advertisement));
+    advertisement->dirty = TRUE;
+}
@@ -0,0 +1,397 @@
+/********************************************************************************
+*   FILE:   event_loop.c
+*   DESC:   epoll based event loop. Sockets and stdin register read handlers,
+*           periodic work registers a timerfd so intervals do not drift with
+*           processing time.
+*
+*           In simulated time (event_loop_init_simulated) the timers are
+*           scheduler events instead and the clock only moves from one event
+*           to the next, so simulated networks run as fast as the CPU allows.
+*           There are no descriptors to watch in that mode.
+********************************************************************************/
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "header.h"
+
+#define MAX_EVENTS 64
+
+struct event_handler {
+    event_callback callback;            // NULL if fd is not registered
+    void *arg;
+    int is_timer;                       // read expirations before the callback
+    int once;                           // TRUE: remove and close after one call
+};
+
+static int epoll_fd = -1;
+static struct event_handler *handlers = NULL;
+static int handlers_size = 0;
+static int simulated = FALSE;
+
+/********************************************************************************
+*   Name:   event_loop_init
+*   Desc:   creates the epoll instance
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+int event_loop_init()
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if(-1 == epoll_fd) {
+        perror("epoll_create1");
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   event_loop_init_simulated
+*   Desc:   runs timers in simulated time, starting at 0
+*   Ret:    Success
+*   Ref:    None
+********************************************************************************/
+int event_loop_init_simulated()
+{
+    scheduler_reset();
+    simulated = TRUE;
+
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   event_loop_close
+*   Desc:   drops every handler and timer. Registered descriptors are left
+*           open; timers the loop created are closed.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void event_loop_close()
+{
+    int fd;
+
+    if(simulated == TRUE) {
+        scheduler_reset();
+        simulated = FALSE;
+        return;
+    }
+
+    for(fd = 0; fd < handlers_size; fd++) {
+        if(NULL != handlers[fd].callback && handlers[fd].is_timer == TRUE) {
+            close(fd);
+        }
+    }
+    free(handlers);
+    handlers = NULL;
+    handlers_size = 0;
+
+    if(-1 != epoll_fd) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+}
+
+/********************************************************************************
+*   Name:   event_loop_now_ms
+*   Desc:   the loop's clock: CLOCK_MONOTONIC, or simulated time
+*   Ret:    milliseconds
+*   Ref:    None
+********************************************************************************/
+double event_loop_now_ms()
+{
+    struct timespec ts;
+
+    if(simulated == TRUE) {
+        return scheduler_now_ms();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1e3 + ts.tv_nsec/1e6;
+}
+
+/********************************************************************************
+*   Name:   register_handler
+*   Desc:   records the handler for fd and adds fd to the epoll set
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+static int register_handler(int fd, event_callback callback, void *arg, int is_timer, int once)
+{
+    struct epoll_event event;
+    struct event_handler *grown;
+    int new_size;
+
+    if(fd >= handlers_size) {
+        new_size = handlers_size ? handlers_size : 16;
+        while(new_size <= fd) {
+            new_size *= 2;
+        }
+        grown = (struct event_handler*) realloc(handlers, new_size*sizeof(struct event_handler));
+        if(NULL == grown) {
+            return FAILURE;
+        }
+        memset(grown + handlers_size, 0, (new_size - handlers_size)*sizeof(struct event_handler));
+        handlers = grown;
+        handlers_size = new_size;
+    }
+
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if(-1 == epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event)) {
+        perror("epoll_ctl");
+        return FAILURE;
+    }
+
+    handlers[fd].callback = callback;
+    handlers[fd].arg = arg;
+    handlers[fd].is_timer = is_timer;
+    handlers[fd].once = once;
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   event_loop_add_fd
+*   Desc:   calls callback whenever fd becomes readable
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+int event_loop_add_fd(int fd, event_callback callback, void *arg)
+{
+    if(simulated == TRUE) {
+        return FAILURE;
+    }
+
+    return register_handler(fd, callback, arg, FALSE, FALSE);
+}
+
+/********************************************************************************
+*   Name:   event_loop_remove_fd
+*   Desc:   stops watching fd. Does not close it.
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+int event_loop_remove_fd(int fd)
+{
+    if(fd < 0 || fd >= handlers_size || NULL == handlers[fd].callback) {
+        return FAILURE;
+    }
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    handlers[fd].callback = NULL;
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   event_loop_add_timer
+*   Desc:   calls callback every interval_sec seconds on an absolute schedule.
+*           The callback's fd argument carries the number of intervals that
+*           elapsed since the previous call (normally 1).
+*   Ret:    timer fd or FAILURE
+*   Ref:    None
+********************************************************************************/
+int event_loop_add_timer(long interval_sec, event_callback callback, void *arg)
+{
+    int timer_fd;
+    struct itimerspec spec;
+
+    if(simulated == TRUE) {
+        return scheduler_add_timer(interval_sec * 1e3, callback, arg);
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(-1 == timer_fd) {
+        perror("timerfd_create");
+        return FAILURE;
+    }
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = interval_sec;
+    spec.it_interval.tv_sec = interval_sec;
+    if(-1 == timerfd_settime(timer_fd, 0, &spec, NULL)) {
+        perror("timerfd_settime");
+        close(timer_fd);
+        return FAILURE;
+    }
+
+    if(SUCCESS != register_handler(timer_fd, callback, arg, TRUE, FALSE)) {
+        close(timer_fd);
+        return FAILURE;
+    }
+
+    return timer_fd;
+}
+
+/********************************************************************************
+*   Name:   event_loop_add_timeout
+*   Desc:   registers a one-shot timer that starts disarmed; arm it with
+*           event_loop_set_timeout
+*   Ret:    timer fd or FAILURE
+*   Ref:    None
+********************************************************************************/
+int event_loop_add_timeout(event_callback callback, void *arg)
+{
+    int timer_fd;
+
+    if(simulated == TRUE) {
+        return scheduler_add_timer(0, callback, arg);
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(-1 == timer_fd) {
+        perror("timerfd_create");
+        return FAILURE;
+    }
+
+    if(SUCCESS != register_handler(timer_fd, callback, arg, TRUE, FALSE)) {
+        close(timer_fd);
+        return FAILURE;
+    }
+
+    return timer_fd;
+}
+
+/********************************************************************************
+*   Name:   event_loop_set_timeout
+*   Desc:   fires a one-shot timer once, delay_ms from now (0 = next dispatch)
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+int event_loop_set_timeout(int timer_fd, long delay_ms)
+{
+    struct itimerspec spec;
+
+    if(simulated == TRUE) {
+        return scheduler_set_timeout(timer_fd, delay_ms);
+    }
+
+    memset(&spec, 0, sizeof(spec));
+    spec.it_value.tv_sec = delay_ms / 1000;
+    spec.it_value.tv_nsec = (delay_ms % 1000) * 1000000;
+    if(0 == delay_ms) {
+        // An all zero it_value would disarm the timer
+        spec.it_value.tv_nsec = 1;
+    }
+
+    if(-1 == timerfd_settime(timer_fd, 0, &spec, NULL)) {
+        perror("timerfd_settime");
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   event_loop_call
+*   Desc:   calls callback(1, arg) once, delay_ms from now
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+int event_loop_call(double delay_ms, event_callback callback, void *arg)
+{
+    int timer_fd;
+
+    if(simulated == TRUE) {
+        return scheduler_call(delay_ms, callback, arg);
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if(-1 == timer_fd) {
+        perror("timerfd_create");
+        return FAILURE;
+    }
+
+    if(SUCCESS != register_handler(timer_fd, callback, arg, TRUE, TRUE) || SUCCESS != event_loop_set_timeout(timer_fd, (long) delay_ms)) {
+        event_loop_remove_fd(timer_fd);
+        close(timer_fd);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   event_loop_next_ms
+*   Desc:   in simulated time, when the next timer or call is due
+*   Ret:    milliseconds, -1 if nothing is scheduled or time is real
+*   Ref:    None
+********************************************************************************/
+double event_loop_next_ms()
+{
+    if(simulated != TRUE) {
+        return -1;
+    }
+
+    return scheduler_next_ms();
+}
+
+/********************************************************************************
+*   Name:   event_loop_run_once
+*   Desc:   waits up to timeout_ms (-1 forever) and dispatches ready handlers.
+*           In simulated time this runs the next due event, if any; waiting
+*           only advances the clock.
+*   Ret:    number of handlers run or FAILURE
+*   Ref:    None
+********************************************************************************/
+int event_loop_run_once(int timeout_ms)
+{
+    struct epoll_event events[MAX_EVENTS];
+    uint64_t expirations;
+    int num_events, index, fd;
+
+    if(simulated == TRUE) {
+        return scheduler_run_once(timeout_ms);
+    }
+
+    num_events = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout_ms);
+    if(-1 == num_events) {
+        if(EINTR == errno) {
+            return 0;
+        }
+        perror("epoll_wait");
+        return FAILURE;
+    }
+
+    for(index = 0; index < num_events; index++) {
+
+        fd = events[index].data.fd;
+        if(fd >= handlers_size || NULL == handlers[fd].callback) {
+            continue;
+        }
+
+        if(handlers[fd].is_timer == TRUE) {
+            if(read(fd, &expirations, sizeof(expirations)) != sizeof(expirations)) {
+                continue;
+            }
+            handlers[fd].callback((int) expirations, handlers[fd].arg);
+            if(handlers[fd].once == TRUE) {
+                event_loop_remove_fd(fd);
+                close(fd);
+            }
+        }
+        else {
+            handlers[fd].callback(fd, handlers[fd].arg);
+        }
+    }
+
+    return num_events;
+}
+
+/********************************************************************************
+*   Name:   event_loop_run
+*   Desc:   dispatches events until an error occurs, or in simulated time
+*           until nothing is left to run
+*   Ret:    FAILURE, or Success once a simulation runs out of events
+*   Ref:    None
+********************************************************************************/
+int event_loop_run()
+{
+    int rv;
+
+    while((rv = event_loop_run_once(-1)) != FAILURE) {
+        if(simulated == TRUE && 0 == rv) {
+            return SUCCESS;
+        }
+    }
+
+    return FAILURE;
+}
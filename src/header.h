@@ -2,14 +2,22 @@
 *   FILE:   headers.c
 *   DESC:   Includes, struct / function declarations and preprocessor stuff here
 ********************************************************************************/
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE                     // sendmmsg / recvmmsg
+#endif
+
 #include <arpa/inet.h>
 #include <ctype.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <netinet/in.h>
 #include <stddef.h>
 #include <string.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <sys/types.h>
 #include <unistd.h>
 #include <stdio.h>
@@ -24,16 +32,56 @@
 #define TRUE 0
 #define FALSE -1
 
-#define MAX_ROUTERS 30
+#define RTABLE_INIT_SIZE 32             // initial routing table capacity, grows on demand
+#define RTABLE_ALIGN 64                 // byte alignment of routing table columns
+#define MAX_DATAGRAM_SIZE 65507         // largest UDP payload we can receive
+#define SEGMENT_SIZE 1472               // largest advertisement datagram: 1500 byte MTU less IP and UDP headers
+#define SEGMENT_REORDER_WINDOW 64       // advertisements a late segment may lag the newest by and still be dropped
+#define WIRE_V1 1                       // 12 byte entries, the default
+#define WIRE_V2 2                       // compact entries, see compact.c
+#define COMPACT_MARK 0xFFFF             // num_updates of a v2 message; too many for any v1 datagram
+#define RECV_BATCH 16                   // datagrams drained per recvmmsg call
+#define ID_SPACE 0x10000                // router ids are 16 bit
+#define NO_SLOT -1
 #define INF 0xFFFF
 #define INVALID_ROUTER_ID -1
-#define COUNTER_DEAD -1
+#define NEXTHOP_SELF 0xFFFE              // nexthop column: direct route
+#define NEXTHOP_NONE 0xFFFF              // nexthop column: unreachable
+#define COUNTER_DEAD 0xFF
 #define COUNTER_MAX 3
 
 #define CMD_LEN 50
+#define HOLDDOWN_DEFAULT 1000           // ms between triggered updates
+#define RELAX_MIN_FRACTION 8            // vectors covering 1/8 of the table are relaxed in bulk
+#define CAPTURE_SIZE (16 << 20)         // bytes in the pcap capture ring
+#define HISTOGRAM_SUB_BITS 4            // 16 buckets per power of two, values kept within 1/16
+#define HISTOGRAM_MAX_BITS 36           // ns; longer values (over a minute) share the top bucket
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_MAX_BITS - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS)
+
+/***************************************
+* Log levels
+*
+* LOG_LEVEL_MAX is fixed at build time; lines above it are compiled out,
+* e.g. -DLOG_LEVEL_MAX=LOG_LEVEL_INFO drops the per-entry receive lines.
+* log_level is the runtime threshold, set with the loglevel command. The
+* default logs everything the assignment output format requires.
+***************************************/
+#define LOG_LEVEL_ERROR 0               // failed commands
+#define LOG_LEVEL_INFO 1                // command results, one line per packet
+#define LOG_LEVEL_DEBUG 2               // one line per received entry
+
+#ifndef LOG_LEVEL_MAX
+#define LOG_LEVEL_MAX LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_ENABLED(level) ((level) <= LOG_LEVEL_MAX && (level) <= log_level)
+#define LOG_AT(level, ...) do { if(LOG_ENABLED(level)) cse4589_print_and_log(__VA_ARGS__); } while(0)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
 
-extern int update_index;
-extern int num_packets;
+extern int poisoned_reverse;
+extern int log_level;
 
 
 /***************************************
@@ -48,25 +96,159 @@ struct update_header {
 struct updates {
     uint32_t ip_addr;                   // ip address of router
     uint16_t port;                      // port number of router
-    uint16_t pad;                       // 0x0 padding
+    uint16_t pad;                       // 0x0 padding; WIRE_V2 in the sender's own entry if it offers v2
     uint16_t id;                        // id of router
     uint16_t cost;                      // cost to reach router
 };
 
 /**************************************
-* Additional Information structure
+* Compact (v2) segment header
+*
+* Advertisements are sent as datagrams of at most SEGMENT_SIZE bytes.
+* v1 segments are plain update messages, each holding the next rows; a
+* router offers v2 in the padding of its own entry, which older decoders
+* skip. Only a neighbor that offered v2 back gets compact segments,
+* which follow an update header whose num_updates is COMPACT_MARK with
+* this header and varint entries, see compact.c. Segments are applied
+* as they arrive; sequence only lets a receiver drop segments of an
+* older advertisement that were overtaken by a newer one.
 **************************************/
-struct info {
-	int nexthop;                  
-	int counter;           	    
+struct compact_header {
+    uint32_t sequence;                  // advertisement number, the same in each of its segments
+    uint16_t index;                     // this segment, from 0
+    uint16_t count;                     // segments in the advertisement
+    uint16_t entries;                   // entries in this segment
+    uint8_t version;                    // WIRE_V2
+    uint8_t accepts;                    // highest wire version the sender accepts
+};
+
+/**************************************
+* Destination structure
+**************************************/
+struct destination {
+    uint32_t ip_addr;                   // ip address of router
+    uint16_t port;                      // port number of router
+    uint16_t id;                        // id of router
 };
 
 /**************************************
 * Routing table structure
+*
+* Rows are sorted by dest id. Route state is kept column-wise in
+* RTABLE_ALIGN aligned arrays so relaxation can run over whole vectors.
+* The hot columns are 4 bytes a row; addresses live in the cold entry
+* array, which only lookups and message encoding touch.
 **************************************/
 struct rtable {
-	struct updates entry[MAX_ROUTERS];  // index corresponds to the dest id
-	struct info additional_info[MAX_ROUTERS];
+	struct destination *entry;          // address of each row's router
+	uint16_t *cost;                     // cost to reach router, INF if unreachable
+	uint16_t *nexthop;                  // neighbor slot of the next hop, NEXTHOP_SELF / NEXTHOP_NONE
+	int capacity;                       // allocated rows in every column
+	int *id_slot;                       // dest id -> row, NO_SLOT if absent
+	int id_slot_size;                   // ids covered by id_slot, past the largest present
+	int *addr_slot;                     // open addressed (ip, port) hash, row+1 or 0 if empty
+	int addr_slot_size;                 // power of two, at least twice capacity
+};
+
+/**************************************
+* Metrics
+*
+* Counters only ever grow. A router instance is only touched by the
+* thread running its event loop, so its metrics are plain integers in
+* the instance: counting is an add, with no atomics or locks.
+*
+* Histograms are HDR style: exact below 2^HISTOGRAM_SUB_BITS ns, then
+* 2^HISTOGRAM_SUB_BITS linear buckets per power of two.
+**************************************/
+struct histogram {
+	uint64_t count;
+	uint64_t sum_ns;
+	uint64_t max_ns;
+	uint64_t bucket[HISTOGRAM_BUCKETS];
+};
+
+struct neighbor_metrics {
+	uint64_t packets_in;                // datagrams received from the neighbor
+	uint64_t bytes_in;
+	uint64_t packets_out;               // datagrams sent to the neighbor
+	uint64_t bytes_out;
+};
+
+struct router_metrics {
+	uint64_t relaxations;               // (row, neighbor) pairs relaxed
+	uint64_t link_timeouts;             // neighbors whose updates stopped
+	uint64_t send_failures;             // datagrams the socket refused
+	uint64_t rejected;                  // malformed datagrams or from strangers
+	struct histogram packet_time;       // processing of one received datagram
+	struct histogram tick_time;         // one periodic update
+};
+
+/**************************************
+* Neighbor structure
+**************************************/
+struct neighbor {
+	uint16_t id;                        // router id of the neighbor
+	uint16_t link_cost;                 // configured link cost, INF if disabled
+	int disabled;                       // TRUE after the disable command, until the link is set again
+	int alive;                          // FALSE once its updates time out
+	uint8_t counter;                    // update intervals since it was last heard, COUNTER_DEAD while down
+	uint16_t *vector;                   // last advertised cost per routing table row
+	uint32_t sequence;                  // newest advertisement heard, if sequenced
+	int sequenced;                      // TRUE once a compact header was heard
+	int accepts;                        // highest wire version it accepts, WIRE_V1 until told
+	struct neighbor_metrics metrics;
+};
+
+/**************************************
+* Compact advertisement
+*
+* v2 segments back to back, with where each entry's cost lies so
+* poisoned reverse can splice in INF per neighbor.
+**************************************/
+struct compact_advertisement {
+	char *message;
+	size_t size;
+	size_t capacity;
+	int dirty;                          // TRUE once the table changed since encoding
+	int announcing;                     // TRUE if the encoding carries addresses
+	const uint16_t *ids;                // entries' ids, NULL for the table in row order
+	uint16_t *cost_offset;              // per entry, offset of its cost in its segment
+	uint8_t *cost_length;               // per entry, bytes of its cost
+	int entry_capacity;
+};
+
+/**************************************
+* Outgoing segment
+*
+* One encoded segment on its way to the neighbors that speak its
+* version. Its entries are table rows in order from first_row, or the
+* rows named by entry_ids. cost_offset and cost_length locate each
+* entry's cost, NULL for the fixed v1 layout; poison is what replaces
+* a cost that goes back through the receiving neighbor.
+**************************************/
+struct outgoing_segment {
+	const char *message;
+	size_t size;
+	int version;
+	int num_entries;
+	int first_row;
+	const uint16_t *entry_ids;
+	const uint16_t *cost_offset;
+	const uint8_t *cost_length;
+	const void *poison;
+	size_t poison_length;
+};
+
+/**************************************
+* Transport structure
+*
+* Carries a router's outgoing updates when it is not using its UDP
+* socket, e.g. the simulator's in-memory network. send is called with
+* the sending router selected.
+**************************************/
+struct transport {
+	ssize_t (*send)(const struct sockaddr_in *to, const struct iovec *iov, size_t iovlen, void *arg);
+	void *arg;
 };
 
 /**************************************
@@ -77,13 +259,57 @@ struct router {
 	uint16_t port;                      // port of this router
 	uint16_t id;                        // id of this 
 	struct rtable routing_table;        // routing table for this router
-} this_router;
+	int num_entries;                    // rows in use in routing_table
+	struct neighbor *neighbors;         // directly linked routers
+	int num_neighbors;
+	int neighbor_capacity;
+	int *neighbor_slot;                 // router id -> neighbors index, NO_SLOT if none
+	int neighbor_slot_size;             // ids covered by neighbor_slot
+	int num_packets;                    // updates accepted since the packets command
+	unsigned long route_changes;        // advertised cost changes, ever
+	struct router_metrics metrics;
+
+	const struct transport *transport;  // NULL sends over send_sock
+	int send_sock;                      // -1 until opened
+
+	char *advertisement;                // encoded full table, see get_advertisement
+	size_t advertisement_size;
+	size_t advertisement_capacity;
+	int advertisement_dirty;            // TRUE once the table changed since encoding
+	uint32_t advertisement_sequence;    // number of the last advertisement sent
+	int wire_version;                   // highest wire version spoken, WIRE_V1 unless enabled
+	struct compact_advertisement compact;   // v2 encoding of the full table
+	char *announced_flag;               // id -> address sent in a v2 advertisement
+	int announced_size;                 // ids covered by announced_flag
+
+	uint16_t *changed_ids;              // destinations changed since the last update
+	char *changed_flag;                 // id -> queued in changed_ids
+	int changed_size;                   // ids covered by changed_flag
+	int num_changed;
+	long holddown_ms;                   // minimum gap between triggered updates
+	int trigger_fd;                     // -1 without triggered updates
+	int trigger_armed;
+	double last_trigger_ms;
+};
+
+/**************************************
+* The current router instance. All routing code works on the instance
+* router_current returns; a router process has a single instance, the
+* simulator selects each of its routers in turn with router_select.
+**************************************/
+extern struct router *current_router;
+
+static inline struct router *router_current(void)
+{
+    return current_router;
+}
 
 
 /**************************************
 * Externals
 **************************************/
 void cse4589_print_and_log(char* format, ...);
+void cse4589_flush_log();
 int cse4589_dump_packet(const void* packet, size_t bytes);
 
 
@@ -91,24 +317,200 @@ int cse4589_dump_packet(const void* packet, size_t bytes);
 * Function Declarations
 ***************************************/
 int new_sockin(uint16_t port);
-int get_args(char **topologypath, long int *upintvl, int argc, char** argv);
+int get_args(char **topologypath, long int *upintvl, long int *holddown, char **capturepath, int *wireversion, char **metricspath, int argc, char** argv);
 FILE *open_file(char *path);
 int close_file(FILE *openfile);
-void add_routing_table_entry(uint16_t id, uint32_t ip_addr, uint16_t port, uint16_t cost, uint16_t nexthop, int counter);
+void *aligned_resize(void *old, size_t old_bytes, size_t new_bytes);
+int grow_routing_table(int min_entries);
+void add_routing_table_entry(uint16_t id, uint32_t ip_addr, uint16_t port, uint16_t cost, uint16_t nexthop);
+void append_routing_table_entry(uint16_t id, uint32_t ip_addr, uint16_t port, uint16_t cost, uint16_t nexthop);
+void sort_routing_table();
 void update_link_routing_table_entry(uint16_t id, int nexthop, uint16_t cost);
-void read_topology(FILE *tofile);
+void set_route(int row, uint16_t nexthop, uint16_t cost);
 char* prepare_message(size_t *msg_size);
+size_t message_size();
+size_t encode_message(char *msg);
+size_t segment_size(const char *segment);
+void invalidate_advertisement();
+const char *get_advertisement(size_t *msg_size);
+int init_triggered_updates(long holddown);
+void mark_route_changed(uint16_t id);
+void clear_changed_routes();
+void send_triggered_update(int intervals, void *arg);
+void periodic_update(int intervals, void *arg);
 void increment_counters();
 void disable_old_links();
+int get_send_socket();
 void send_message_to_neighbors();
 int send_message(uint32_t ip_addr, uint16_t port);
 void get_message_and_update(int sock_in);
+int parse_update_header(const char *msg, ssize_t msg_len, uint32_t *source_ip_addr, uint16_t *source_port);
+int process_update_message(const char *msg, ssize_t msg_len);
 uint32_t get_this_router_ip_addr();
 char *get_command(void);
 void string_lowcase(char *string);
 void tokenize_command(char *command, char **command_tokens, int *command_token_count);
 void kill_connection(int target_index);
 int find_entry_by_id(uint16_t id);
+int find_entry_by_ip(uint32_t ip, uint16_t port);
+void rebuild_routing_table_index();
+
+/******************************************
+* Router instances
+******************************************/
+void router_init(struct router *router);
+struct router *router_select(struct router *router);
+void router_free(struct router *router);
+
+/******************************************
+* Neighbors
+******************************************/
+int find_neighbor(uint16_t id);
+uint16_t neighbor_link_cost(int slot);
+uint16_t nexthop_slot(int id);
+int nexthop_id(int row);
+void recompute_route(int row);
+void recompute_routes();
+void set_link_cost(uint16_t id, uint16_t cost);
+void set_neighbor_alive(int slot, int alive);
+void mark_neighbor_dead(uint16_t id);
+int accept_segment(int slot, uint32_t sequence);
+void set_neighbor_accepts(int slot, int accepts);
+int neighbor_wire_version(int slot);
+int bulk_neighbor_update(int slot, int count);
+void store_advertised_cost(int slot, uint16_t id, uint16_t cost, int bulk);
+void clear_neighbor_vector(int slot);
+void store_neighbor_cost(int slot, int row, uint16_t cost);
+int store_neighbor_update(int slot, const char *entries, int count);
+void relax_neighbor(int slot);
+void apply_neighbor_update(int slot, const char *entries, int count);
+int resize_neighbor_vectors(int old_capacity, int new_capacity);
+void insert_neighbor_vector_row(int row);
+void clear_neighbor_vectors();
+
+/******************************************
+* Relaxation kernels
+******************************************/
+typedef void (*relax_kernel)(const uint16_t *vector, uint16_t link, uint16_t via, uint16_t *cost, uint16_t *nexthop, int from, int rows, uint32_t *changed, uint32_t *reselect);
+
+void relax_vector_scalar(const uint16_t *vector, uint16_t link, uint16_t via, uint16_t *cost, uint16_t *nexthop, int from, int rows, uint32_t *changed, uint32_t *reselect);
+void relax_vector_sse41(const uint16_t *vector, uint16_t link, uint16_t via, uint16_t *cost, uint16_t *nexthop, int from, int rows, uint32_t *changed, uint32_t *reselect);
+void relax_vector_avx2(const uint16_t *vector, uint16_t link, uint16_t via, uint16_t *cost, uint16_t *nexthop, int from, int rows, uint32_t *changed, uint32_t *reselect);
+relax_kernel get_relax_kernel();
+
+/******************************************
+* Topology
+******************************************/
+struct topology_handler {
+	void (*routers_begin)(uint32_t num_routers, void *arg);     // optional
+	void (*router)(uint16_t id, uint32_t ip_addr, uint16_t port, void *arg);
+	void (*routers_end)(void *arg);                             // optional
+	void (*link)(uint16_t id, uint16_t neighbor_id, uint16_t cost, void *arg);
+	void *arg;
+};
+
+int parse_topology(const char *data, size_t size, const struct topology_handler *handler);
+const char *map_topology(FILE *tofile, size_t *size, int *mapped);
+void unmap_topology(const char *data, size_t size, int mapped);
+int read_topology(FILE *tofile);
+int reload_topology();
+int watch_topology(const char *path);
+
+/******************************************
+* Compact (v2) wire format
+******************************************/
+const struct compact_advertisement *get_compact_advertisement();
+const struct compact_advertisement *encode_compact_delta(const uint16_t *ids, int count);
+int next_compact_segment(const struct compact_advertisement *advertisement, size_t *pos, int *entry, struct outgoing_segment *segment);
+int check_compact_message(const char *body, size_t length);
+int apply_compact_update(int slot, const char *body, size_t length);
+void reannounce_addresses();
+void free_compact_advertisement(struct compact_advertisement *advertisement);
+
+/******************************************
+* Metrics
+******************************************/
+uint64_t metrics_now_ns();
+void histogram_record(struct histogram *histogram, uint64_t ns);
+uint64_t histogram_percentile(const struct histogram *histogram, double fraction);
+int write_metrics_file(const char *path);
+int init_metrics_export(const char *path, long interval_sec);
+
+/******************************************
+* Capture
+******************************************/
+int capture_open(const char *path, size_t size);
+int capture_enabled();
+void capture_datagram(const struct sockaddr_in *from, const struct sockaddr_in *to, const struct iovec *iov, size_t iovlen);
+void capture_local_address(struct sockaddr_in *local);
+
+/******************************************
+* Simulator
+******************************************/
+struct sim_config {
+	long interval_sec;                  // periodic update interval
+	double delay_min_ms;                // one-way delay, uniform in [min, max]
+	double delay_max_ms;
+	double loss;                        // probability a datagram is lost
+	int triggered;                      // TRUE: changes are also sent between intervals
+	long holddown_ms;                   // minimum gap between triggered updates
+	uint32_t seed;
+	int wire_version;                   // WIRE_V1, or WIRE_V2 for every router
+};
+
+struct sim_link {
+	uint16_t a;                         // router ids, 1..num_routers
+	uint16_t b;
+	uint16_t cost;                      // INF while the link is down
+};
+
+struct sim_stats {
+	int converged;                      // FALSE if the run hit its time limit
+	double converged_ms;                // time of the last route change
+	unsigned long messages;             // datagrams sent up to then
+	unsigned long bytes;
+	unsigned long dropped;              // datagrams lost, whole run
+	unsigned long route_changes;
+};
+
+struct simulation;
+
+struct simulation *sim_create(const struct sim_config *config, int num_routers, const struct sim_link *links, int num_links);
+int sim_set_link(struct simulation *sim, uint16_t a, uint16_t b, uint16_t cost);
+int sim_crash_router(struct simulation *sim, uint16_t id);
+void sim_run(struct simulation *sim, double settle_ms, double max_ms, struct sim_stats *stats);
+int sim_check_routes(struct simulation *sim);
+void sim_free(struct simulation *sim);
+
+/******************************************
+* Event loop
+******************************************/
+typedef void (*event_callback)(int fd, void *arg);
+
+int event_loop_init();
+int event_loop_init_simulated();
+void event_loop_close();
+double event_loop_now_ms();
+int event_loop_add_fd(int fd, event_callback callback, void *arg);
+int event_loop_remove_fd(int fd);
+int event_loop_add_timer(long interval_sec, event_callback callback, void *arg);
+int event_loop_add_timeout(event_callback callback, void *arg);
+int event_loop_set_timeout(int timer_fd, long delay_ms);
+int event_loop_call(double delay_ms, event_callback callback, void *arg);
+double event_loop_next_ms();
+int event_loop_run_once(int timeout_ms);
+int event_loop_run();
+
+/******************************************
+* Discrete-event scheduler (simulated time)
+******************************************/
+void scheduler_reset();
+double scheduler_now_ms();
+int scheduler_add_timer(double interval_ms, event_callback callback, void *arg);
+int scheduler_set_timeout(int timer, double delay_ms);
+int scheduler_call(double delay_ms, event_callback callback, void *arg);
+double scheduler_next_ms();
+int scheduler_run_once(double timeout_ms);
 
 /******************************************
 * Commands
@@ -120,4 +522,7 @@ void display();
 void disable(uint16_t id);
 void crash();
 void dump();
-void academic_integrity();
\ No newline at end of file
+void academic_integrity();
+void loglevel(const char *level);
+void reload();
+void stats();
\ No newline at end of file
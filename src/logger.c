@@ -21,16 +21,48 @@
  * Contains logging functions to be used by CSE489/589 students for PA3.
  */
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <stdio.h>
 #include <stdarg.h>
 #include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/eventfd.h>
 
 #include "../include/global.h"
 #include "../include/logger.h"
 
+#define LOG_RING_SIZE (1 << 20)		/* bytes, power of two */
+#define LOG_RECORD_LEN 1024		/* records longer than this are formatted on the heap */
+#define LOG_BATCH_US 100		/* writer delay after a wakeup, to take a burst in one write */
+
 char LOGFILE[FILEPATH_LEN];
 char DUMPFILE[FILEPATH_LEN];
+
+/*
+ * Single producer ring. The router formats records into it from its only
+ * thread; a writer thread (or a crash handler) claims [tail, head) and
+ * writes it to the long-lived log descriptor. The writer blocks on an
+ * eventfd while the ring is empty; the producer signals it only after the
+ * writer said it was about to block, and the woken writer lets a burst
+ * gather before writing, so a busy ring costs few system calls.
+ */
+static char log_ring[LOG_RING_SIZE];
+static atomic_size_t log_head;		/* next byte the producer writes */
+static atomic_size_t log_claimed;	/* bytes handed to a consumer */
+static atomic_size_t log_tail;		/* bytes written out; space before it is free */
+static int log_fd = -1;
+static int log_event = -1;		/* eventfd the idle writer blocks on */
+static atomic_int log_idle;		/* 1 once the writer is about to block */
+static atomic_int log_state;		/* 0 not started, 1 running, -1 unavailable */
+static pthread_t log_writer;
+
 void cse4589_init_log()
 {
 	/*Get hostname and build file paths*/
@@ -53,7 +85,181 @@ void cse4589_init_log()
 
 	/*Clean up*/
 	free(hostname);
-	fclose(fp);
+	pclose(fp);
+}
+
+/**
+ * Writes out whatever is queued in the ring. The writer thread and the
+ * logging thread may both drain: each claims a distinct range, and ranges
+ * are released in claim order so the producer never reuses unwritten bytes.
+ * A crash handler passes release = 0 and never waits on anyone.
+ *
+ * @param  release whether to hand the written range back to the producer
+ * @return number of bytes written
+ */
+static size_t drain_log_ring(int release)
+{
+	size_t tail, head, offset, chunk, done = 0;
+	ssize_t written;
+
+	tail = atomic_load_explicit(&log_claimed, memory_order_relaxed);
+	do {
+		head = atomic_load_explicit(&log_head, memory_order_acquire);
+		if (tail >= head)
+			return 0;
+	} while (!atomic_compare_exchange_weak(&log_claimed, &tail, head));
+
+	while (tail + done < head) {
+		offset = (tail + done) & (LOG_RING_SIZE - 1);
+		chunk = head - tail - done;
+		if (chunk > LOG_RING_SIZE - offset)
+			chunk = LOG_RING_SIZE - offset;
+		written = write(log_fd, log_ring + offset, chunk);
+		if (written <= 0)
+			break;
+		done += written;
+	}
+
+	if (release) {
+		while (atomic_load_explicit(&log_tail, memory_order_acquire) != tail)
+			sched_yield();
+		atomic_store_explicit(&log_tail, head, memory_order_release);
+	}
+	return done;
+}
+
+/**
+ * Background writer: drains the ring to the log file until the process exits,
+ * blocking until a record arrives whenever the ring is empty.
+ */
+static void *log_writer_main(void *arg)
+{
+	uint64_t count;
+
+	(void) arg;
+
+	while (1) {
+		if (drain_log_ring(1) != 0)
+			continue;
+
+		/* Look again after announcing the sleep, or a record published
+		 * just before it would wait for the next one */
+		atomic_store(&log_idle, 1);
+		atomic_thread_fence(memory_order_seq_cst);
+		if (drain_log_ring(1) != 0) {
+			atomic_store(&log_idle, 0);
+			continue;
+		}
+
+		/* A stale count only means one empty pass */
+		if (read(log_event, &count, sizeof(count)) < 0)
+			continue;
+		usleep(LOG_BATCH_US);
+	}
+
+	return NULL;
+}
+
+/**
+ * Wakes the writer if it is blocked, or about to block, on an empty ring.
+ * Called after publishing a record.
+ */
+static void wake_log_writer(void)
+{
+	uint64_t one = 1;
+
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&log_idle, memory_order_relaxed) == 0 || atomic_exchange(&log_idle, 0) == 0)
+		return;
+
+	if (write(log_event, &one, sizeof(one)) < 0)
+		ret_log = -100;
+}
+
+/**
+ * Flushes the log on fatal signals, then lets the signal take its course.
+ */
+static void log_crash_handler(int signum)
+{
+	if (atomic_load(&log_state) == 1)
+		drain_log_ring(0);
+	signal(signum, SIG_DFL);
+	raise(signum);
+}
+
+/**
+ * Opens the log once and starts the writer thread. Runs on first use so
+ * callers may set LOGFILE directly and truncate it before logging starts.
+ *
+ * @return 0 when the ring is usable, -1 otherwise
+ */
+static int start_log_writer(void)
+{
+	int state = atomic_load(&log_state);
+
+	if (state != 0)
+		return state == 1 ? 0 : -1;
+
+	log_fd = open(LOGFILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	log_event = eventfd(0, EFD_CLOEXEC);
+	if (log_fd < 0 || log_event < 0 || pthread_create(&log_writer, NULL, log_writer_main, NULL) != 0) {
+		atomic_store(&log_state, -1);
+		return -1;
+	}
+	pthread_detach(log_writer);
+
+	atexit(cse4589_flush_log);
+	signal(SIGSEGV, log_crash_handler);
+	signal(SIGBUS, log_crash_handler);
+	signal(SIGABRT, log_crash_handler);
+	signal(SIGTERM, log_crash_handler);
+	signal(SIGINT, log_crash_handler);
+
+	atomic_store(&log_state, 1);
+	return 0;
+}
+
+/**
+ * Copies one formatted record into the ring, waiting for the writer if the
+ * ring is full. Records larger than the ring are written directly.
+ */
+static void push_log_record(const char *record, size_t len)
+{
+	size_t head, offset, first;
+
+	if (len > LOG_RING_SIZE) {
+		cse4589_flush_log();
+		if (write(log_fd, record, len) < 0)
+			ret_log = -100;
+		return;
+	}
+
+	head = atomic_load_explicit(&log_head, memory_order_relaxed);
+	while (head + len - atomic_load_explicit(&log_tail, memory_order_acquire) > LOG_RING_SIZE)
+		drain_log_ring(1);
+
+	offset = head & (LOG_RING_SIZE - 1);
+	first = len < LOG_RING_SIZE - offset ? len : LOG_RING_SIZE - offset;
+	memcpy(log_ring + offset, record, first);
+	memcpy(log_ring, record + first, len - first);
+
+	atomic_store_explicit(&log_head, head + len, memory_order_release);
+	wake_log_writer();
+}
+
+/**
+ * Blocks until everything logged so far has reached the log file.
+ */
+void cse4589_flush_log()
+{
+	size_t target;
+
+	if (atomic_load(&log_state) != 1)
+		return;
+
+	target = atomic_load_explicit(&log_head, memory_order_acquire);
+	while (atomic_load_explicit(&log_tail, memory_order_acquire) < target)
+		drain_log_ring(1);
 }
 
 /**
@@ -67,6 +273,9 @@ void cse4589_init_log()
  * ret_print either contains the number of characters logged OR a negative value 
  * indicating the error code. error code -100 indicates unable to open LOGFILE.
  *
+ * The log side is formatted into a ring buffer and written to LOGFILE by a
+ * background thread; call cse4589_flush_log to wait for it.
+ *
  * @param  format Format string to be printed
  * @param  ... Variable number of arguments to replace format specifiers
  */
@@ -74,26 +283,49 @@ int ret_print, ret_log;
 void cse4589_print_and_log(char* format, ...)
 {
 	va_list args_pointer;
+	char stack_record[LOG_RECORD_LEN];
+	char *record = stack_record;
+	int framing, body, closing;
 
 	/* Print to STDOUT */
     	va_start(args_pointer, format);
    	ret_print = vprintf(format, args_pointer);
+    	va_end(args_pointer);
 
-    	/* Write to LOG File */
-    	FILE* fp;
-    	if((fp = fopen(LOGFILE, "a")) == NULL){
-    		ret_log = -100;
-    		/* clean up before exit */
-    		va_end(args_pointer);
+    	/* Queue for the LOG File */
+	if (start_log_writer() != 0) {
+		ret_log = -100;
+		return;
 	}
-	fprintf(fp, "[PA3:Start:%u]\n", (unsigned)time(NULL));
-    	va_start(args_pointer, format);
-    	ret_log = vfprintf(fp, format, args_pointer);
-	fprintf(fp, "[PA3:End]\n");
 
-    	/* clean up */
-	fclose(fp);
+	framing = snprintf(record, LOG_RECORD_LEN, "[PA3:Start:%u]\n", (unsigned)time(NULL));
+    	va_start(args_pointer, format);
+    	body = vsnprintf(record + framing, LOG_RECORD_LEN - framing, format, args_pointer);
     	va_end(args_pointer);
+	if (body < 0) {
+		ret_log = body;
+		return;
+	}
+
+	closing = sizeof("[PA3:End]\n") - 1;
+	if (framing + body + closing >= LOG_RECORD_LEN) {
+		record = (char*) malloc(framing + body + closing + 1);
+		if (record == NULL) {
+			ret_log = -100;
+			return;
+		}
+		memcpy(record, stack_record, framing);
+    		va_start(args_pointer, format);
+    		vsnprintf(record + framing, body + 1, format, args_pointer);
+    		va_end(args_pointer);
+	}
+	memcpy(record + framing + body, "[PA3:End]\n", closing);
+
+	push_log_record(record, framing + body + closing);
+	ret_log = body;
+
+	if (record != stack_record)
+		free(record);
 }
 
 /**
@@ -0,0 +1,268 @@
+/********************************************************************************
+*   FILE:   metrics.c
+*   DESC:   Runtime metrics: HDR style latency histograms and the Prometheus
+*           text format export. The counters themselves live in struct
+*           router and struct neighbor and are bumped where things happen;
+*           the stats command prints them.
+*
+*           The export is rewritten every update interval under a temporary
+*           name and renamed into place, so a scraper (e.g. node_exporter's
+*           textfile collector) never reads half a file.
+********************************************************************************/
+#include "header.h"
+
+#define HISTOGRAM_SUB_COUNT (1 << HISTOGRAM_SUB_BITS)
+#define EXPORT_MIN_BITS 10              // first exported histogram bound, about 1 us
+
+/********************************************************************************
+*   Name:   metrics_now_ns
+*   Desc:   monotonic wall clock for timing; real time even when the event
+*           loop runs on simulated time
+*   Ret:    nanoseconds
+*   Ref:    None
+********************************************************************************/
+uint64_t metrics_now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec*1000000000ULL + ts.tv_nsec;
+}
+
+/********************************************************************************
+*   Name:   histogram_index
+*   Desc:   bucket of a value: the value itself below HISTOGRAM_SUB_COUNT,
+*           then the top HISTOGRAM_SUB_BITS bits after the leading one
+*   Ret:    bucket index
+*   Ref:    None
+********************************************************************************/
+static int histogram_index(uint64_t ns)
+{
+    int shift;
+
+    if(ns < HISTOGRAM_SUB_COUNT) {
+        return (int) ns;
+    }
+    if(ns >> HISTOGRAM_MAX_BITS) {
+        return HISTOGRAM_BUCKETS - 1;
+    }
+
+    shift = 63 - __builtin_clzll(ns) - HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << HISTOGRAM_SUB_BITS) + (int) (ns >> shift) - HISTOGRAM_SUB_COUNT;
+}
+
+/********************************************************************************
+*   Name:   histogram_upper
+*   Desc:   largest value that falls in a bucket
+*   Ret:    nanoseconds
+*   Ref:    None
+********************************************************************************/
+static uint64_t histogram_upper(int index)
+{
+    int shift;
+
+    if(index < HISTOGRAM_SUB_COUNT) {
+        return index;
+    }
+
+    shift = (index >> HISTOGRAM_SUB_BITS) - 1;
+    return ((uint64_t) ((index & (HISTOGRAM_SUB_COUNT - 1)) + HISTOGRAM_SUB_COUNT + 1) << shift) - 1;
+}
+
+/********************************************************************************
+*   Name:   histogram_record
+*   Desc:   adds one value
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void histogram_record(struct histogram *histogram, uint64_t ns)
+{
+    histogram->bucket[histogram_index(ns)]++;
+    histogram->count++;
+    histogram->sum_ns += ns;
+    if(ns > histogram->max_ns) {
+        histogram->max_ns = ns;
+    }
+}
+
+/********************************************************************************
+*   Name:   histogram_percentile
+*   Desc:   value below which the given fraction of the recorded values lie,
+*           as the top of its bucket, so at most 1/16 too high
+*   Ret:    nanoseconds, 0 if nothing was recorded
+*   Ref:    None
+********************************************************************************/
+uint64_t histogram_percentile(const struct histogram *histogram, double fraction)
+{
+    uint64_t target, seen = 0;
+    int index;
+
+    if(0 == histogram->count) {
+        return 0;
+    }
+
+    target = (uint64_t) (fraction * histogram->count + 0.999999);
+    if(target < 1) {
+        target = 1;
+    }
+
+    for(index = 0; index < HISTOGRAM_BUCKETS; index++) {
+        seen += histogram->bucket[index];
+        if(seen >= target) {
+            break;
+        }
+    }
+
+    return histogram_upper(index) < histogram->max_ns ? histogram_upper(index) : histogram->max_ns;
+}
+
+/********************************************************************************
+*   Name:   write_counter
+*   Desc:   one router wide counter in Prometheus text format
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void write_counter(FILE *file, const char *name, const char *help, uint64_t value)
+{
+    fprintf(file, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    fprintf(file, "%s{router=\"%d\"} %" PRIu64 "\n", name, router_current()->id, value);
+}
+
+/********************************************************************************
+*   Name:   write_neighbor_counter
+*   Desc:   one per-neighbor counter, the field at offset in struct
+*           neighbor_metrics, in Prometheus text format
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void write_neighbor_counter(FILE *file, const char *name, const char *help, size_t offset)
+{
+    uint64_t value;
+    int slot;
+
+    fprintf(file, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for(slot = 0; slot < router_current()->num_neighbors; slot++) {
+        memcpy(&value, (const char*) &router_current()->neighbors[slot].metrics + offset, sizeof(value));
+        fprintf(file, "%s{router=\"%d\",neighbor=\"%d\"} %" PRIu64 "\n", name, router_current()->id,
+                router_current()->neighbors[slot].id, value);
+    }
+}
+
+/********************************************************************************
+*   Name:   write_histogram
+*   Desc:   a histogram in Prometheus text format, in seconds. Bounds are the
+*           powers of two ns from about 1 us; each is the top of an HDR
+*           bucket, so the cumulative counts are exact.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void write_histogram(FILE *file, const char *name, const char *help, const struct histogram *histogram)
+{
+    uint64_t seen = 0;
+    int bits, index = 0, end;
+
+    fprintf(file, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for(bits = EXPORT_MIN_BITS; bits < HISTOGRAM_MAX_BITS; bits++) {
+        // Buckets below 2^bits ns
+        end = (bits - HISTOGRAM_SUB_BITS + 1) << HISTOGRAM_SUB_BITS;
+        for(; index < end; index++) {
+            seen += histogram->bucket[index];
+        }
+        fprintf(file, "%s_bucket{router=\"%d\",le=\"%.9g\"} %" PRIu64 "\n", name, router_current()->id,
+                ((1ULL << bits) - 1) / 1e9, seen);
+    }
+    fprintf(file, "%s_bucket{router=\"%d\",le=\"+Inf\"} %" PRIu64 "\n", name, router_current()->id, histogram->count);
+    fprintf(file, "%s_sum{router=\"%d\"} %.9f\n", name, router_current()->id, histogram->sum_ns / 1e9);
+    fprintf(file, "%s_count{router=\"%d\"} %" PRIu64 "\n", name, router_current()->id, histogram->count);
+}
+
+/********************************************************************************
+*   Name:   write_metrics_file
+*   Desc:   writes every metric in Prometheus text format to path, through a
+*           temporary file renamed over it
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+int write_metrics_file(const char *path)
+{
+    const struct router_metrics *metrics = &router_current()->metrics;
+    char *temp;
+    FILE *file;
+    int rv = SUCCESS;
+
+    temp = (char*) malloc(strlen(path) + sizeof(".tmp"));
+    if(NULL == temp) {
+        return FAILURE;
+    }
+    sprintf(temp, "%s.tmp", path);
+
+    file = fopen(temp, "w");
+    if(NULL == file) {
+        free(temp);
+        return FAILURE;
+    }
+
+    write_neighbor_counter(file, "dvrouter_received_packets_total", "Update datagrams received from the neighbor.",
+            offsetof(struct neighbor_metrics, packets_in));
+    write_neighbor_counter(file, "dvrouter_received_bytes_total", "Bytes of update datagrams received from the neighbor.",
+            offsetof(struct neighbor_metrics, bytes_in));
+    write_neighbor_counter(file, "dvrouter_sent_packets_total", "Update datagrams sent to the neighbor.",
+            offsetof(struct neighbor_metrics, packets_out));
+    write_neighbor_counter(file, "dvrouter_sent_bytes_total", "Bytes of update datagrams sent to the neighbor.",
+            offsetof(struct neighbor_metrics, bytes_out));
+    write_counter(file, "dvrouter_route_changes_total", "Changes to advertised route costs.", router_current()->route_changes);
+    write_counter(file, "dvrouter_relaxations_total", "Route relaxations over a neighbor, per routing table row.", metrics->relaxations);
+    write_counter(file, "dvrouter_link_timeouts_total", "Neighbors taken down after their updates stopped.", metrics->link_timeouts);
+    write_counter(file, "dvrouter_send_failures_total", "Update datagrams the socket failed to send.", metrics->send_failures);
+    write_counter(file, "dvrouter_rejected_packets_total", "Received datagrams that were malformed or not from a linked neighbor.", metrics->rejected);
+    write_histogram(file, "dvrouter_packet_processing_seconds", "Time to process one received datagram.", &metrics->packet_time);
+    write_histogram(file, "dvrouter_tick_seconds", "Time taken by one periodic update.", &metrics->tick_time);
+
+    if(0 != fclose(file) || 0 != rename(temp, path)) {
+        unlink(temp);
+        rv = FAILURE;
+    }
+
+    free(temp);
+    return rv;
+}
+
+/********************************************************************************
+*   Name:   export_metrics
+*   Desc:   timer callback rewriting the metrics file; a failure is reported
+*           once, not every interval
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void export_metrics(int intervals, void *arg)
+{
+    static int failing = FALSE;
+
+    (void) intervals;
+
+    if(SUCCESS == write_metrics_file((const char*) arg)) {
+        failing = FALSE;
+    }
+    else if(failing != TRUE) {
+        fprintf(stderr, "Failed to write metrics to %s\n", (const char*) arg);
+        failing = TRUE;
+    }
+}
+
+/********************************************************************************
+*   Name:   init_metrics_export
+*   Desc:   writes the metrics to path now and then every interval. path
+*           must outlive the router.
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+int init_metrics_export(const char *path, long interval_sec)
+{
+    export_metrics(1, (void*) path);
+
+    if(FAILURE == event_loop_add_timer(interval_sec, export_metrics, (void*) path)) {
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
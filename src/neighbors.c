@@ -0,0 +1,602 @@
+/********************************************************************************
+*   FILE:   neighbors.c
+*   DESC:   Per-neighbor distance vector store and route selection. Every
+*           neighbor's last advertised vector is kept, so a route is always
+*           the minimum over all live neighbors of link cost + advertised cost
+*           and can fail over without waiting for new messages.
+********************************************************************************/
+#include "header.h"
+
+
+/********************************************************************************
+*   Name:   find_neighbor
+*   Desc:   Finds a neighbor by router id
+*   Ret:    neighbor slot or FAILURE
+*   Ref:    None
+********************************************************************************/
+int find_neighbor(uint16_t id)
+{
+    if(id >= router_current()->neighbor_slot_size || router_current()->neighbor_slot[id] == NO_SLOT) {
+        return FAILURE;
+    }
+
+    return router_current()->neighbor_slot[id];
+}
+
+/********************************************************************************
+*   Name:   add_neighbor
+*   Desc:   Adds a neighbor with an empty (all INF) vector
+*   Ret:    neighbor slot
+*   Ref:    None
+********************************************************************************/
+static int add_neighbor(uint16_t id)
+{
+    struct neighbor *grown;
+    int *grown_slot;
+    int slot, index, size;
+
+    // Covers the largest neighbor id rather than all of ID_SPACE
+    if(id >= router_current()->neighbor_slot_size) {
+        size = router_current()->neighbor_slot_size ? router_current()->neighbor_slot_size : RTABLE_INIT_SIZE;
+        while(size <= id) {
+            size *= 2;
+        }
+        grown_slot = (int*) realloc(router_current()->neighbor_slot, size*sizeof(int));
+        if(NULL == grown_slot) {
+            fprintf(stderr, "Failed to allocate neighbor table\n");
+            exit(EXIT_FAILURE);
+        }
+        for(index = router_current()->neighbor_slot_size; index < size; index++) {
+            grown_slot[index] = NO_SLOT;
+        }
+        router_current()->neighbor_slot = grown_slot;
+        router_current()->neighbor_slot_size = size;
+    }
+
+    if(router_current()->num_neighbors == router_current()->neighbor_capacity) {
+        router_current()->neighbor_capacity = router_current()->neighbor_capacity ? 2*router_current()->neighbor_capacity : 8;
+        grown = (struct neighbor*) realloc(router_current()->neighbors, router_current()->neighbor_capacity*sizeof(struct neighbor));
+        if(NULL == grown) {
+            fprintf(stderr, "Failed to allocate neighbor table\n");
+            exit(EXIT_FAILURE);
+        }
+        router_current()->neighbors = grown;
+    }
+
+    // Slots share the 16-bit nexthop column with NEXTHOP_SELF / NEXTHOP_NONE
+    if(router_current()->num_neighbors >= NEXTHOP_SELF) {
+        fprintf(stderr, "Too many neighbors\n");
+        exit(EXIT_FAILURE);
+    }
+
+    slot = router_current()->num_neighbors++;
+    router_current()->neighbors[slot].id = id;
+    router_current()->neighbors[slot].link_cost = INF;
+    router_current()->neighbors[slot].disabled = FALSE;
+    router_current()->neighbors[slot].alive = TRUE;
+    router_current()->neighbors[slot].counter = COUNTER_DEAD;
+    router_current()->neighbors[slot].sequence = 0;
+    router_current()->neighbors[slot].sequenced = FALSE;
+    router_current()->neighbors[slot].accepts = WIRE_V1;
+    memset(&router_current()->neighbors[slot].metrics, 0, sizeof(struct neighbor_metrics));
+    router_current()->neighbors[slot].vector = (uint16_t*) aligned_resize(NULL, 0, router_current()->routing_table.capacity*sizeof(uint16_t));
+    if(NULL == router_current()->neighbors[slot].vector) {
+        fprintf(stderr, "Failed to allocate neighbor vector\n");
+        exit(EXIT_FAILURE);
+    }
+    for(index = 0; index < router_current()->routing_table.capacity; index++) {
+        router_current()->neighbors[slot].vector[index] = INF;
+    }
+
+    router_current()->neighbor_slot[id] = slot;
+    return slot;
+}
+
+/********************************************************************************
+*   Name:   neighbor_link_cost
+*   Desc:   cost of the direct link to a neighbor as routing sees it
+*   Ret:    link cost, INF if disabled or timed out
+*   Ref:    None
+********************************************************************************/
+uint16_t neighbor_link_cost(int slot)
+{
+    if(router_current()->neighbors[slot].alive != TRUE) {
+        return INF;
+    }
+
+    return router_current()->neighbors[slot].link_cost;
+}
+
+/********************************************************************************
+*   Name:   nexthop_slot
+*   Desc:   nexthop column value for a router id
+*   Ret:    neighbor slot, NEXTHOP_SELF for this router, NEXTHOP_NONE otherwise
+*   Ref:    None
+********************************************************************************/
+uint16_t nexthop_slot(int id)
+{
+    int slot;
+
+    if(id == router_current()->id) {
+        return NEXTHOP_SELF;
+    }
+    if(id < 0 || id >= ID_SPACE || (slot = find_neighbor(id)) == FAILURE) {
+        return NEXTHOP_NONE;
+    }
+
+    return slot;
+}
+
+/********************************************************************************
+*   Name:   nexthop_id
+*   Desc:   router id of a row's next hop
+*   Ret:    router id, INVALID_ROUTER_ID if unreachable
+*   Ref:    None
+********************************************************************************/
+int nexthop_id(int row)
+{
+    uint16_t nexthop = router_current()->routing_table.nexthop[row];
+
+    if(nexthop == NEXTHOP_NONE) {
+        return INVALID_ROUTER_ID;
+    }
+    if(nexthop == NEXTHOP_SELF) {
+        return router_current()->id;
+    }
+
+    return router_current()->neighbors[nexthop].id;
+}
+
+/********************************************************************************
+*   Name:   add_cost
+*   Desc:   adds two costs, saturating at INF
+*   Ret:    sum
+*   Ref:    None
+********************************************************************************/
+static uint16_t add_cost(uint16_t a, uint16_t b)
+{
+    uint32_t sum = (uint32_t) a + b;
+
+    return sum >= INF ? INF : (uint16_t) sum;
+}
+
+/********************************************************************************
+*   Name:   recompute_route
+*   Desc:   Bellman-Ford relaxation of one row over every live neighbor
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void recompute_route(int row)
+{
+    uint16_t id = router_current()->routing_table.entry[row].id;
+    uint16_t best_cost = INF, cost, link;
+    uint16_t best_nexthop = NEXTHOP_NONE;
+    int slot;
+
+    if(id == router_current()->id) {
+        return;
+    }
+
+    for(slot = 0; slot < router_current()->num_neighbors; slot++) {
+
+        link = neighbor_link_cost(slot);
+        if(link == INF) {
+            continue;
+        }
+
+        // Direct link; nexthop is ourselves by this table's convention
+        if(router_current()->neighbors[slot].id == id && link < best_cost) {
+            best_cost = link;
+            best_nexthop = NEXTHOP_SELF;
+        }
+
+        cost = add_cost(link, router_current()->neighbors[slot].vector[row]);
+        if(cost < best_cost) {
+            best_cost = cost;
+            best_nexthop = slot;
+        }
+    }
+    router_current()->metrics.relaxations += router_current()->num_neighbors;
+
+    set_route(row, best_nexthop, best_cost);
+}
+
+/********************************************************************************
+*   Name:   recompute_routes
+*   Desc:   recomputes every row, after a link cost or liveness change
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void recompute_routes()
+{
+    int row;
+
+    for(row = 0; row < router_current()->num_entries; row++) {
+        recompute_route(row);
+    }
+}
+
+/********************************************************************************
+*   Name:   set_link_cost
+*   Desc:   sets the configured cost of the direct link to id (INF disables
+*           it), adding id as a neighbor if needed, and reroutes. Only this
+*           neighbor's contribution changed, so one relaxation pass is enough.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void set_link_cost(uint16_t id, uint16_t cost)
+{
+    int slot;
+
+    slot = find_neighbor(id);
+    if(slot == FAILURE) {
+        if(cost == INF) {
+            return;
+        }
+        slot = add_neighbor(id);
+    }
+
+    router_current()->neighbors[slot].link_cost = cost;
+    router_current()->neighbors[slot].alive = TRUE;
+    if(cost == INF) {
+        clear_neighbor_vector(slot);
+    }
+    else {
+        // A link brought up or changed has that long to be heard from
+        router_current()->neighbors[slot].counter = 0;
+        router_current()->neighbors[slot].disabled = FALSE;
+    }
+
+    relax_neighbor(slot);
+}
+
+/********************************************************************************
+*   Name:   set_neighbor_alive
+*   Desc:   marks a neighbor as timed out (FALSE) or heard from again (TRUE).
+*           A dead neighbor's vector, advertisement number and wire version
+*           are dropped; it may come back as a different build.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void set_neighbor_alive(int slot, int alive)
+{
+    if(router_current()->neighbors[slot].alive == alive) {
+        return;
+    }
+
+    router_current()->neighbors[slot].alive = alive;
+    if(alive != TRUE) {
+        clear_neighbor_vector(slot);
+        router_current()->neighbors[slot].sequenced = FALSE;
+        router_current()->neighbors[slot].accepts = WIRE_V1;
+    }
+
+    relax_neighbor(slot);
+}
+
+/********************************************************************************
+*   Name:   mark_neighbor_dead
+*   Desc:   after a link to id was taken down by hand, stops timing the
+*           neighbor out, as it is not expected to be heard from
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void mark_neighbor_dead(uint16_t id)
+{
+    int slot = find_neighbor(id);
+
+    if(slot == FAILURE) {
+        return;
+    }
+
+    set_neighbor_alive(slot, FALSE);
+    router_current()->neighbors[slot].counter = COUNTER_DEAD;
+}
+
+/********************************************************************************
+*   Name:   clear_neighbor_vector
+*   Desc:   forgets everything a neighbor advertised
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void clear_neighbor_vector(int slot)
+{
+    int row;
+
+    for(row = 0; row < router_current()->routing_table.capacity; row++) {
+        router_current()->neighbors[slot].vector[row] = INF;
+    }
+}
+
+/********************************************************************************
+*   Name:   accept_segment
+*   Desc:   checks a segment's advertisement number against the newest heard
+*           from the neighbor. A segment of an advertisement that a newer one
+*           overtook would bring back older costs, so it is refused. Lagging
+*           by more than SEGMENT_REORDER_WINDOW means the neighbor restarted
+*           and numbers from somewhere else.
+*   Ret:    TRUE to apply the segment, FALSE to drop it
+*   Ref:    None
+********************************************************************************/
+int accept_segment(int slot, uint32_t sequence)
+{
+    struct neighbor *neighbor = &router_current()->neighbors[slot];
+    uint32_t behind = neighbor->sequence - sequence;
+
+    if(neighbor->sequenced == TRUE && behind > 0 && behind <= SEGMENT_REORDER_WINDOW) {
+        return FALSE;
+    }
+
+    neighbor->sequence = sequence;
+    neighbor->sequenced = TRUE;
+    return TRUE;
+}
+
+/********************************************************************************
+*   Name:   set_neighbor_accepts
+*   Desc:   records the highest wire version a neighbor accepts, from the
+*           header of its latest message
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void set_neighbor_accepts(int slot, int accepts)
+{
+    int before = neighbor_wire_version(slot);
+
+    router_current()->neighbors[slot].accepts = accepts == WIRE_V2 ? WIRE_V2 : WIRE_V1;
+
+    // It has seen none of our addresses in v2 yet
+    if(neighbor_wire_version(slot) == WIRE_V2 && before != WIRE_V2) {
+        reannounce_addresses();
+    }
+}
+
+/********************************************************************************
+*   Name:   neighbor_wire_version
+*   Desc:   the wire version advertisements to a neighbor go out in: the
+*           highest both ends accept
+*   Ret:    WIRE_V1 or WIRE_V2
+*   Ref:    None
+********************************************************************************/
+int neighbor_wire_version(int slot)
+{
+    if(router_current()->neighbors[slot].accepts < router_current()->wire_version) {
+        return router_current()->neighbors[slot].accepts;
+    }
+
+    return router_current()->wire_version;
+}
+
+/********************************************************************************
+*   Name:   store_neighbor_cost
+*   Desc:   records one advertised cost and reroutes that row if it changed
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void store_neighbor_cost(int slot, int row, uint16_t cost)
+{
+    if(router_current()->neighbors[slot].vector[row] == cost) {
+        return;
+    }
+
+    router_current()->neighbors[slot].vector[row] = cost;
+    recompute_route(row);
+}
+
+/********************************************************************************
+*   Name:   flagged_row
+*   Desc:   next row flagged in a relaxation bitmap, clearing it
+*   Ret:    row or FAILURE when none are left
+*   Ref:    None
+********************************************************************************/
+static int flagged_row(uint32_t *bits, int words, int *word)
+{
+    int bit;
+
+    for(; *word < words; (*word)++) {
+        if(bits[*word]) {
+            bit = __builtin_ctz(bits[*word]) & ~1;
+            bits[*word] &= ~(3u << bit);
+            return *word*16 + bit/2;
+        }
+    }
+
+    return FAILURE;
+}
+
+/********************************************************************************
+*   Name:   relax_neighbor
+*   Desc:   brings every route up to date with one neighbor's current vector
+*           and link cost in a single vectorized pass. Rows that got worse
+*           through this neighbor fall back to full reselection.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void relax_neighbor(int slot)
+{
+    static uint32_t *changed_bits = NULL, *reselect_bits = NULL;
+    static int bits_words = 0;
+
+    uint32_t *grown;
+    int row, word, words;
+
+    words = (router_current()->num_entries + 15) / 16;
+    if(words > bits_words) {
+        grown = (uint32_t*) realloc(changed_bits, words*sizeof(uint32_t));
+        if(NULL == grown) {
+            recompute_routes();
+            return;
+        }
+        changed_bits = grown;
+        grown = (uint32_t*) realloc(reselect_bits, words*sizeof(uint32_t));
+        if(NULL == grown) {
+            recompute_routes();
+            return;
+        }
+        reselect_bits = grown;
+        bits_words = words;
+    }
+    memset(changed_bits, 0, words*sizeof(uint32_t));
+    memset(reselect_bits, 0, words*sizeof(uint32_t));
+
+    get_relax_kernel()(router_current()->neighbors[slot].vector, neighbor_link_cost(slot), slot,
+            router_current()->routing_table.cost, router_current()->routing_table.nexthop,
+            0, router_current()->num_entries, changed_bits, reselect_bits);
+    router_current()->metrics.relaxations += router_current()->num_entries;
+
+    // The kernel already wrote the improved rows
+    word = 0;
+    while((row = flagged_row(changed_bits, words, &word)) != FAILURE) {
+        invalidate_advertisement();
+        mark_route_changed(router_current()->routing_table.entry[row].id);
+    }
+
+    word = 0;
+    while((row = flagged_row(reselect_bits, words, &word)) != FAILURE) {
+        recompute_route(row);
+    }
+
+    // The direct route to the neighbor keeps ourselves as nexthop
+    row = find_entry_by_id(router_current()->neighbors[slot].id);
+    if(row != FAILURE) {
+        recompute_route(row);
+    }
+}
+
+/********************************************************************************
+*   Name:   bulk_neighbor_update
+*   Desc:   decides how an update of count entries is stored. Small updates
+*           reselect row by row as they go; large ones only fill the
+*           neighbor's vector for relax_neighbor.
+*   Ret:    TRUE to store in bulk, FALSE row by row
+*   Ref:    None
+********************************************************************************/
+int bulk_neighbor_update(int slot, int count)
+{
+    if(count >= router_current()->num_entries / RELAX_MIN_FRACTION && neighbor_link_cost(slot) != INF) {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/********************************************************************************
+*   Name:   store_advertised_cost
+*   Desc:   records one advertised cost, as bulk_neighbor_update decided
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void store_advertised_cost(int slot, uint16_t id, uint16_t cost, int bulk)
+{
+    int row;
+
+    LOG_DEBUG("%-15d%-15d\n", id, cost);
+
+    row = find_entry_by_id(id);
+    if(row == FAILURE) {
+        return;
+    }
+
+    if(bulk == TRUE) {
+        router_current()->neighbors[slot].vector[row] = cost;
+    }
+    else {
+        store_neighbor_cost(slot, row, cost);
+    }
+}
+
+/********************************************************************************
+*   Name:   store_neighbor_update
+*   Desc:   one pass over the entries of an update message, read in place from
+*           the datagram, handing each to store_advertised_cost
+*   Ret:    TRUE if the vector still has to be relaxed, FALSE otherwise
+*   Ref:    None
+********************************************************************************/
+int store_neighbor_update(int slot, const char *entries, int count)
+{
+    int bulk = bulk_neighbor_update(slot, count);
+    const char *entry = entries;
+    uint16_t id, cost;
+    int index;
+
+    for(index = 0; index < count; index++, entry += sizeof(struct updates)) {
+        memcpy(&id, entry + offsetof(struct updates, id), sizeof(id));
+        memcpy(&cost, entry + offsetof(struct updates, cost), sizeof(cost));
+        store_advertised_cost(slot, ntohs(id), ntohs(cost), bulk);
+    }
+
+    return bulk;
+}
+
+/********************************************************************************
+*   Name:   apply_neighbor_update
+*   Desc:   records a neighbor's advertised costs, given as update message
+*           entries, and reroutes what they affect
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void apply_neighbor_update(int slot, const char *entries, int count)
+{
+    if(store_neighbor_update(slot, entries, count) == TRUE) {
+        relax_neighbor(slot);
+    }
+}
+
+/********************************************************************************
+*   Name:   resize_neighbor_vectors
+*   Desc:   follows a routing table capacity change
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+int resize_neighbor_vectors(int old_capacity, int new_capacity)
+{
+    uint16_t *grown;
+    int slot, row;
+
+    for(slot = 0; slot < router_current()->num_neighbors; slot++) {
+        grown = (uint16_t*) aligned_resize(router_current()->neighbors[slot].vector, old_capacity*sizeof(uint16_t), new_capacity*sizeof(uint16_t));
+        if(NULL == grown) {
+            return FAILURE;
+        }
+        for(row = old_capacity; row < new_capacity; row++) {
+            grown[row] = INF;
+        }
+        router_current()->neighbors[slot].vector = grown;
+    }
+
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   insert_neighbor_vector_row
+*   Desc:   follows a routing table insert at row; the new row is unknown (INF)
+*           to every neighbor until it advertises it
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void insert_neighbor_vector_row(int row)
+{
+    uint16_t *vector;
+    int slot;
+
+    for(slot = 0; slot < router_current()->num_neighbors; slot++) {
+        vector = router_current()->neighbors[slot].vector;
+        memmove(&vector[row+1], &vector[row], (router_current()->num_entries-1-row)*sizeof(uint16_t));
+        vector[row] = INF;
+    }
+}
+
+/********************************************************************************
+*   Name:   clear_neighbor_vectors
+*   Desc:   forgets every advertised vector, used when rows are reordered
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void clear_neighbor_vectors()
+{
+    int slot;
+
+    for(slot = 0; slot < router_current()->num_neighbors; slot++) {
+        clear_neighbor_vector(slot);
+    }
+}
@@ -0,0 +1,181 @@
+/********************************************************************************
+*   FILE:   relax.c
+*   DESC:   Relaxation kernels. One call relaxes a whole neighbor vector
+*           against the routing table's cost / nexthop columns:
+*
+*               candidate = link + vector[row]      (saturating at INF)
+*               candidate <  cost[row]              -> take it, flag changed
+*               candidate >  cost[row] via neighbor -> flag for reselection
+*
+*           Flags are returned as bitmaps with one 32-bit word per 16 rows and
+*           two bits per row (bit 2*(row%16) and the one above it). Callers
+*           must zero the bitmaps. The best kernel for the CPU is picked at
+*           runtime.
+********************************************************************************/
+#include "header.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_KERNELS
+#endif
+
+/********************************************************************************
+*   Name:   relax_vector_scalar
+*   Desc:   portable kernel, also used for the tails of the SIMD ones
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void relax_vector_scalar(const uint16_t *vector, uint16_t link, uint16_t via, uint16_t *cost, uint16_t *nexthop, int from, int rows, uint32_t *changed, uint32_t *reselect)
+{
+    uint32_t candidate;
+    int row;
+
+    for(row = from; row < rows; row++) {
+
+        candidate = (uint32_t) vector[row] + link;
+        if(candidate > INF) {
+            candidate = INF;
+        }
+
+        if(candidate < cost[row]) {
+            cost[row] = (uint16_t) candidate;
+            nexthop[row] = via;
+            changed[row / 16] |= 3u << (2 * (row % 16));
+        }
+        else if(candidate > cost[row] && nexthop[row] == via) {
+            reselect[row / 16] |= 3u << (2 * (row % 16));
+        }
+    }
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/********************************************************************************
+*   Name:   relax_vector_sse41
+*   Desc:   8 rows per step with SSE4.1 unsigned min and saturating add
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+__attribute__((target("sse4.1")))
+void relax_vector_sse41(const uint16_t *vector, uint16_t link, uint16_t via, uint16_t *cost, uint16_t *nexthop, int from, int rows, uint32_t *changed, uint32_t *reselect)
+{
+    __m128i link16 = _mm_set1_epi16((short) link);
+    __m128i via16 = _mm_set1_epi16((short) via);
+    __m128i all = _mm_set1_epi16(-1);
+    __m128i vec, old, hop, candidate, best, better, worse;
+    int row = from;
+
+    // Aligned start keeps each step inside one bitmap word
+    if(row % 8) {
+        relax_vector_scalar(vector, link, via, cost, nexthop, row, row + 8 - row % 8 < rows ? row + 8 - row % 8 : rows, changed, reselect);
+        row += 8 - row % 8;
+    }
+
+    for(; row + 8 <= rows; row += 8) {
+
+        vec = _mm_loadu_si128((const __m128i*) &vector[row]);
+        old = _mm_loadu_si128((const __m128i*) &cost[row]);
+        hop = _mm_loadu_si128((const __m128i*) &nexthop[row]);
+
+        candidate = _mm_adds_epu16(vec, link16);
+        best = _mm_min_epu16(candidate, old);
+        better = _mm_xor_si128(_mm_cmpeq_epi16(best, old), all);
+        worse = _mm_xor_si128(_mm_cmpeq_epi16(best, candidate), all);
+        worse = _mm_and_si128(worse, _mm_cmpeq_epi16(hop, via16));
+
+        if(_mm_movemask_epi8(better)) {
+            _mm_storeu_si128((__m128i*) &cost[row], best);
+            _mm_storeu_si128((__m128i*) &nexthop[row], _mm_blendv_epi8(hop, via16, better));
+            changed[row / 16] |= (uint32_t) _mm_movemask_epi8(better) << (2 * (row % 16));
+        }
+        reselect[row / 16] |= (uint32_t) _mm_movemask_epi8(worse) << (2 * (row % 16));
+    }
+
+    relax_vector_scalar(vector, link, via, cost, nexthop, row, rows, changed, reselect);
+}
+
+/********************************************************************************
+*   Name:   relax_vector_avx2
+*   Desc:   16 rows per step with AVX2 unsigned min and saturating add
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+__attribute__((target("avx2")))
+void relax_vector_avx2(const uint16_t *vector, uint16_t link, uint16_t via, uint16_t *cost, uint16_t *nexthop, int from, int rows, uint32_t *changed, uint32_t *reselect)
+{
+    __m256i link16 = _mm256_set1_epi16((short) link);
+    __m256i via16 = _mm256_set1_epi16((short) via);
+    __m256i all = _mm256_set1_epi16(-1);
+    __m256i vec, old, hop, candidate, best, better, worse;
+    int row = from;
+
+    // Aligned start keeps each step inside one bitmap word
+    if(row % 16) {
+        relax_vector_scalar(vector, link, via, cost, nexthop, row, row + 16 - row % 16 < rows ? row + 16 - row % 16 : rows, changed, reselect);
+        row += 16 - row % 16;
+    }
+
+    for(; row + 16 <= rows; row += 16) {
+
+        vec = _mm256_loadu_si256((const __m256i*) &vector[row]);
+        old = _mm256_loadu_si256((const __m256i*) &cost[row]);
+        hop = _mm256_loadu_si256((const __m256i*) &nexthop[row]);
+
+        candidate = _mm256_adds_epu16(vec, link16);
+        best = _mm256_min_epu16(candidate, old);
+        better = _mm256_xor_si256(_mm256_cmpeq_epi16(best, old), all);
+        worse = _mm256_xor_si256(_mm256_cmpeq_epi16(best, candidate), all);
+        worse = _mm256_and_si256(worse, _mm256_cmpeq_epi16(hop, via16));
+
+        if(!_mm256_testz_si256(better, better)) {
+            _mm256_storeu_si256((__m256i*) &cost[row], best);
+            _mm256_storeu_si256((__m256i*) &nexthop[row], _mm256_blendv_epi8(hop, via16, better));
+            changed[row / 16] |= (uint32_t) _mm256_movemask_epi8(better);
+        }
+        reselect[row / 16] |= (uint32_t) _mm256_movemask_epi8(worse);
+    }
+
+    relax_vector_scalar(vector, link, via, cost, nexthop, row, rows, changed, reselect);
+}
+
+#else
+
+void relax_vector_sse41(const uint16_t *vector, uint16_t link, uint16_t via, uint16_t *cost, uint16_t *nexthop, int from, int rows, uint32_t *changed, uint32_t *reselect)
+{
+    relax_vector_scalar(vector, link, via, cost, nexthop, from, rows, changed, reselect);
+}
+
+void relax_vector_avx2(const uint16_t *vector, uint16_t link, uint16_t via, uint16_t *cost, uint16_t *nexthop, int from, int rows, uint32_t *changed, uint32_t *reselect)
+{
+    relax_vector_scalar(vector, link, via, cost, nexthop, from, rows, changed, reselect);
+}
+
+#endif
+
+/********************************************************************************
+*   Name:   get_relax_kernel
+*   Desc:   picks the widest kernel the CPU supports, once
+*   Ret:    kernel
+*   Ref:    None
+********************************************************************************/
+relax_kernel get_relax_kernel()
+{
+    static relax_kernel kernel = NULL;
+
+    if(NULL != kernel) {
+        return kernel;
+    }
+
+    kernel = relax_vector_scalar;
+#ifdef HAVE_X86_KERNELS
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2")) {
+        kernel = relax_vector_avx2;
+    }
+    else if(__builtin_cpu_supports("sse4.1")) {
+        kernel = relax_vector_sse41;
+    }
+#endif
+
+    return kernel;
+}
@@ -0,0 +1,77 @@
+/********************************************************************************
+*   FILE:   router.c
+*   DESC:   Router instances. All routing state lives in struct router and the
+*           routing code works on whichever instance is selected. A router
+*           process uses the default instance; the simulator runs many.
+********************************************************************************/
+#include "header.h"
+
+#define ROUTER_DEFAULTS { .send_sock = -1, .advertisement_dirty = TRUE, .wire_version = WIRE_V1, .compact = { .dirty = TRUE }, \
+                         .trigger_fd = -1, .trigger_armed = FALSE }
+
+static struct router default_router = ROUTER_DEFAULTS;
+struct router *current_router = &default_router;
+
+/********************************************************************************
+*   Name:   router_init
+*   Desc:   sets up an empty router instance: no routes, no neighbors, no
+*           socket and no triggered updates
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void router_init(struct router *router)
+{
+    static const struct router defaults = ROUTER_DEFAULTS;
+
+    *router = defaults;
+}
+
+/********************************************************************************
+*   Name:   router_select
+*   Desc:   makes router the instance router_current returns
+*   Ret:    the previously selected instance
+*   Ref:    None
+********************************************************************************/
+struct router *router_select(struct router *router)
+{
+    struct router *previous = current_router;
+
+    current_router = router;
+    return previous;
+}
+
+/********************************************************************************
+*   Name:   router_free
+*   Desc:   releases everything an instance allocated and leaves it empty.
+*           The instance must not be selected afterwards without router_init.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void router_free(struct router *router)
+{
+    int slot;
+
+    for(slot = 0; slot < router->num_neighbors; slot++) {
+        free(router->neighbors[slot].vector);
+    }
+    free(router->neighbors);
+    free(router->neighbor_slot);
+
+    free(router->routing_table.entry);
+    free(router->routing_table.cost);
+    free(router->routing_table.nexthop);
+    free(router->routing_table.id_slot);
+    free(router->routing_table.addr_slot);
+
+    free(router->advertisement);
+    free_compact_advertisement(&router->compact);
+    free(router->announced_flag);
+    free(router->changed_ids);
+    free(router->changed_flag);
+
+    if(-1 != router->send_sock) {
+        close(router->send_sock);
+    }
+
+    router_init(router);
+}
@@ -0,0 +1,288 @@
+/********************************************************************************
+*   FILE:   scheduler.c
+*   DESC:   Discrete-event scheduler behind the event loop's timers when it
+*           runs in simulated time. Events are kept in a binary heap ordered
+*           by (time, sequence), so events at the same instant run in the
+*           order they were scheduled and every run is reproducible. The
+*           clock jumps straight to the next event; nothing waits.
+*
+*           Each event remembers the router that was selected when it was
+*           scheduled and selects it again before running, so timers set by
+*           one of many simulated routers fire for that router.
+********************************************************************************/
+#include "header.h"
+
+struct scheduled_event {
+	double time;                        // simulated milliseconds
+	unsigned long sequence;             // scheduling order, breaks ties
+	int timer;                          // timer handle, NO_SLOT for a one-shot call
+	unsigned generation;                // timer arming this event belongs to
+	event_callback callback;            // one-shot calls only
+	void *arg;
+	struct router *router;              // selected while the event runs
+};
+
+struct scheduler_timer {
+	event_callback callback;
+	void *arg;
+	struct router *router;
+	double interval_ms;                 // 0 for a one-shot timeout
+	unsigned generation;                // bumped on every (re)arm; older events are stale
+};
+
+static struct scheduled_event *events = NULL;
+static int num_events = 0;
+static int event_capacity = 0;
+static struct scheduler_timer *timers = NULL;
+static int num_timers = 0;
+static int timer_capacity = 0;
+static unsigned long sequence = 0;
+static double clock_ms = 0;
+
+/********************************************************************************
+*   Name:   event_before
+*   Desc:   heap order
+*   Ret:    non-zero if a runs before b
+*   Ref:    None
+********************************************************************************/
+static int event_before(const struct scheduled_event *a, const struct scheduled_event *b)
+{
+    return a->time < b->time || (a->time == b->time && a->sequence < b->sequence);
+}
+
+/********************************************************************************
+*   Name:   push_event
+*   Desc:   adds an event to the heap
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+static int push_event(double time, int timer, event_callback callback, void *arg)
+{
+    struct scheduled_event *grown, event;
+    int index, parent;
+
+    if(num_events == event_capacity) {
+        event_capacity = event_capacity ? 2*event_capacity : 1024;
+        grown = (struct scheduled_event*) realloc(events, event_capacity*sizeof(struct scheduled_event));
+        if(NULL == grown) {
+            fprintf(stderr, "Failed to allocate scheduler events\n");
+            return FAILURE;
+        }
+        events = grown;
+    }
+
+    event.time = time;
+    event.sequence = sequence++;
+    event.timer = timer;
+    event.generation = timer == NO_SLOT ? 0 : timers[timer].generation;
+    event.callback = callback;
+    event.arg = arg;
+    event.router = current_router;
+
+    index = num_events++;
+    while(index > 0) {
+        parent = (index - 1) / 2;
+        if(!event_before(&event, &events[parent])) {
+            break;
+        }
+        events[index] = events[parent];
+        index = parent;
+    }
+    events[index] = event;
+
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   pop_event
+*   Desc:   removes the earliest event from the heap
+*   Ret:    the event
+*   Ref:    None
+********************************************************************************/
+static struct scheduled_event pop_event()
+{
+    struct scheduled_event first = events[0], last;
+    int index = 0, child;
+
+    last = events[--num_events];
+    while((child = 2*index + 1) < num_events) {
+        if(child + 1 < num_events && event_before(&events[child+1], &events[child])) {
+            child++;
+        }
+        if(!event_before(&events[child], &last)) {
+            break;
+        }
+        events[index] = events[child];
+        index = child;
+    }
+    if(num_events > 0) {
+        events[index] = last;
+    }
+
+    return first;
+}
+
+/********************************************************************************
+*   Name:   is_stale
+*   Desc:   tells whether an event belongs to a timer arming that was replaced
+*   Ret:    TRUE or FALSE
+*   Ref:    None
+********************************************************************************/
+static int is_stale(const struct scheduled_event *event)
+{
+    if(event->timer != NO_SLOT && event->generation != timers[event->timer].generation) {
+        return TRUE;
+    }
+
+    return FALSE;
+}
+
+/********************************************************************************
+*   Name:   scheduler_reset
+*   Desc:   drops every event and timer and sets the clock back to 0
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void scheduler_reset()
+{
+    free(events);
+    free(timers);
+    events = NULL;
+    timers = NULL;
+    num_events = event_capacity = 0;
+    num_timers = timer_capacity = 0;
+    sequence = 0;
+    clock_ms = 0;
+}
+
+/********************************************************************************
+*   Name:   scheduler_now_ms
+*   Desc:   the simulated clock
+*   Ret:    milliseconds since the last reset
+*   Ref:    None
+********************************************************************************/
+double scheduler_now_ms()
+{
+    return clock_ms;
+}
+
+/********************************************************************************
+*   Name:   scheduler_add_timer
+*   Desc:   creates a timer for the selected router. A periodic timer starts
+*           at once, first firing one interval from now; with interval_ms 0
+*           it is a one-shot timeout that starts disarmed.
+*   Ret:    timer handle or FAILURE
+*   Ref:    None
+********************************************************************************/
+int scheduler_add_timer(double interval_ms, event_callback callback, void *arg)
+{
+    struct scheduler_timer *grown;
+    int timer;
+
+    if(num_timers == timer_capacity) {
+        timer_capacity = timer_capacity ? 2*timer_capacity : 64;
+        grown = (struct scheduler_timer*) realloc(timers, timer_capacity*sizeof(struct scheduler_timer));
+        if(NULL == grown) {
+            fprintf(stderr, "Failed to allocate scheduler timers\n");
+            return FAILURE;
+        }
+        timers = grown;
+    }
+
+    timer = num_timers++;
+    timers[timer].callback = callback;
+    timers[timer].arg = arg;
+    timers[timer].router = current_router;
+    timers[timer].interval_ms = interval_ms;
+    timers[timer].generation = 0;
+
+    if(interval_ms > 0 && SUCCESS != push_event(clock_ms + interval_ms, timer, NULL, NULL)) {
+        return FAILURE;
+    }
+
+    return timer;
+}
+
+/********************************************************************************
+*   Name:   scheduler_set_timeout
+*   Desc:   (re)arms a one-shot timer delay_ms from now, replacing any earlier
+*           arming
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+int scheduler_set_timeout(int timer, double delay_ms)
+{
+    if(timer < 0 || timer >= num_timers) {
+        return FAILURE;
+    }
+
+    timers[timer].generation++;
+    return push_event(clock_ms + delay_ms, timer, NULL, NULL);
+}
+
+/********************************************************************************
+*   Name:   scheduler_call
+*   Desc:   runs callback(1, arg) once, delay_ms from now, with the currently
+*           selected router
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+int scheduler_call(double delay_ms, event_callback callback, void *arg)
+{
+    return push_event(clock_ms + delay_ms, NO_SLOT, callback, arg);
+}
+
+/********************************************************************************
+*   Name:   scheduler_next_ms
+*   Desc:   time of the next live event
+*   Ret:    milliseconds, or -1 if nothing is scheduled
+*   Ref:    None
+********************************************************************************/
+double scheduler_next_ms()
+{
+    while(num_events > 0 && is_stale(&events[0]) == TRUE) {
+        pop_event();
+    }
+
+    return num_events > 0 ? events[0].time : -1;
+}
+
+/********************************************************************************
+*   Name:   scheduler_run_once
+*   Desc:   advances the clock to the next event and runs it, unless it is
+*           more than timeout_ms away (-1: no limit), in which case the clock
+*           advances by timeout_ms. The event's router stays selected.
+*   Ret:    number of events run, 0 or 1
+*   Ref:    None
+********************************************************************************/
+int scheduler_run_once(double timeout_ms)
+{
+    struct scheduled_event event;
+    struct scheduler_timer *timer;
+    double next = scheduler_next_ms();
+
+    if(next < 0 || (timeout_ms >= 0 && next > clock_ms + timeout_ms)) {
+        if(timeout_ms >= 0) {
+            clock_ms += timeout_ms;
+        }
+        return 0;
+    }
+
+    event = pop_event();
+    clock_ms = event.time;
+    router_select(event.router);
+
+    if(event.timer == NO_SLOT) {
+        event.callback(1, event.arg);
+        return 1;
+    }
+
+    // Periodic timers keep an absolute schedule, like timerfd
+    timer = &timers[event.timer];
+    if(timer->interval_ms > 0) {
+        push_event(event.time + timer->interval_ms, event.timer, NULL, NULL);
+    }
+    timer->callback(1, timer->arg);
+
+    return 1;
+}
@@ -0,0 +1,547 @@
+/********************************************************************************
+*   FILE:   simulator.c
+*   DESC:   In-process network simulator. Every router is a struct router
+*           instance running the real routing code; update messages travel
+*           through an in-memory transport with configurable delay and loss
+*           instead of UDP. Time is simulated, so a run over thousands of
+*           routers takes as long as the routing work, not the intervals.
+*
+*           Routers keep their own timers: the periodic update and the
+*           triggered update hold-down are the event loop timers main uses,
+*           with the event loop in simulated time, so the simulator only
+*           starts them and delivers datagrams.
+*
+*           Router i (1..num_routers) has address 10.0.0.0 + i.
+********************************************************************************/
+#include "header.h"
+
+#define SIM_ADDRESS_BASE 0x0A000000     // 10.0.0.0
+#define SIM_PORT 4000
+
+struct sim_packet {
+	struct sim_packet *prev;            // in-flight list, for sim_free
+	struct sim_packet *next;
+	struct simulation *sim;
+	size_t length;
+	char message[];
+};
+
+struct sim_adjacency {
+	int neighbor;                       // router index
+	int link;                           // index into links
+};
+
+struct simulation {
+	struct sim_config config;
+	struct router *routers;             // router id i is routers[i-1]
+	unsigned long *seen_changes;        // route_changes of each router already counted
+	char *crashed;                      // TRUE for routers taken down by sim_crash_router
+	int num_routers;
+	struct sim_link *links;             // current cost of every link
+	int num_links;
+	int *adjacency_start;               // router index -> first entry in adjacency
+	struct sim_adjacency *adjacency;
+	struct transport transport;
+	struct sim_packet *in_flight;       // datagrams sent but not yet delivered
+	uint32_t random;                    // xorshift state
+
+	unsigned long messages;             // datagrams handed to the transport
+	unsigned long bytes;
+	unsigned long dropped;
+	unsigned long route_changes;
+	double last_change;                 // time of the latest route change
+	unsigned long messages_at_change;   // messages sent by then
+	unsigned long bytes_at_change;
+};
+
+/********************************************************************************
+*   Name:   sim_random
+*   Desc:   xorshift32, so runs repeat for a given seed
+*   Ret:    uniform value in [0, 1)
+*   Ref:    None
+********************************************************************************/
+static double sim_random(struct simulation *sim)
+{
+    sim->random ^= sim->random << 13;
+    sim->random ^= sim->random >> 17;
+    sim->random ^= sim->random << 5;
+
+    return sim->random / 4294967296.0;
+}
+
+/********************************************************************************
+*   Name:   deliver_packet
+*   Desc:   scheduled with the receiving router selected; stands in for
+*           recvfrom and hands the datagram to process_update_message
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void deliver_packet(int fired, void *arg)
+{
+    struct sim_packet *packet = (struct sim_packet*) arg;
+
+    (void) fired;
+
+    if(NULL != packet->prev) {
+        packet->prev->next = packet->next;
+    }
+    else {
+        packet->sim->in_flight = packet->next;
+    }
+    if(NULL != packet->next) {
+        packet->next->prev = packet->prev;
+    }
+
+    if(packet->sim->crashed[current_router - packet->sim->routers] != TRUE) {
+        process_update_message(packet->message, packet->length);
+    }
+    free(packet);
+}
+
+/********************************************************************************
+*   Name:   sim_send
+*   Desc:   the in-memory transport: stands in for sendmmsg / sendto. The
+*           datagram is copied and delivered after the configured delay
+*           unless it is lost.
+*   Ret:    bytes sent, -1 for an address outside the simulation
+*   Ref:    None
+********************************************************************************/
+static ssize_t sim_send(const struct sockaddr_in *to, const struct iovec *iov, size_t iovlen, void *arg)
+{
+    struct simulation *sim = (struct simulation*) arg;
+    uint32_t id = ntohl(to->sin_addr.s_addr) - SIM_ADDRESS_BASE;
+    struct sim_packet *packet;
+    struct router *sender;
+    size_t length = 0, pos = 0, index;
+    double delay;
+    int rv;
+
+    if(id < 1 || id > (uint32_t) sim->num_routers) {
+        return -1;
+    }
+    // A crashed router sends nothing; a triggered update may still be armed
+    if(sim->crashed[current_router - sim->routers] == TRUE) {
+        return 0;
+    }
+
+    for(index = 0; index < iovlen; index++) {
+        length += iov[index].iov_len;
+    }
+    sim->messages++;
+    sim->bytes += length;
+
+    if(sim_random(sim) < sim->config.loss) {
+        sim->dropped++;
+        return length;
+    }
+
+    packet = (struct sim_packet*) malloc(sizeof(struct sim_packet) + length);
+    if(NULL == packet) {
+        fprintf(stderr, "Failed to allocate simulated datagram\n");
+        exit(EXIT_FAILURE);
+    }
+    for(index = 0; index < iovlen; index++) {
+        memcpy(packet->message + pos, iov[index].iov_base, iov[index].iov_len);
+        pos += iov[index].iov_len;
+    }
+    packet->sim = sim;
+    packet->length = length;
+    packet->prev = NULL;
+    packet->next = sim->in_flight;
+    if(NULL != sim->in_flight) {
+        sim->in_flight->prev = packet;
+    }
+    sim->in_flight = packet;
+
+    // Scheduled events run with the router selected when they were scheduled
+    delay = sim->config.delay_min_ms + sim_random(sim) * (sim->config.delay_max_ms - sim->config.delay_min_ms);
+    sender = router_select(&sim->routers[id-1]);
+    rv = event_loop_call(delay, deliver_packet, packet);
+    router_select(sender);
+    if(SUCCESS != rv) {
+        exit(EXIT_FAILURE);
+    }
+
+    return length;
+}
+
+/********************************************************************************
+*   Name:   sim_periodic_update
+*   Desc:   periodic_update, unless the router has crashed
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void sim_periodic_update(int intervals, void *arg)
+{
+    struct simulation *sim = (struct simulation*) arg;
+
+    if(sim->crashed[current_router - sim->routers] != TRUE) {
+        periodic_update(intervals, NULL);
+    }
+}
+
+/********************************************************************************
+*   Name:   start_router
+*   Desc:   starts a router's update interval; scheduled at a random phase so
+*           routers do not all advertise at the same instant
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void start_router(int fired, void *arg)
+{
+    struct simulation *sim = (struct simulation*) arg;
+
+    (void) fired;
+
+    if(FAILURE == event_loop_add_timer(sim->config.interval_sec, sim_periodic_update, sim)) {
+        exit(EXIT_FAILURE);
+    }
+}
+
+/********************************************************************************
+*   Name:   note_changes
+*   Desc:   after the selected router ran, records the time if any of its
+*           routes changed
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void note_changes(struct simulation *sim)
+{
+    int index = current_router - sim->routers;
+
+    if(index < 0 || index >= sim->num_routers || sim->crashed[index] == TRUE || router_current()->route_changes == sim->seen_changes[index]) {
+        return;
+    }
+
+    sim->route_changes += router_current()->route_changes - sim->seen_changes[index];
+    sim->seen_changes[index] = router_current()->route_changes;
+    sim->last_change = event_loop_now_ms();
+    sim->messages_at_change = sim->messages;
+    sim->bytes_at_change = sim->bytes;
+}
+
+/********************************************************************************
+*   Name:   sim_create
+*   Desc:   builds routers 1..num_routers joined by the given links, each
+*           knowing only its own links, with periodic updates at random phase
+*   Ret:    simulation, NULL on bad input
+*   Ref:    None
+********************************************************************************/
+struct simulation *sim_create(const struct sim_config *config, int num_routers, const struct sim_link *links, int num_links)
+{
+    struct simulation *sim;
+    struct router *previous;
+    int index, id, fill, *next;
+
+    if(num_routers < 1 || num_routers >= NEXTHOP_SELF) {
+        fprintf(stderr, "Simulations need 1 to %d routers\n", NEXTHOP_SELF - 1);
+        return NULL;
+    }
+    for(index = 0; index < num_links; index++) {
+        if(links[index].a < 1 || links[index].a > num_routers || links[index].b < 1 || links[index].b > num_routers || links[index].a == links[index].b) {
+            fprintf(stderr, "Link %d joins routers that are not in the simulation\n", index);
+            return NULL;
+        }
+    }
+
+    sim = (struct simulation*) calloc(1, sizeof(struct simulation));
+    if(NULL == sim) {
+        return NULL;
+    }
+    // The simulation owns the event loop, in simulated time, until sim_free
+    event_loop_init_simulated();
+    sim->config = *config;
+    sim->num_routers = num_routers;
+    sim->num_links = num_links;
+    sim->random = config->seed ? config->seed : 1;
+    sim->transport.send = sim_send;
+    sim->transport.arg = sim;
+
+    sim->routers = (struct router*) malloc(num_routers*sizeof(struct router));
+    sim->links = (struct sim_link*) malloc((num_links ? num_links : 1)*sizeof(struct sim_link));
+    sim->adjacency_start = (int*) calloc(num_routers+1, sizeof(int));
+    sim->adjacency = (struct sim_adjacency*) malloc((num_links ? 2*num_links : 1)*sizeof(struct sim_adjacency));
+    sim->seen_changes = (unsigned long*) calloc(num_routers, sizeof(unsigned long));
+    sim->crashed = (char*) malloc(num_routers*sizeof(char));
+    next = (int*) malloc(num_routers*sizeof(int));
+    if(NULL == sim->routers || NULL == sim->links || NULL == sim->adjacency_start || NULL == sim->adjacency || NULL == sim->seen_changes || NULL == sim->crashed || NULL == next) {
+        fprintf(stderr, "Failed to allocate simulation\n");
+        exit(EXIT_FAILURE);
+    }
+    memcpy(sim->links, links, num_links*sizeof(struct sim_link));
+    memset(sim->crashed, FALSE, num_routers*sizeof(char));
+
+    // Links are undirected; index them from both ends
+    for(index = 0; index < num_links; index++) {
+        sim->adjacency_start[links[index].a]++;
+        sim->adjacency_start[links[index].b]++;
+    }
+    for(index = 0; index < num_routers; index++) {
+        sim->adjacency_start[index+1] += sim->adjacency_start[index];
+        next[index] = sim->adjacency_start[index];
+    }
+    for(index = 0; index < num_links; index++) {
+        fill = next[links[index].a-1]++;
+        sim->adjacency[fill].neighbor = links[index].b - 1;
+        sim->adjacency[fill].link = index;
+        fill = next[links[index].b-1]++;
+        sim->adjacency[fill].neighbor = links[index].a - 1;
+        sim->adjacency[fill].link = index;
+    }
+    free(next);
+
+    previous = current_router;
+    for(index = 0; index < num_routers; index++) {
+
+        router_init(&sim->routers[index]);
+        router_select(&sim->routers[index]);
+        router_current()->id = index + 1;
+        router_current()->ip_addr = htonl(SIM_ADDRESS_BASE + index + 1);
+        router_current()->port = SIM_PORT;
+        router_current()->transport = &sim->transport;
+        router_current()->wire_version = config->wire_version == WIRE_V2 ? WIRE_V2 : WIRE_V1;
+
+        // The same bulk load read_topology does
+        grow_routing_table(num_routers);
+        for(id = 1; id <= num_routers; id++) {
+            if(id == router_current()->id) {
+                append_routing_table_entry(id, router_current()->ip_addr, SIM_PORT, 0, router_current()->id);
+            }
+            else {
+                append_routing_table_entry(id, htonl(SIM_ADDRESS_BASE + id), SIM_PORT, INF, INVALID_ROUTER_ID);
+            }
+        }
+        sort_routing_table();
+
+        for(fill = sim->adjacency_start[index]; fill < sim->adjacency_start[index+1]; fill++) {
+            update_link_routing_table_entry(sim->adjacency[fill].neighbor + 1, router_current()->id, sim->links[sim->adjacency[fill].link].cost);
+        }
+        clear_changed_routes();
+        sim->seen_changes[index] = router_current()->route_changes;
+
+        // The same timers main sets up, run by the simulated clock
+        if(config->triggered == TRUE && SUCCESS != init_triggered_updates(config->holddown_ms)) {
+            exit(EXIT_FAILURE);
+        }
+        if(SUCCESS != event_loop_call(sim_random(sim) * config->interval_sec * 1000, start_router, sim)) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    router_select(previous);
+
+    return sim;
+}
+
+/********************************************************************************
+*   Name:   sim_set_link
+*   Desc:   changes the cost of a link at both ends, as the update command
+*           would; INF takes the link down like the disable command
+*   Ret:    Success or Failure if the routers are not linked
+*   Ref:    None
+********************************************************************************/
+int sim_set_link(struct simulation *sim, uint16_t a, uint16_t b, uint16_t cost)
+{
+    struct router *previous;
+    int index, end, link = FAILURE;
+    uint16_t self, other;
+
+    for(index = 0; index < sim->num_links; index++) {
+        if((sim->links[index].a == a && sim->links[index].b == b) || (sim->links[index].a == b && sim->links[index].b == a)) {
+            link = index;
+            break;
+        }
+    }
+    if(link == FAILURE) {
+        return FAILURE;
+    }
+    sim->links[link].cost = cost;
+
+    previous = current_router;
+    for(end = 0; end < 2; end++) {
+        self = end ? b : a;
+        other = end ? a : b;
+        router_select(&sim->routers[self-1]);
+
+        update_link_routing_table_entry(other, self, cost);
+        if(cost == INF) {
+            mark_neighbor_dead(other);
+        }
+
+        note_changes(sim);
+    }
+    router_select(previous);
+
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   sim_crash_router
+*   Desc:   takes a router down like the crash command: it stops sending and
+*           ignores what it receives, and its neighbors only find out when
+*           its updates stop arriving
+*   Ret:    Success or Failure for an id outside the simulation
+*   Ref:    None
+********************************************************************************/
+int sim_crash_router(struct simulation *sim, uint16_t id)
+{
+    if(id < 1 || id > sim->num_routers) {
+        return FAILURE;
+    }
+
+    sim->crashed[id-1] = TRUE;
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   sim_run
+*   Desc:   runs until no route has changed for settle_ms, or for at most
+*           max_ms of simulated time
+*   Ret:    Nothing; stats cover this run only
+*   Ref:    None
+********************************************************************************/
+void sim_run(struct simulation *sim, double settle_ms, double max_ms, struct sim_stats *stats)
+{
+    struct router *previous = current_router;
+    double start = event_loop_now_ms(), next;
+    unsigned long messages = sim->messages, bytes = sim->bytes, dropped = sim->dropped, changes = sim->route_changes;
+
+    // Changes made before the run (sim_set_link) count from its start
+    sim->last_change = start;
+    sim->messages_at_change = messages;
+    sim->bytes_at_change = bytes;
+
+    stats->converged = FALSE;
+    while((next = event_loop_next_ms()) >= 0) {
+
+        if(next - sim->last_change > settle_ms) {
+            stats->converged = TRUE;
+            break;
+        }
+        if(next - start > max_ms) {
+            break;
+        }
+
+        // Runs the event with its router selected
+        event_loop_run_once(-1);
+        note_changes(sim);
+    }
+    router_select(previous);
+
+    stats->converged_ms = sim->last_change - start;
+    stats->messages = sim->messages_at_change - messages;
+    stats->bytes = sim->bytes_at_change - bytes;
+    stats->dropped = sim->dropped - dropped;
+    stats->route_changes = sim->route_changes - changes;
+}
+
+/********************************************************************************
+*   Name:   sim_check_routes
+*   Desc:   compares every router's costs with shortest paths over the links
+*           as they are now (Dijkstra from each router). Crashed routers are
+*           not checked and carry no traffic.
+*   Ret:    number of routing table rows that disagree
+*   Ref:    None
+********************************************************************************/
+int sim_check_routes(struct simulation *sim)
+{
+    struct router *previous = current_router;
+    uint32_t *dist, *heap, candidate, top;
+    int source, node, size, index, child, fill, row, wrong = 0;
+    uint16_t cost;
+
+    // Heap entries pack (distance << 16 | router index); stale ones are skipped
+    dist = (uint32_t*) malloc(sim->num_routers*sizeof(uint32_t));
+    heap = (uint32_t*) malloc((2*sim->num_links + 1)*sizeof(uint32_t));
+    if(NULL == dist || NULL == heap) {
+        fprintf(stderr, "Failed to allocate route check\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for(source = 0; source < sim->num_routers; source++) {
+
+        if(sim->crashed[source] == TRUE) {
+            continue;
+        }
+        for(node = 0; node < sim->num_routers; node++) {
+            dist[node] = INF;
+        }
+        dist[source] = 0;
+        heap[0] = source;
+        size = 1;
+
+        while(size > 0) {
+            top = heap[0];
+            heap[0] = heap[--size];
+            for(index = 0; (child = 2*index + 1) < size; index = child) {
+                if(child + 1 < size && heap[child+1] < heap[child]) {
+                    child++;
+                }
+                if(heap[index] <= heap[child]) {
+                    break;
+                }
+                candidate = heap[index]; heap[index] = heap[child]; heap[child] = candidate;
+            }
+
+            node = top & 0xFFFF;
+            if((top >> 16) != dist[node]) {
+                continue;
+            }
+            for(fill = sim->adjacency_start[node]; fill < sim->adjacency_start[node+1]; fill++) {
+                cost = sim->links[sim->adjacency[fill].link].cost;
+                candidate = dist[node] + cost;
+                // Sums past INF are unreachable, as add_cost saturates
+                if(cost == INF || sim->crashed[sim->adjacency[fill].neighbor] == TRUE || candidate >= INF || candidate >= dist[sim->adjacency[fill].neighbor]) {
+                    continue;
+                }
+                dist[sim->adjacency[fill].neighbor] = candidate;
+                heap[size] = (candidate << 16) | sim->adjacency[fill].neighbor;
+                for(index = size++; index > 0 && heap[(index-1)/2] > heap[index]; index = (index-1)/2) {
+                    top = heap[index]; heap[index] = heap[(index-1)/2]; heap[(index-1)/2] = top;
+                }
+            }
+        }
+
+        router_select(&sim->routers[source]);
+        for(node = 0; node < sim->num_routers; node++) {
+            row = find_entry_by_id(node + 1);
+            if(row == FAILURE || router_current()->routing_table.cost[row] != dist[node]) {
+                wrong++;
+            }
+        }
+    }
+    router_select(previous);
+
+    free(dist);
+    free(heap);
+    return wrong;
+}
+
+/********************************************************************************
+*   Name:   sim_free
+*   Desc:   releases the routers, the links and any datagrams in flight
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void sim_free(struct simulation *sim)
+{
+    struct sim_packet *packet;
+    int index;
+
+    while(NULL != sim->in_flight) {
+        packet = sim->in_flight;
+        sim->in_flight = packet->next;
+        free(packet);
+    }
+    event_loop_close();
+    for(index = 0; index < sim->num_routers; index++) {
+        router_free(&sim->routers[index]);
+    }
+
+    free(sim->seen_changes);
+    free(sim->crashed);
+    free(sim->routers);
+    free(sim->links);
+    free(sim->adjacency_start);
+    free(sim->adjacency);
+    free(sim);
+}
@@ -25,6 +25,129 @@
 #include "../include/logger.h"
 
 
+/**
+ * Handles readable update socket
+ *
+ * @param  fd Receiving socket
+ * @param  arg Unused
+ */
+static void handle_update_message(int fd, void *arg)
+{
+    (void) arg;
+    get_message_and_update(fd);
+}
+
+/**
+ * Handles one line of user input
+ *
+ * @param  fd STDIN_FILENO
+ * @param  arg Unused
+ */
+static void handle_command(int fd, void *arg)
+{
+    char command[CMD_LEN];
+    int count=0;
+    char *arg_token;
+    char *command_tokens[CMD_LEN];
+
+    (void) arg;
+
+    memset(command, 0, CMD_LEN);
+
+    if(NULL == fgets(command, CMD_LEN, stdin)) {
+        // stdin closed, keep routing without a console
+        event_loop_remove_fd(fd);
+        return;
+    }
+    count = 0;
+
+    arg_token = strtok(command, " ");
+
+    while(arg_token!=NULL) {
+
+        string_lowcase(arg_token);
+        command_tokens[count] = malloc((strlen(arg_token)+1)*sizeof(char));
+        strcpy(command_tokens[count], arg_token);
+        count++;
+        arg_token = strtok(NULL, " ");
+    }
+
+    if(0 == count) {
+        return;
+    }
+
+    if(0 == strncmp(command_tokens[0], "academic_integrity", 18)) {
+    
+        academic_integrity();
+    
+    }
+    else if(0 == strncmp(command_tokens[0], "update", 6)) {
+        
+        if((uint16_t) atoi(command_tokens[1]) < 0 || (uint16_t) atoi(command_tokens[2]) < 0 || (uint16_t) atoi(command_tokens[3]) < 0) {
+
+            LOG_ERROR("%s:%s\n", "update", "invalid arguments");
+        }
+        else {
+            update((uint16_t) atoi(command_tokens[1]), (uint16_t) atoi(command_tokens[2]), (uint16_t) atoi(command_tokens[3]));
+        }
+    }
+    else if(0 == strncmp(command_tokens[0], "step", 4)) {
+    
+        step();
+    
+    }
+    else if(0 == strncmp(command_tokens[0], "packets", 7)) {
+    
+        packets();
+    
+    }
+    else if(0 == strncmp(command_tokens[0], "display", 7)) {
+    
+        display();
+    
+    }
+    else if(0 == strncmp(command_tokens[0], "disable", 7)) {
+    
+        if((uint16_t) atoi(command_tokens[1]) < 0) {
+            LOG_ERROR("%s:%s\n", "disable", "invalid argument");
+        }
+        else {    
+            disable((uint16_t) atoi(command_tokens[1]));
+        }
+    
+    }
+    else if(0 == strncmp(command_tokens[0], "crash", 5)) {
+    
+        crash();
+    
+    }
+    else if(0 == strncmp(command_tokens[0], "dump", 4)) {
+    
+        dump();
+    
+    }
+    else if(0 == strncmp(command_tokens[0], "loglevel", 8)) {
+
+        loglevel(count > 1 ? command_tokens[1] : NULL);
+
+    }
+    else if(0 == strncmp(command_tokens[0], "reload", 6)) {
+
+        reload();
+
+    }
+    else if(0 == strncmp(command_tokens[0], "stats", 5)) {
+
+        stats();
+
+    }
+    printf("Nothing to do!\n");
+
+    while(count > 0) {
+        free(command_tokens[--count]);
+    }
+}
+
 /**
  * main function
  *
@@ -49,24 +172,17 @@ int main(int argc, char **argv)
     int rv=0;
     char *topath = NULL;
     long int update_interval=0;
+    long int holddown=0;
+    char *capturepath = NULL;
+    int wire_version = WIRE_V1;
+    char *metricspath = NULL;
     FILE *tofile;
     int sock_in=0;
 
-    char command[CMD_LEN];
-    int count=0;
-    char *arg;
-    char *command_tokens[60];
-
-    /***************************************
-    * Init
-    ***************************************/
-    
-    memset(command, 0, CMD_LEN);
-
     /***************************************
     * Get path to topology file and router update interval
     ***************************************/
-    rv = get_args(&topath, &update_interval, argc, argv);
+    rv = get_args(&topath, &update_interval, &holddown, &capturepath, &wire_version, &metricspath, argc, argv);
     if(SUCCESS != rv) {
         fprintf(stderr, "Failed to get one or more required parameters to execute further! Exiting.\n");
         exit(EXIT_FAILURE);
@@ -84,137 +200,76 @@ int main(int argc, char **argv)
     /***************************************
     * Set IP Address
     ***************************************/
-    this_router.ip_addr = get_this_router_ip_addr();
+    router_current()->ip_addr = get_this_router_ip_addr();
 
     /***************************************
     * Read topology file
     ***************************************/
-    read_topology(tofile);
+    if(SUCCESS != read_topology(tofile)) {
+        fprintf(stderr, "Invalid topology file. Exiting.\n");
+        exit(EXIT_FAILURE);
+    }
 
 
     /***************************************
     * Initialize receiving socket
     ***************************************/
-    sock_in = new_sockin(this_router.port);
+    sock_in = new_sockin(router_current()->port);
+
+    /***************************************
+    * Advertisement numbers start somewhere new
+    * on every run, so neighbors do not take a
+    * restarted router's segments for late ones
+    ***************************************/
+    router_current()->advertisement_sequence = (uint32_t) time(NULL) ^ ((uint32_t) getpid() << 16);
+
+    /***************************************
+    * Offer the compact format if enabled;
+    * neighbors still get v1 until they offer
+    * it back
+    ***************************************/
+    router_current()->wire_version = wire_version;
+
+    /***************************************
+    * Optional capture of all update traffic
+    ***************************************/
+    if(NULL != capturepath && SUCCESS != capture_open(capturepath, CAPTURE_SIZE)) {
+        fprintf(stderr, "Capture unavailable, running without it.\n");
+    }
     
     /***************************************
-    * Timeout Implementation
+    * Event loop
     ****************************************/
-    struct timeval perm_timeout, temp_timeout;
+    if(SUCCESS != event_loop_init()) {
+        exit(EXIT_FAILURE);
+    }
 
-    perm_timeout.tv_sec = update_interval;
-    perm_timeout.tv_usec = 0;
+    if(SUCCESS != event_loop_add_fd(sock_in, handle_update_message, NULL)) {
+        exit(EXIT_FAILURE);
+    }
 
+    if(SUCCESS != event_loop_add_fd(STDIN_FILENO, handle_command, NULL)) {
+        fprintf(stderr, "Console input unavailable, running without commands.\n");
+    }
 
-    /***************************************
-    * Select Loop
-    ****************************************/    
-    fd_set perm_fdset, temp_fdset;
+    if(FAILURE == event_loop_add_timer(update_interval, periodic_update, NULL)) {
+        exit(EXIT_FAILURE);
+    }
 
-    FD_ZERO(&perm_fdset);
-    FD_ZERO(&temp_fdset);
+    if(SUCCESS != init_triggered_updates(holddown)) {
+        fprintf(stderr, "Triggered updates unavailable, sending periodic updates only.\n");
+    }
+
+    if(SUCCESS != watch_topology(topath)) {
+        fprintf(stderr, "Not watching the topology file, use the reload command.\n");
+    }
 
-    FD_SET(STDIN_FILENO, &perm_fdset);
-    FD_SET(sock_in, &perm_fdset);
+    if(NULL != metricspath && SUCCESS != init_metrics_export(metricspath, update_interval)) {
+        fprintf(stderr, "Metrics export unavailable, use the stats command.\n");
+    }
 
-    temp_timeout = perm_timeout;
+    event_loop_run();
     
-    while(1) {
-        
-        temp_fdset = perm_fdset;
- 
-        if(select(sock_in+1, &temp_fdset, NULL, NULL, &temp_timeout) < 0) {
-            perror("select");
-            exit(EXIT_FAILURE);
-        }
-            // Incoming message
-            if(FD_ISSET(sock_in, &temp_fdset)) {
-                get_message_and_update(sock_in);
-            }
-                    
-            // Incoming user input
-            if(FD_ISSET(STDIN_FILENO, &temp_fdset)) {
-                
-
-                fgets(command, CMD_LEN, stdin);
-                count = 0;
-
-                arg = strtok(command, " ");
-
-                while(arg!=NULL) {
-
-                    string_lowcase(arg);
-                    command_tokens[count] = malloc(sizeof(arg)*sizeof(char));
-                    strcpy(command_tokens[count], arg);
-                    count++;
-                    arg = strtok(NULL, " ");
-                }
-
-
-                 if(0 == strncmp(command_tokens[0], "academic_integrity", 18)) {
-                 
-                    academic_integrity();
-                 
-                 }
-                 else if(0 == strncmp(command_tokens[0], "update", 6)) {
-                    
-                    if((uint16_t) atoi(command_tokens[1]) < 0 || (uint16_t) atoi(command_tokens[2]) < 0 || (uint16_t) atoi(command_tokens[3]) < 0) {
-
-                        cse4589_print_and_log("%s:%s\n", "update", "invalid arguments");
-                    }
-                    else {
-                        update((uint16_t) atoi(command_tokens[1]), (uint16_t) atoi(command_tokens[2]), (uint16_t) atoi(command_tokens[3]));
-                    }
-                 }
-                 else if(0 == strncmp(command_tokens[0], "step", 4)) {
-                 
-                    step();
-                 
-                 }
-                 else if(0 == strncmp(command_tokens[0], "packets", 7)) {
-                 
-                    packets();
-                 
-                 }
-                 else if(0 == strncmp(command_tokens[0], "display", 7)) {
-                 
-                    display();
-                 
-                 }
-                 else if(0 == strncmp(command_tokens[0], "disable", 7)) {
-                 
-                    if((uint16_t) atoi(command_tokens[1]) < 0) {
-                        cse4589_print_and_log("%s:%s\n", "disable", "invalid argument");
-                    }
-                    else {    
-                        disable((uint16_t) atoi(command_tokens[1]));
-                    }
-                 
-                 }
-                 else if(0 == strncmp(command_tokens[0], "crash", 5)) {
-                 
-                    crash();
-                 
-                 }
-                 else if(0 == strncmp(command_tokens[0], "dump", 4)) {
-                 
-                    dump();
-                 
-                 }
-            printf("Nothing to do!\n");
-            }
-            
-            // Check for timeout
-            if(temp_timeout.tv_sec == 0 && temp_timeout.tv_usec == 0) {
-                    
-                increment_counters();
-                disable_old_links();
-                send_message_to_neighbors();
-
-                temp_timeout = perm_timeout;
-            }
-    }
-  
 
     /***************************************
     * Close topology file
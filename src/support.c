@@ -4,8 +4,43 @@
 ********************************************************************************/
 #include "header.h"
 
-int update_index = 0;
-int num_packets = 0;
+int poisoned_reverse = TRUE;
+int log_level = LOG_LEVEL_DEBUG;
+
+static size_t encode_header(char *msg, uint16_t count);
+static size_t encode_entry(char *msg, int index);
+static int num_segments(int entries);
+static void send_to_neighbors(const struct outgoing_segment *segment);
+static int neighbors_speaking(int version);
+static void v1_segment(struct outgoing_segment *segment, const char *message, int first_row, const uint16_t *entry_ids);
+static size_t flatten_iov(char *buffer, const struct iovec *iov, int iovlen);
+static void capture_fanout(int first, int count);
+static void count_sent(int slot, ssize_t bytes);
+static int apply_update_message(const char *msg, ssize_t msg_len);
+static int offered_version(const char *entries, int count, uint16_t sender_id);
+
+static char *delta = NULL;
+
+// A segment is a whole update message holding the next rows
+static const int segment_entries = (SEGMENT_SIZE - sizeof(struct update_header)) / sizeof(struct updates);
+
+static struct sockaddr_in *fanout_addr = NULL;
+static struct mmsghdr *fanout_msg = NULL;
+static int fanout_capacity = 0;
+static int *fanout_slot = NULL;
+static int *patch_start = NULL;
+static int *patch_list = NULL;
+static int patch_capacity = 0;
+static struct iovec *fanout_iov = NULL;
+static int iov_capacity = 0;
+static char *copy_buffer = NULL;
+static size_t copy_capacity = 0;
+static const uint16_t poisoned_cost = INF;      // same in either byte order
+
+static char *recv_batch = NULL;
+static struct iovec recv_iov[RECV_BATCH];
+static struct sockaddr_in recv_addr[RECV_BATCH];
+static struct mmsghdr recv_msg[RECV_BATCH];
 
 /********************************************************************************
 *   Name:   make_incoming_socket
@@ -34,17 +69,22 @@ int new_sockin(uint16_t port) {
         exit(EXIT_FAILURE);
     }
 
+    // Updates go out from the same port we listen on
+    router_current()->send_sock = sockfd;
+
     return sockfd;
 }
 
 /********************************************************************************
 *   Name:   get_args
 *   Desc:   Takes command line arguments. Checks for path of topology file,
-            router update interval
+            router update interval, optional triggered update hold-down,
+            optional pcap capture file (NULL if not given) and optional
+            highest wire version to speak (WIRE_V1 if not given)
 *   Ret:    Success or Failure
 *   Ref:    http://www.gnu.org/software/libc/manual/html_node/Example-of-Getopt.html#Example-of-Getopt
 ********************************************************************************/
-int get_args(char **topologypath, long int *upintvl, int argc, char** argv)
+int get_args(char **topologypath, long int *upintvl, long int *holddown, char **capturepath, int *wireversion, char **metricspath, int argc, char** argv)
 {
     /***************************************
     * Declarations
@@ -52,9 +92,14 @@ int get_args(char **topologypath, long int *upintvl, int argc, char** argv)
     char ch;
     char *temp;
     long int updateinterval;
+    long int triggerholddown = HOLDDOWN_DEFAULT;
     int has_topologypath = FALSE;
     int has_updateinterval = FALSE;
 
+    *capturepath = NULL;
+    *wireversion = WIRE_V1;
+    *metricspath = NULL;
+
     /***************************************
     * If there are no arguments then return
     ***************************************/
@@ -66,7 +111,7 @@ int get_args(char **topologypath, long int *upintvl, int argc, char** argv)
     /***************************************
     * Check for -t and -i and their values
     ***************************************/
-    while ((ch = (char) getopt(argc, argv, "t:i:")) != -1) {
+    while ((ch = (char) getopt(argc, argv, "t:i:h:c:v:m:")) != -1) {
 
         switch (ch) {
 
@@ -87,6 +132,32 @@ int get_args(char **topologypath, long int *upintvl, int argc, char** argv)
                 }
                 break;
 
+            case 'h':
+                triggerholddown = strtol(optarg, NULL, 10);
+                if(triggerholddown < 0) {
+                    fprintf(stdout, "Invalid hold-down, using %d ms\n", HOLDDOWN_DEFAULT);
+                    triggerholddown = HOLDDOWN_DEFAULT;
+                }
+                break;
+
+            case 'c':
+                *capturepath = optarg;
+                fprintf(stdout, "Capturing updates to: %s\n", optarg);
+                break;
+
+            case 'v':
+                *wireversion = (int) strtol(optarg, NULL, 10);
+                if(*wireversion != WIRE_V1 && *wireversion != WIRE_V2) {
+                    fprintf(stdout, "Invalid wire version, using %d\n", WIRE_V1);
+                    *wireversion = WIRE_V1;
+                }
+                break;
+
+            case 'm':
+                *metricspath = optarg;
+                fprintf(stdout, "Writing metrics to: %s\n", optarg);
+                break;
+
             case '?':
                 if(optopt == 't') {
                   fprintf(stdout, "Option -%c requires an argument.\n", optopt);
@@ -94,6 +165,18 @@ int get_args(char **topologypath, long int *upintvl, int argc, char** argv)
                 else if(optopt == 'i') {
                   fprintf(stdout, "Option -%c requires an argument.\n", optopt);
                 }
+                else if(optopt == 'h') {
+                  fprintf(stdout, "Option -%c requires an argument.\n", optopt);
+                }
+                else if(optopt == 'c') {
+                  fprintf(stdout, "Option -%c requires an argument.\n", optopt);
+                }
+                else if(optopt == 'v') {
+                  fprintf(stdout, "Option -%c requires an argument.\n", optopt);
+                }
+                else if(optopt == 'm') {
+                  fprintf(stdout, "Option -%c requires an argument.\n", optopt);
+                }
 
             default:
                 return FALSE;
@@ -117,16 +200,18 @@ int get_args(char **topologypath, long int *upintvl, int argc, char** argv)
     * If not, pass references back and return success
     ***************************************/
     // Get topologypath from temp
-    *topologypath = (char*) malloc(sizeof(temp));
+    *topologypath = strdup(temp);
     if(NULL == *topologypath) {
         fprintf(stdout, "memory allocation failed.\n");
         return FAILURE;
     }
-    strncpy(*topologypath, temp, strlen(temp));
 
     // Get upintvl
     *upintvl = updateinterval;
 
+    // Get holddown
+    *holddown = triggerholddown;
+
     return SUCCESS;
 }
 
@@ -172,49 +257,180 @@ int close_file(FILE *openfile)
 }
 
 /********************************************************************************
-*   Name:   add_routing_table_entry
-*   Desc:   Enters given information to routing table.
-*   Ret:    Nothing
+*   Name:   aligned_resize
+*   Desc:   realloc for RTABLE_ALIGN aligned column arrays
+*   Ret:    new block or NULL, in which case the old block is untouched
+*   Ref:    None
+********************************************************************************/
+void *aligned_resize(void *old, size_t old_bytes, size_t new_bytes)
+{
+    void *block = NULL;
+
+    if(0 != posix_memalign(&block, RTABLE_ALIGN, new_bytes)) {
+        return NULL;
+    }
+    if(NULL != old) {
+        memcpy(block, old, old_bytes < new_bytes ? old_bytes : new_bytes);
+        free(old);
+    }
+
+    return block;
+}
+
+/********************************************************************************
+*   Name:   grow_routing_table
+*   Desc:   Makes sure the routing table has room for at least min_entries rows.
+*           Capacity doubles each time so repeated inserts stay amortized O(1).
+*   Ret:    Success or Failure
 *   Ref:    None
 ********************************************************************************/
-void add_routing_table_entry(uint16_t id, uint32_t ip_addr, uint16_t port, uint16_t cost, uint16_t nexthop, int counter) 
+int grow_routing_table(int min_entries)
 {
-    int index_base=0, index_target=0;
-    struct updates temp;
-    struct info temp2;
+    struct rtable *table = &router_current()->routing_table;
+    int new_capacity;
+    void *grown;
 
-   // Add entry to update/routing structure
-    this_router.routing_table.entry[update_index].ip_addr = ip_addr;
-    this_router.routing_table.entry[update_index].port = port;
-    this_router.routing_table.entry[update_index].id = id;
-    this_router.routing_table.entry[update_index].cost = cost;
+    if(min_entries <= table->capacity) {
+        return SUCCESS;
+    }
 
-    if(this_router.routing_table.entry[update_index].cost == INF) {
-        this_router.routing_table.additional_info[update_index].nexthop = -1;    
+    new_capacity = table->capacity;
+    if(new_capacity < RTABLE_INIT_SIZE) {
+        new_capacity = RTABLE_INIT_SIZE;
     }
-    else {
-        this_router.routing_table.additional_info[update_index].nexthop = nexthop;
+    while(new_capacity < min_entries) {
+        new_capacity *= 2;
     }
 
-    this_router.routing_table.additional_info[update_index].counter = counter;
+    grown = realloc(table->entry, new_capacity*sizeof(struct destination));
+    if(NULL == grown) {
+        fprintf(stderr, "Failed to grow routing table to %d entries\n", new_capacity);
+        return FAILURE;
+    }
+    table->entry = (struct destination*) grown;
 
-    // Keep track
-    update_index++;
+    grown = aligned_resize(table->cost, table->capacity*sizeof(uint16_t), new_capacity*sizeof(uint16_t));
+    if(NULL == grown) {
+        fprintf(stderr, "Failed to grow routing table to %d entries\n", new_capacity);
+        return FAILURE;
+    }
+    table->cost = (uint16_t*) grown;
 
-    // Bubble Sort
-    for(index_base = 0; index_base < update_index; index_base++) {
-        for(index_target = index_base+1; index_target < update_index; index_target++) {
+    grown = aligned_resize(table->nexthop, table->capacity*sizeof(uint16_t), new_capacity*sizeof(uint16_t));
+    if(NULL == grown) {
+        fprintf(stderr, "Failed to grow routing table to %d entries\n", new_capacity);
+        return FAILURE;
+    }
+    table->nexthop = (uint16_t*) grown;
 
-            if(this_router.routing_table.entry[index_target].id < this_router.routing_table.entry[index_base].id) {
-                temp = this_router.routing_table.entry[index_target];
-                this_router.routing_table.entry[index_target] = this_router.routing_table.entry[index_base];
-                this_router.routing_table.entry[index_base] = temp;
+    if(SUCCESS != resize_neighbor_vectors(table->capacity, new_capacity)) {
+        fprintf(stderr, "Failed to grow neighbor vectors to %d entries\n", new_capacity);
+        return FAILURE;
+    }
 
-                temp2 = this_router.routing_table.additional_info[index_target];
-                this_router.routing_table.additional_info[index_target] = this_router.routing_table.additional_info[index_base];
-                this_router.routing_table.additional_info[index_base] = temp2;
-            }
+    table->capacity = new_capacity;
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   addr_hash
+*   Desc:   hashes an (ip, port) pair into the addr_slot table
+*   Ret:    bucket index
+*   Ref:    None
+********************************************************************************/
+static uint32_t addr_hash(uint32_t ip, uint16_t port)
+{
+    uint32_t key = ip ^ ((uint32_t) port * 0x9E3779B1u);
+
+    key ^= key >> 16;
+    key *= 0x85EBCA6Bu;
+    key ^= key >> 13;
+
+    return key & (router_current()->routing_table.addr_slot_size - 1);
+}
+
+/********************************************************************************
+*   Name:   index_routing_table_row
+*   Desc:   points both lookup indexes at the given row. The (ip, port) hash
+*           stores ids rather than rows so it stays valid when rows move.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void index_routing_table_row(int row)
+{
+    struct rtable *table = &router_current()->routing_table;
+    uint32_t bucket;
+    int other;
+
+    table->id_slot[table->entry[row].id] = row;
+
+    bucket = addr_hash(table->entry[row].ip_addr, table->entry[row].port);
+    while(table->addr_slot[bucket] != 0) {
+        other = table->id_slot[table->addr_slot[bucket]-1];
+        if(table->entry[other].ip_addr == table->entry[row].ip_addr &&
+                table->entry[other].port == table->entry[row].port) {
+            break;
+        }
+        bucket = (bucket + 1) & (table->addr_slot_size - 1);
+    }
+    table->addr_slot[bucket] = table->entry[row].id + 1;
+}
+
+/********************************************************************************
+*   Name:   rebuild_routing_table_index
+*   Desc:   recomputes the id and (ip, port) indexes from the routing table rows.
+*           Needed after rows are bulk loaded or the table grows.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void rebuild_routing_table_index()
+{
+    struct rtable *table = &router_current()->routing_table;
+    int size, max_id = 0;
+    int index;
+    int *grown;
+
+    // Covers the largest id present rather than all of ID_SPACE, so tables
+    // of small ids (simulated routers) stay small
+    for(index = 0; index < router_current()->num_entries; index++) {
+        if(table->entry[index].id > max_id) {
+            max_id = table->entry[index].id;
+        }
+    }
+    size = RTABLE_INIT_SIZE;
+    while(size <= max_id) {
+        size *= 2;
+    }
+    if(size != table->id_slot_size) {
+        grown = (int*) realloc(table->id_slot, size*sizeof(int));
+        if(NULL == grown) {
+            fprintf(stderr, "Failed to allocate routing table index\n");
+            exit(EXIT_FAILURE);
         }
+        table->id_slot = grown;
+        table->id_slot_size = size;
+    }
+    for(index = 0; index < size; index++) {
+        table->id_slot[index] = NO_SLOT;
+    }
+
+    size = 2*RTABLE_INIT_SIZE;
+    while(size < 2*table->capacity) {
+        size *= 2;
+    }
+    if(size != table->addr_slot_size) {
+        free(table->addr_slot);
+        table->addr_slot = (int*) malloc(size*sizeof(int));
+        if(NULL == table->addr_slot) {
+            fprintf(stderr, "Failed to allocate routing table index\n");
+            exit(EXIT_FAILURE);
+        }
+        table->addr_slot_size = size;
+    }
+    memset(table->addr_slot, 0, size*sizeof(int));
+
+    for(index = 0; index < router_current()->num_entries; index++) {
+        index_routing_table_row(index);
     }
 }
 
@@ -228,382 +444,1279 @@ int find_entry_by_id(uint16_t id)
 {
     int index;
 
-    for(index = 0; index < update_index; index++) 
-    {
-        if(this_router.routing_table.entry[index].id == id) {    
-            return index;
-        }
+    if(id >= router_current()->routing_table.id_slot_size) {
+        return FAILURE;
     }
 
-    return FAILURE;
+    index = router_current()->routing_table.id_slot[id];
+    if(index == NO_SLOT) {
+        return FAILURE;
+    }
+
+    return index;
 }
 
 
 /********************************************************************************
 *   Name:   find_entry_by_ip
-*   Desc:   finds entry by ip
-*   Ret:    Nothing
+*   Desc:   finds entry by ip and port
+*   Ret:    index
 *   Ref:    None
 ********************************************************************************/
-int find_entry_by_ip(uint32_t ip) 
+int find_entry_by_ip(uint32_t ip, uint16_t port) 
 {
-    int index;
+    struct rtable *table = &router_current()->routing_table;
+    uint32_t bucket;
+    int row;
 
-    for(index = 0; index < update_index; index++) 
-    {
-        if(this_router.routing_table.entry[index].ip_addr == ip) {    
-            return index;
+    if(NULL == table->addr_slot) {
+        return FAILURE;
+    }
+
+    bucket = addr_hash(ip, port);
+    while(table->addr_slot[bucket] != 0) {
+        row = table->id_slot[table->addr_slot[bucket]-1];
+        if(table->entry[row].ip_addr == ip && table->entry[row].port == port) {
+            return row;
         }
+        bucket = (bucket + 1) & (table->addr_slot_size - 1);
     }
 
     return FAILURE;
 }
 
-
 /********************************************************************************
-*   Name:   update_link_routing_table_entry
-*   Desc:   Enters given information to routing table.
+*   Name:   fill_routing_table_row
+*   Desc:   writes one routing table row
 *   Ret:    Nothing
 *   Ref:    None
 ********************************************************************************/
-void update_link_routing_table_entry(uint16_t id, int nexthop, uint16_t cost) {
-    
-    int index = 0;
+static void fill_routing_table_row(int row, uint16_t id, uint32_t ip_addr, uint16_t port, uint16_t cost, uint16_t nexthop)
+{
+    router_current()->routing_table.entry[row].ip_addr = ip_addr;
+    router_current()->routing_table.entry[row].port = port;
+    router_current()->routing_table.entry[row].id = id;
+    router_current()->routing_table.cost[row] = cost;
 
-    index = find_entry_by_id(id);
-    if(index == FAILURE)
-    {
-        //printf("No entry found to update!\n");
-        return;
+    if(cost == INF) {
+        router_current()->routing_table.nexthop[row] = NEXTHOP_NONE;
     }
-    this_router.routing_table.additional_info[index].counter = 0;
-    this_router.routing_table.additional_info[index].nexthop = nexthop;
-    this_router.routing_table.entry[index].cost = cost;
+    else {
+        router_current()->routing_table.nexthop[row] = nexthop_slot(nexthop);
+    }
+
+    invalidate_advertisement();
 }
 
 /********************************************************************************
-*   Name:   read_topology
-*   Desc:   Reads topology file and adds entries to routing table
+*   Name:   add_routing_table_entry
+*   Desc:   Enters given information to routing table, keeping rows sorted by
+*           id. An existing row with the same id is overwritten.
 *   Ret:    Nothing
 *   Ref:    None
 ********************************************************************************/
-void read_topology(FILE *tofile) {
+void add_routing_table_entry(uint16_t id, uint32_t ip_addr, uint16_t port, uint16_t cost, uint16_t nexthop) 
+{
+    struct rtable *table = &router_current()->routing_table;
+    int low=0, high=router_current()->num_entries, mid=0;
+    int index=0;
+    int old_capacity = table->capacity;
 
-    int index;
-    int num_routers;
-    int num_neighbors;
-    int num_neighbors2;
-    int router_ip1;
-    int router_ip2;
-    int router_ip3;
-    int router_ip4;
-    char router_ip[14];
-    
-    uint16_t router_id;
-    uint16_t router_id1;
-    uint16_t neighbor_id1;
-    uint16_t cost1;
-    uint16_t router_port;
-
-    fscanf(tofile, "%d\n", &num_routers);
-    //printf("%d\n", num_routers);
-
-    fscanf(tofile, "%d\n", &num_neighbors);
-    num_neighbors2 = num_neighbors;
-    //printf("%d\n", num_neighbors);
-   
-    // Store information of other routers in routing table
-    for(index = 0; index < num_routers; index++) {
-        
-        fscanf(tofile, "%"SCNu16" %d.%d.%d.%d %"SCNu16"\n", &router_id, &router_ip1, &router_ip2, &router_ip3, &router_ip4, &router_port);
-        sprintf(router_ip, "%d.%d.%d.%d", router_ip1, router_ip2, router_ip3, router_ip4);
-
-        //printf("%"PRIu16" %s %"PRIu16"\n", router_id, router_ip, router_port);
-
-        if(inet_addr(router_ip) == this_router.ip_addr) {
-            //printf("Self entry found\n");
-            this_router.id = router_id;
-            this_router.port = router_port;
-            add_routing_table_entry(router_id, inet_addr(router_ip), router_port, 0, this_router.id, 0);
+    if(SUCCESS != grow_routing_table(router_current()->num_entries+1)) {
+        exit(EXIT_FAILURE);
+    }
+
+    // Binary search for the first row with an id >= the new one
+    while(low < high) {
+        mid = low + (high - low) / 2;
+        if(table->entry[mid].id < id) {
+            low = mid + 1;
         }
         else {
-            add_routing_table_entry(router_id, inet_addr(router_ip), router_port, INF, INVALID_ROUTER_ID, COUNTER_DEAD);
+            high = mid;
         }
     }
 
-    //  Store neighbors in routing table
-    for(index = 0; index < num_neighbors2; index++) {
-        
-        fscanf(tofile, "%"SCNu16" %"SCNu16" %"SCNu16"", &router_id1, &neighbor_id1, &cost1);
-        //printf("%"PRIu16" %"PRIu16" %"PRIu16"\n", router_id1, neighbor_id1, cost1);
+    if(low < router_current()->num_entries && table->entry[low].id == id) {
+        fill_routing_table_row(low, id, ip_addr, port, cost, nexthop);
+        rebuild_routing_table_index();
+        return;
+    }
+
+    // Open a gap and add entry to update/routing structure
+    memmove(&table->entry[low+1], &table->entry[low], (router_current()->num_entries-low)*sizeof(struct destination));
+    memmove(&table->cost[low+1], &table->cost[low], (router_current()->num_entries-low)*sizeof(uint16_t));
+    memmove(&table->nexthop[low+1], &table->nexthop[low], (router_current()->num_entries-low)*sizeof(uint16_t));
+    fill_routing_table_row(low, id, ip_addr, port, cost, nexthop);
+
+    // Keep track
+    router_current()->num_entries++;
+    insert_neighbor_vector_row(low);
+
+    if(id >= table->id_slot_size || old_capacity != table->capacity) {
+        rebuild_routing_table_index();
+        return;
+    }
 
-        update_link_routing_table_entry(neighbor_id1, router_id1, cost1);
+    // Only the shifted rows moved; the (ip, port) hash is keyed to ids
+    for(index = low+1; index < router_current()->num_entries; index++) {
+        table->id_slot[table->entry[index].id] = index;
     }
+    index_routing_table_row(low);
 }
 
 /********************************************************************************
-*   Name:   prepare_message
-*   Desc:   Prepares an update message
-*   Ret:    update message
+*   Name:   append_routing_table_entry
+*   Desc:   Bulk load path. Adds a row at the end of the table without sorting
+*           or indexing; call sort_routing_table once all rows are in.
+*   Ret:    Nothing
 *   Ref:    None
 ********************************************************************************/
-char* prepare_message(size_t *msg_size)
+void append_routing_table_entry(uint16_t id, uint32_t ip_addr, uint16_t port, uint16_t cost, uint16_t nexthop)
 {
-    char *msg = NULL;
-    uint16_t num_updates=0;
-    size_t size_count=0;
-    int index=0;
-
-    uint16_t port;
-    uint32_t ip_addr;
-    uint16_t id;
-    uint16_t cost;
-
-    /**********************************************************************************
-    * Fill header
-    ***********************************************************************************/
-    msg = (char*) malloc(sizeof(struct update_header) + update_index*sizeof(struct updates));
-
-    num_updates = htons((uint16_t) update_index);
-    memcpy(msg, &num_updates, sizeof(num_updates)); 
-    size_count += sizeof(num_updates);
-    
-    port = htons(this_router.port);
-    memcpy(msg+size_count, &port, sizeof(port)); 
-    size_count += sizeof(port);
-
-    ip_addr = this_router.ip_addr;
-    memcpy(msg+size_count, &ip_addr, sizeof(ip_addr));    
-    size_count += sizeof(ip_addr);
-   
-    /**********************************************************************************
-    * Fill message
-    ***********************************************************************************/
-    for(index = 0; index < update_index; index++) {
-
-        memcpy(msg+size_count, &this_router.routing_table.entry[index].ip_addr, sizeof(this_router.routing_table.entry[index].ip_addr));    
-        size_count += sizeof(this_router.routing_table.entry[index].ip_addr);
-
-        port = htons(this_router.routing_table.entry[index].port);
-        memcpy(msg+size_count, &port, sizeof(port));    
-        size_count += sizeof(port);
-
-        size_count += sizeof(this_router.routing_table.entry[index].pad);
-
-        id = htons(this_router.routing_table.entry[index].id);
-        memcpy(msg+size_count, &id, sizeof(id));    
-        size_count += sizeof(id);
-
-        cost = htons(this_router.routing_table.entry[index].cost);
-        memcpy(msg+size_count, &cost, sizeof(cost));    
-        size_count += sizeof(cost);
+    if(SUCCESS != grow_routing_table(router_current()->num_entries+1)) {
+        exit(EXIT_FAILURE);
     }
 
-    
-    *msg_size = size_count;
-    return msg;
+    fill_routing_table_row(router_current()->num_entries, id, ip_addr, port, cost, nexthop);
+    router_current()->num_entries++;
 }
 
 /********************************************************************************
-*   Name:   Increment Counters
-*   Desc:   increses counter of each neigbor by 1
+*   Name:   sort_routing_table
+*   Desc:   Finishes a bulk load. Ids are 16 bit, so rows are placed by walking
+*           the id space once instead of comparing. Later duplicates win.
 *   Ret:    Nothing
 *   Ref:    None
 ********************************************************************************/
-void increment_counters() {
-    int this_router_index=0;
-    int index=0;
+void sort_routing_table()
+{
+    struct rtable *table = &router_current()->routing_table;
+    struct destination *sorted_entry;
+    uint16_t *sorted_cost, *sorted_nexthop;
+    int index, id, count=0;
+    int capacity = RTABLE_INIT_SIZE;
 
-    this_router_index = find_entry_by_id(this_router.id);
+    rebuild_routing_table_index();
 
-    for(index = 0; index < update_index; index++) {
+    // Duplicates collapse here, so a bulk load may shrink the table
+    for(id = 0; id < table->id_slot_size; id++) {
+        count += table->id_slot[id] != NO_SLOT;
+    }
+    while(capacity < count) {
+        capacity *= 2;
+    }
+    count = 0;
 
-        if(this_router.routing_table.additional_info[index].counter != COUNTER_DEAD) {
-            
-            if(index == this_router_index) {
-                this_router.routing_table.additional_info[index].counter = 0;
-            }
-            else {
-                this_router.routing_table.additional_info[index].counter++;
-            }
+    sorted_entry = (struct destination*) malloc(capacity*sizeof(struct destination));
+    sorted_cost = (uint16_t*) aligned_resize(NULL, 0, capacity*sizeof(uint16_t));
+    sorted_nexthop = (uint16_t*) aligned_resize(NULL, 0, capacity*sizeof(uint16_t));
+    if(NULL == sorted_entry || NULL == sorted_cost || NULL == sorted_nexthop) {
+        fprintf(stderr, "Failed to sort routing table\n");
+        exit(EXIT_FAILURE);
+    }
 
+    for(id = 0; id < table->id_slot_size; id++) {
+        index = table->id_slot[id];
+        if(index != NO_SLOT) {
+            sorted_entry[count] = table->entry[index];
+            sorted_cost[count] = table->cost[index];
+            sorted_nexthop[count] = table->nexthop[index];
+            count++;
         }
     }
-}
 
+    free(table->entry);
+    free(table->cost);
+    free(table->nexthop);
+    table->entry = sorted_entry;
+    table->cost = sorted_cost;
+    table->nexthop = sorted_nexthop;
+    router_current()->num_entries = count;
+
+    if(capacity != table->capacity && SUCCESS != resize_neighbor_vectors(table->capacity, capacity)) {
+        fprintf(stderr, "Failed to sort routing table\n");
+        exit(EXIT_FAILURE);
+    }
+    table->capacity = capacity;
+
+    rebuild_routing_table_index();
+    clear_neighbor_vectors();
+}
 
 /********************************************************************************
-*   Name:   Disable old links
-*   Desc:   checks counter of all links and disables those that have more than 3
+*   Name:   update_link_routing_table_entry
+*   Desc:   Enters given information to routing table. For a neighbor, or a
+*           direct link (nexthop is this router), this sets the link cost and
+*           lets route selection pick the best path.
 *   Ret:    Nothing
 *   Ref:    None
 ********************************************************************************/
-void disable_old_links() {
+void update_link_routing_table_entry(uint16_t id, int nexthop, uint16_t cost) {
     
-    int index=0;
-
-    for(index = 0; index < update_index; index++) {
+    int index = 0;
 
-       // printf("Index %d Counter %d \n", index+1, this_router.routing_table.additional_info[index].counter);
+    index = find_entry_by_id(id);
+    if(index == FAILURE)
+    {
+        //printf("No entry found to update!\n");
+        return;
+    }
 
-        if(this_router.routing_table.additional_info[index].counter > COUNTER_MAX) {
-            
-            //this_router.routing_table.entry[index].nexthop = INF;
-            //this_router.routing_table.entry[index].cost = INF;
-            update_link_routing_table_entry(this_router.routing_table.entry[index].id, -1, INF);
-            this_router.routing_table.additional_info[index].counter = COUNTER_DEAD;    
-        }
+    if(nexthop == router_current()->id || find_neighbor(id) != FAILURE) {
+        set_link_cost(id, cost);
+        return;
     }
-}
 
+    set_route(index, nexthop_slot(nexthop), cost);
+}
 
 /********************************************************************************
-*   Name:   send_message_to_neighbors
-*   Desc:   sends update message to all neighbors
+*   Name:   set_route
+*   Desc:   Sets the selected route of a row, flagging wire-visible changes.
+*           nexthop is a neighbor slot, NEXTHOP_SELF or NEXTHOP_NONE.
 *   Ret:    Nothing
 *   Ref:    None
 ********************************************************************************/
-void send_message_to_neighbors() {
-    int index = 0;
-    int rv = 0;
-
-    for(index=0; index < update_index; index++) {
-
-        if(this_router.routing_table.additional_info[index].nexthop == this_router.id && 
-                this_router.routing_table.entry[index].id != this_router.id) {
-           
-            rv = send_message(this_router.routing_table.entry[index].ip_addr,
-                                this_router.routing_table.entry[index].port);
+void set_route(int row, uint16_t nexthop, uint16_t cost) {
 
-            if(-1 == rv) {
-                //printf("Failed to send message to router %d\n", this_router.routing_table.entry[index].id);
-            }
-        }
+    router_current()->routing_table.nexthop[row] = nexthop;
+    if(router_current()->routing_table.cost[row] != cost) {
+        router_current()->routing_table.cost[row] = cost;
+        invalidate_advertisement();
+        mark_route_changed(router_current()->routing_table.entry[row].id);
     }
 }
 
 /********************************************************************************
-*   Name:   Send Message
-*   Desc:   sends update message to the given address
-*   Ret:    Nothing
+*   Name:   message_size
+*   Desc:   size of a full advertisement of the current routing table, all
+*           segments together
+*   Ret:    bytes
 *   Ref:    None
 ********************************************************************************/
-int send_message(uint32_t ip_addr, uint16_t port) {
-
-    /***************************************
-    * Declarations
-    ***************************************/
-    int rv;
-    int sockfd2;
-    struct sockaddr_in neighbor_router2;
-    char *message=NULL;
-    size_t msg_size;
+size_t message_size()
+{
+    return num_segments(router_current()->num_entries)*sizeof(struct update_header) + router_current()->num_entries*sizeof(struct updates);
+}
 
-    sockfd2 = socket(AF_INET, SOCK_DGRAM, 0);
-    if(0 == sockfd2) {
-        perror("socket");
+/********************************************************************************
+*   Name:   num_segments
+*   Desc:   segments needed to advertise the given number of entries
+*   Ret:    segments, at least 1
+*   Ref:    None
+********************************************************************************/
+static int num_segments(int entries)
+{
+    if(entries <= segment_entries) {
+        return 1;
     }
 
-    memset(&neighbor_router2, 0, sizeof(neighbor_router2));
-    neighbor_router2.sin_family = AF_INET;
-    neighbor_router2.sin_addr.s_addr = ip_addr;
-    neighbor_router2.sin_port = port;    
-
-    message = prepare_message(&msg_size);
+    return (entries + segment_entries - 1) / segment_entries;
+}
 
-    //printf("Sending update message to: %s %d\n", inet_ntoa(neighbor_router2.sin_addr), neighbor_router2.sin_port);
-    rv = sendto(sockfd2, message, msg_size, 0, (struct sockaddr*) &neighbor_router2, sizeof(neighbor_router2));
+/********************************************************************************
+*   Name:   segment_size
+*   Desc:   length of the update message starting at segment, from its header
+*   Ret:    bytes
+*   Ref:    None
+********************************************************************************/
+size_t segment_size(const char *segment)
+{
+    uint16_t count;
 
-    free(message);
-    close(sockfd2);
-    return rv;
+    memcpy(&count, segment + offsetof(struct update_header, num_updates), sizeof(count));
+    return sizeof(struct update_header) + ntohs(count)*sizeof(struct updates);
 }
 
 /********************************************************************************
-*   Name:   Get message and update
-*   Desc:   reads update message and updates routing table
-*   Ret:    Nothing
+*   Name:   prepare_message
+*   Desc:   Prepares a full advertisement in a newly allocated buffer
+*   Ret:    update message segments, back to back
 *   Ref:    None
 ********************************************************************************/
-void get_message_and_update(int sock_in) {
+char* prepare_message(size_t *msg_size)
+{
+    char *msg = NULL;
 
-    uint16_t num_updates;
-    uint16_t source_port;
-    uint32_t source_ip_addr; 
-    
-    struct updates incoming_message[MAX_ROUTERS];
-    
-    uint16_t self_id=0;
-    uint16_t neighbor_id=0; 
+    msg = (char*) malloc(message_size());
+    if(NULL == msg) {
+        *msg_size = 0;
+        return NULL;
+    }
 
-    char msg[1000];
+    *msg_size = encode_message(msg);
+    return msg;
+}
 
-    int index=0;
-    int self_index=0;
-    int neighbor_index=0;
-    int entry_index=0;
+/********************************************************************************
+*   Name:   encode_message
+*   Desc:   Serializes the routing table into msg, which must hold at least
+*           message_size() bytes, as segments of up to SEGMENT_SIZE bytes
+*           each covering the next rows in order. Every segment but the last
+*           is full.
+*   Ret:    bytes written
+*   Ref:    None
+********************************************************************************/
+size_t encode_message(char *msg)
+{
+    size_t size_count=0;
+    int index=0;
+    int segment, count, entries;
+
+    count = num_segments(router_current()->num_entries);
+    for(segment = 0; segment < count; segment++) {
+
+        entries = router_current()->num_entries - index < segment_entries ? router_current()->num_entries - index : segment_entries;
+        size_count += encode_header(msg+size_count, (uint16_t) entries);
+
+        for(; entries > 0; entries--, index++) {
+            size_count += encode_entry(msg+size_count, index);
+        }
+    }
+
+    return size_count;
+}
+
+/********************************************************************************
+*   Name:   encode_header
+*   Desc:   writes the update message header
+*   Ret:    bytes written
+*   Ref:    None
+********************************************************************************/
+static size_t encode_header(char *msg, uint16_t count)
+{
+    uint16_t num_updates=0;
+    size_t size_count=0;
+
+    uint16_t port;
+    uint32_t ip_addr;
+
+    num_updates = htons(count);
+    memcpy(msg, &num_updates, sizeof(num_updates)); 
+    size_count += sizeof(num_updates);
     
-    int size_count=0;
+    port = htons(router_current()->port);
+    memcpy(msg+size_count, &port, sizeof(port)); 
+    size_count += sizeof(port);
+
+    ip_addr = router_current()->ip_addr;
+    memcpy(msg+size_count, &ip_addr, sizeof(ip_addr));    
+    size_count += sizeof(ip_addr);
+
+    return size_count;
+}
+
+/********************************************************************************
+*   Name:   encode_entry
+*   Desc:   writes one routing table row in update message format. The
+*           padding of this router's own row offers v2 when enabled.
+*   Ret:    bytes written
+*   Ref:    None
+********************************************************************************/
+static size_t encode_entry(char *msg, int index)
+{
+    size_t size_count=0;
+
+    uint16_t port;
+    uint16_t pad;
+    uint16_t id;
+    uint16_t cost;
+
+    memcpy(msg+size_count, &router_current()->routing_table.entry[index].ip_addr, sizeof(router_current()->routing_table.entry[index].ip_addr));    
+    size_count += sizeof(router_current()->routing_table.entry[index].ip_addr);
+
+    port = htons(router_current()->routing_table.entry[index].port);
+    memcpy(msg+size_count, &port, sizeof(port));    
+    size_count += sizeof(port);
+
+    // 0x0 padding
+    pad = 0;
+    if(router_current()->routing_table.entry[index].id == router_current()->id && router_current()->wire_version == WIRE_V2) {
+        pad = htons(WIRE_V2);
+    }
+    memcpy(msg+size_count, &pad, sizeof(pad));
+    size_count += sizeof(pad);
+
+    id = htons(router_current()->routing_table.entry[index].id);
+    memcpy(msg+size_count, &id, sizeof(id));    
+    size_count += sizeof(id);
+
+    cost = htons(router_current()->routing_table.cost[index]);
+    memcpy(msg+size_count, &cost, sizeof(cost));    
+    size_count += sizeof(cost);
+
+    return size_count;
+}
+
+/********************************************************************************
+*   Name:   invalidate_advertisement
+*   Desc:   marks the cached update message stale. Called on every change to
+*           a routing table field that goes on the wire.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void invalidate_advertisement()
+{
+    router_current()->advertisement_dirty = TRUE;
+    router_current()->compact.dirty = TRUE;
+}
+
+/********************************************************************************
+*   Name:   get_advertisement
+*   Desc:   returns the advertisement of the current routing table, encoding
+*           it only if the table changed since the last call. The buffer is
+*           owned by this module and stays valid until the next call; walk
+*           its segments with segment_size.
+*   Ret:    update message segments, back to back
+*   Ref:    None
+********************************************************************************/
+const char *get_advertisement(size_t *msg_size)
+{
+    size_t needed;
+    char *grown;
+
+    if(router_current()->advertisement_dirty == TRUE) {
+
+        needed = message_size();
+        if(needed > router_current()->advertisement_capacity) {
+            grown = (char*) realloc(router_current()->advertisement, needed);
+            if(NULL == grown) {
+                fprintf(stderr, "Failed to allocate update message\n");
+                exit(EXIT_FAILURE);
+            }
+            router_current()->advertisement = grown;
+            router_current()->advertisement_capacity = needed;
+        }
+
+        router_current()->advertisement_size = encode_message(router_current()->advertisement);
+        router_current()->advertisement_dirty = FALSE;
+    }
+
+    *msg_size = router_current()->advertisement_size;
+    return router_current()->advertisement;
+}
+
+/********************************************************************************
+*   Name:   init_triggered_updates
+*   Desc:   enables triggered updates: route changes are sent to neighbors as
+*           a delta no sooner than holddown milliseconds after the last one
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+int init_triggered_updates(long holddown)
+{
+    router_current()->trigger_fd = event_loop_add_timeout(send_triggered_update, NULL);
+    if(FAILURE == router_current()->trigger_fd) {
+        router_current()->trigger_fd = -1;
+        return FAILURE;
+    }
+
+    router_current()->holddown_ms = holddown;
+    router_current()->last_trigger_ms = event_loop_now_ms() - holddown;
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   mark_route_changed
+*   Desc:   queues a destination for the next triggered update and makes sure
+*           one is scheduled
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void mark_route_changed(uint16_t id)
+{
+    double delay;
+    char *flag;
+    uint16_t *ids;
+    int size;
+
+    // Sized by the largest id seen rather than ID_SPACE, to keep
+    // simulated routers small
+    if(id >= router_current()->changed_size) {
+        size = router_current()->changed_size ? router_current()->changed_size : RTABLE_INIT_SIZE;
+        while(size <= id) {
+            size *= 2;
+        }
+        flag = (char*) realloc(router_current()->changed_flag, size*sizeof(char));
+        if(NULL != flag) {
+            router_current()->changed_flag = flag;
+        }
+        ids = (uint16_t*) realloc(router_current()->changed_ids, size*sizeof(uint16_t));
+        if(NULL == flag || NULL == ids) {
+            fprintf(stderr, "Failed to allocate triggered update list\n");
+            exit(EXIT_FAILURE);
+        }
+        memset(flag + router_current()->changed_size, 0, size - router_current()->changed_size);
+        router_current()->changed_ids = ids;
+        router_current()->changed_size = size;
+    }
+
+    router_current()->route_changes++;
+
+    if(!router_current()->changed_flag[id]) {
+        router_current()->changed_flag[id] = 1;
+        router_current()->changed_ids[router_current()->num_changed++] = id;
+    }
+
+    if(-1 == router_current()->trigger_fd || router_current()->trigger_armed == TRUE) {
+        return;
+    }
+
+    delay = router_current()->last_trigger_ms + router_current()->holddown_ms - event_loop_now_ms();
+    event_loop_set_timeout(router_current()->trigger_fd, delay > 0 ? (long) delay : 0);
+    router_current()->trigger_armed = TRUE;
+}
+
+/********************************************************************************
+*   Name:   clear_changed_routes
+*   Desc:   forgets pending triggered changes
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void clear_changed_routes()
+{
+    int index;
 
-    socklen_t fromlen;
-    struct sockaddr addr;
-    struct in_addr ip_addr;
+    for(index = 0; index < router_current()->num_changed; index++) {
+        router_current()->changed_flag[router_current()->changed_ids[index]] = 0;
+    }
+    router_current()->num_changed = 0;
+}
 
-    // Keep msg clear
-    memset(&msg, 0, sizeof(msg));
-    memset(&incoming_message, 0, sizeof(incoming_message));
+/********************************************************************************
+*   Name:   compare_ids
+*   Desc:   qsort order of router ids
+*   Ret:    <0, 0, >0
+*   Ref:    None
+********************************************************************************/
+static int compare_ids(const void *a, const void *b)
+{
+    return (int) *(const uint16_t*) a - (int) *(const uint16_t*) b;
+}
+
+/********************************************************************************
+*   Name:   send_triggered_update
+*   Desc:   sends neighbors only the routes that changed since the last update,
+*           as one advertisement split over as many segments as needed
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void send_triggered_update(int intervals, void *arg)
+{
+    const struct compact_advertisement *compact;
+    struct outgoing_segment outgoing;
+    int start, count, index, row;
+    size_t size_count, pos;
+
+    (void) intervals;
+    (void) arg;
+
+    router_current()->trigger_armed = FALSE;
+    if(0 == router_current()->num_changed) {
+        return;
+    }
+
+    if(NULL == delta) {
+        delta = (char*) malloc(SEGMENT_SIZE);
+        if(NULL == delta) {
+            fprintf(stderr, "Failed to allocate triggered update\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // In id order, as v2 delta encodes them
+    qsort(router_current()->changed_ids, router_current()->num_changed, sizeof(uint16_t), compare_ids);
+
+    router_current()->advertisement_sequence++;
+    for(start = 0; neighbors_speaking(WIRE_V1) == TRUE && start < router_current()->num_changed; start += segment_entries) {
+
+        count = router_current()->num_changed - start < segment_entries ? router_current()->num_changed - start : segment_entries;
+        size_count = encode_header(delta, (uint16_t) count);
+
+        for(index = start; index < start + count; index++) {
+            row = find_entry_by_id(router_current()->changed_ids[index]);
+            size_count += encode_entry(delta+size_count, row);
+        }
+
+        v1_segment(&outgoing, delta, 0, router_current()->changed_ids+start);
+        send_to_neighbors(&outgoing);
+    }
+
+    if(neighbors_speaking(WIRE_V2) == TRUE) {
+        compact = encode_compact_delta(router_current()->changed_ids, router_current()->num_changed);
+        for(pos = 0, index = 0; next_compact_segment(compact, &pos, &index, &outgoing) == TRUE; ) {
+            send_to_neighbors(&outgoing);
+        }
+    }
+
+    clear_changed_routes();
+    router_current()->last_trigger_ms = event_loop_now_ms();
+}
+
+/********************************************************************************
+*   Name:   periodic_update
+*   Desc:   timer callback for the update interval: ages neighbors, drops
+*           dead links and advertises the table
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void periodic_update(int intervals, void *arg)
+{
+    uint64_t start = metrics_now_ns();
+    int index;
+
+    (void) arg;
+
+    for(index = 0; index < intervals; index++) {
+        increment_counters();
+    }
+    disable_old_links();
+    send_message_to_neighbors();
+
+    histogram_record(&router_current()->metrics.tick_time, metrics_now_ns() - start);
+}
+
+/********************************************************************************
+*   Name:   Increment Counters
+*   Desc:   increses counter of each neigbor by 1
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void increment_counters() {
+    struct neighbor *neighbor;
+    int slot=0;
+
+    for(slot = 0; slot < router_current()->num_neighbors; slot++) {
+        neighbor = &router_current()->neighbors[slot];
+        neighbor->counter += (neighbor->counter != COUNTER_DEAD);
+    }
+}
+
+
+/********************************************************************************
+*   Name:   Disable old links
+*   Desc:   checks counter of all links and disables those that have more than 3
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void disable_old_links() {
     
-    //printf("\nGetting message... \n");
-    recvfrom(sock_in, &msg, sizeof(msg), 0, &addr, &fromlen);
+    int slot=0;
+
+    for(slot = 0; slot < router_current()->num_neighbors; slot++) {
+
+        if(router_current()->neighbors[slot].counter > COUNTER_MAX && router_current()->neighbors[slot].counter != COUNTER_DEAD) {
+            
+            // A silent neighbor's link goes down; routes through it fail over
+            // to the next best neighbor. Only a link that was up and not
+            // disabled counts as timed out.
+            if(router_current()->neighbors[slot].alive == TRUE && router_current()->neighbors[slot].link_cost != INF) {
+                router_current()->metrics.link_timeouts++;
+            }
+            set_neighbor_alive(slot, FALSE);
+            router_current()->neighbors[slot].counter = COUNTER_DEAD;
+        }
+    }
+}
 
-    memcpy(&num_updates, msg, sizeof(num_updates)); 
-    num_updates = ntohs(num_updates);
-    size_count += sizeof(num_updates);
-    //printf("num updates: %"PRIu16"\n", num_updates);    
 
-    memcpy(&source_port, msg+size_count, sizeof(source_port)); 
-    source_port = ntohs(source_port);
-    size_count += sizeof(source_port);
-    //printf("port: %"PRIu16"\n", source_port);
+/********************************************************************************
+*   Name:   get_send_socket
+*   Desc:   socket used for all outgoing updates. This is the bound receive
+*           socket once new_sockin has run, so neighbors see our real port;
+*           otherwise a dedicated socket is opened once and kept.
+*   Ret:    socket
+*   Ref:    None
+********************************************************************************/
+int get_send_socket()
+{
+    if(-1 == router_current()->send_sock) {
+        router_current()->send_sock = socket(AF_INET, SOCK_DGRAM, 0);
+        if(-1 == router_current()->send_sock) {
+            perror("socket");
+        }
+    }
 
-    memcpy(&source_ip_addr, msg+size_count, sizeof(source_ip_addr));    
-    size_count += sizeof(source_ip_addr);
-    ip_addr.s_addr = source_ip_addr;
-    //printf("ip addr: %s\n\n", inet_ntoa(ip_addr));
+    return router_current()->send_sock;
+}
+
+/********************************************************************************
+*   Name:   send_message_to_neighbors
+*   Desc:   sends the advertisement to all neighbors, one sendmmsg batch per
+*           segment, in each wire version some neighbor speaks
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void send_message_to_neighbors() {
+    const struct compact_advertisement *compact;
+    struct outgoing_segment segment;
+    const char *message = NULL;
+    size_t msg_size, pos;
+    int entry = 0;
+
+    if(neighbors_speaking(WIRE_V1) == TRUE) {
+        message = get_advertisement(&msg_size);
+        for(pos = 0; pos < msg_size; pos += segment.size) {
+            v1_segment(&segment, message + pos, entry, NULL);
+            send_to_neighbors(&segment);
+            entry += segment.num_entries;
+        }
+    }
+
+    if(neighbors_speaking(WIRE_V2) == TRUE) {
+        compact = get_compact_advertisement();
+        for(pos = 0, entry = 0; next_compact_segment(compact, &pos, &entry, &segment) == TRUE; ) {
+            send_to_neighbors(&segment);
+        }
+    }
+
+    // A full table covers every pending triggered change
+    clear_changed_routes();
+}
+
+/********************************************************************************
+*   Name:   neighbors_speaking
+*   Desc:   tells whether any neighbor that gets updates speaks a wire version
+*   Ret:    TRUE or FALSE
+*   Ref:    None
+********************************************************************************/
+static int neighbors_speaking(int version)
+{
+    int slot;
+
+    for(slot = 0; slot < router_current()->num_neighbors; slot++) {
+        if(router_current()->neighbors[slot].link_cost != INF && neighbor_wire_version(slot) == version) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/********************************************************************************
+*   Name:   v1_segment
+*   Desc:   describes the v1 segment at message for send_to_neighbors
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void v1_segment(struct outgoing_segment *segment, const char *message, int first_row, const uint16_t *entry_ids)
+{
+    segment->message = message;
+    segment->size = segment_size(message);
+    segment->version = WIRE_V1;
+    segment->num_entries = (segment->size - sizeof(struct update_header)) / sizeof(struct updates);
+    segment->first_row = first_row;
+    segment->entry_ids = entry_ids;
+    segment->cost_offset = NULL;
+    segment->cost_length = NULL;
+    segment->poison = &poisoned_cost;
+    segment->poison_length = sizeof(poisoned_cost);
+}
+
+/********************************************************************************
+*   Name:   via_neighbor
+*   Desc:   tells whether a row's route goes through one of the neighbors
+*   Ret:    neighbor slot or NO_SLOT
+*   Ref:    None
+********************************************************************************/
+static int via_neighbor(int row)
+{
+    if(row == FAILURE || router_current()->routing_table.nexthop[row] >= NEXTHOP_SELF) {
+        return NO_SLOT;
+    }
+
+    return router_current()->routing_table.nexthop[row];
+}
+
+/********************************************************************************
+*   Name:   cost_field
+*   Desc:   where an entry's cost lies in a segment
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void cost_field(const struct outgoing_segment *segment, int index, size_t *offset, size_t *length)
+{
+    if(NULL == segment->cost_offset) {
+        *offset = sizeof(struct update_header) + index*sizeof(struct updates) + offsetof(struct updates, cost);
+        *length = sizeof(uint16_t);
+        return;
+    }
+
+    *offset = segment->cost_offset[index];
+    *length = segment->cost_length[index];
+}
+
+/********************************************************************************
+*   Name:   send_to_neighbors
+*   Desc:   sends one segment, in one sendmmsg batch, to all neighbors that
+*           speak its wire version. With poisoned reverse on, each neighbor
+*           sees INF for the routes that go through it.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void send_to_neighbors(const struct outgoing_segment *segment) {
+    int index = 0;
+    int rv = 0;
+    int num_neighbors = 0;
+    int num_patches = 0;
+    int num_iov = 0;
+    int num_copies = 0;
+    int sent = 0;
+    int sockfd = -1;
+    int row, slot, patch, first;
+    size_t pos, offset, length;
+    char *copy;
+
+    if(0 == router_current()->num_neighbors) {
+        return;
+    }
+    if(NULL == router_current()->transport) {
+        sockfd = get_send_socket();
+        if(-1 == sockfd) {
+            return;
+        }
+    }
+
+    if(router_current()->num_neighbors > fanout_capacity) {
+        fanout_capacity = router_current()->num_neighbors;
+        fanout_addr = (struct sockaddr_in*) realloc(fanout_addr, fanout_capacity*sizeof(struct sockaddr_in));
+        fanout_msg = (struct mmsghdr*) realloc(fanout_msg, fanout_capacity*sizeof(struct mmsghdr));
+        fanout_slot = (int*) realloc(fanout_slot, fanout_capacity*sizeof(int));
+        patch_start = (int*) realloc(patch_start, (fanout_capacity+1)*sizeof(int));
+        if(NULL == fanout_addr || NULL == fanout_msg || NULL == fanout_slot || NULL == patch_start) {
+            fprintf(stderr, "Failed to allocate send batch\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // Timed out neighbors still get updates so the link can come back;
+    // disabled links do not
+    for(slot = 0; slot < router_current()->num_neighbors; slot++) {
+
+        patch_start[slot] = 0;
+
+        row = find_entry_by_id(router_current()->neighbors[slot].id);
+        if(router_current()->neighbors[slot].link_cost == INF || row == FAILURE || neighbor_wire_version(slot) != segment->version) {
+            continue;
+        }
+
+        memset(&fanout_addr[num_neighbors], 0, sizeof(struct sockaddr_in));
+        fanout_addr[num_neighbors].sin_family = AF_INET;
+        fanout_addr[num_neighbors].sin_addr.s_addr = router_current()->routing_table.entry[row].ip_addr;
+        fanout_addr[num_neighbors].sin_port = router_current()->routing_table.entry[row].port;
+
+        memset(&fanout_msg[num_neighbors], 0, sizeof(struct mmsghdr));
+        fanout_msg[num_neighbors].msg_hdr.msg_name = &fanout_addr[num_neighbors];
+        fanout_msg[num_neighbors].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+        fanout_slot[num_neighbors] = slot;
+        num_neighbors++;
+    }
+
+    if(0 == num_neighbors) {
+        return;
+    }
+    patch_start[router_current()->num_neighbors] = 0;
+
+    /**********************************************************************************
+    * Split horizon with poisoned reverse: find, per neighbor, the entries whose
+    * route goes through that neighbor. Counting sort keeps each list in
+    * message order.
+    ***********************************************************************************/
+    if(poisoned_reverse == TRUE) {
+
+        if(segment->num_entries > patch_capacity) {
+            patch_capacity = segment->num_entries;
+            patch_list = (int*) realloc(patch_list, patch_capacity*sizeof(int));
+            if(NULL == patch_list) {
+                fprintf(stderr, "Failed to allocate send batch\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+
+        for(index = 0; index < segment->num_entries; index++) {
+            row = (NULL == segment->entry_ids) ? segment->first_row + index : find_entry_by_id(segment->entry_ids[index]);
+            slot = via_neighbor(row);
+            if(slot != NO_SLOT) {
+                patch_start[slot+1]++;
+                num_patches++;
+            }
+        }
+        for(slot = 0; slot < router_current()->num_neighbors; slot++) {
+            patch_start[slot+1] += patch_start[slot];
+        }
+        for(index = 0; index < segment->num_entries; index++) {
+            row = (NULL == segment->entry_ids) ? segment->first_row + index : find_entry_by_id(segment->entry_ids[index]);
+            slot = via_neighbor(row);
+            if(slot != NO_SLOT) {
+                patch_list[patch_start[slot]++] = index;
+            }
+        }
+        // Filling advanced every start to the next neighbor's; shift back
+        for(slot = router_current()->num_neighbors; slot > 0; slot--) {
+            patch_start[slot] = patch_start[slot-1];
+        }
+        patch_start[0] = 0;
+    }
 
     /**********************************************************************************
-    * Get message
+    * Every neighbor shares the encoded segment; poisoned costs are spliced in
+    * as separate iovecs. A v2 cost may be longer than its poisoned one, so
+    * the datagram can come out shorter. Neighbors needing more than IOV_MAX
+    * pieces get a patched copy instead.
     ***********************************************************************************/
-   //printf("Getting node info...\n");
-   for(index = 0; index < num_updates; index++) {
+    if(num_neighbors + 2*num_patches > iov_capacity) {
+        iov_capacity = num_neighbors + 2*num_patches;
+        fanout_iov = (struct iovec*) realloc(fanout_iov, iov_capacity*sizeof(struct iovec));
+        if(NULL == fanout_iov) {
+            fprintf(stderr, "Failed to allocate send batch\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    for(index = 0; index < num_neighbors; index++) {
+        slot = fanout_slot[index];
+        if(2*(patch_start[slot+1] - patch_start[slot]) + 1 > IOV_MAX) {
+            num_copies++;
+        }
+    }
+    if(num_copies*segment->size > copy_capacity) {
+        copy_capacity = num_copies*segment->size;
+        copy_buffer = (char*) realloc(copy_buffer, copy_capacity);
+        if(NULL == copy_buffer) {
+            fprintf(stderr, "Failed to allocate send batch\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    copy = copy_buffer;
+    for(index = 0; index < num_neighbors; index++) {
+
+        slot = fanout_slot[index];
+        first = num_iov;
+
+        pos = 0;
+        for(patch = patch_start[slot]; patch < patch_start[slot+1]; patch++) {
+            cost_field(segment, patch_list[patch], &offset, &length);
+            fanout_iov[num_iov].iov_base = (void*) (segment->message+pos);
+            fanout_iov[num_iov].iov_len = offset - pos;
+            num_iov++;
+            fanout_iov[num_iov].iov_base = (void*) segment->poison;
+            fanout_iov[num_iov].iov_len = segment->poison_length;
+            num_iov++;
+            pos = offset + length;
+        }
+        fanout_iov[num_iov].iov_base = (void*) (segment->message+pos);
+        fanout_iov[num_iov].iov_len = segment->size - pos;
+        num_iov++;
+
+        if(num_iov - first > IOV_MAX) {
+            length = flatten_iov(copy, &fanout_iov[first], num_iov - first);
+            fanout_iov[first].iov_base = copy;
+            fanout_iov[first].iov_len = length;
+            copy += length;
+            num_iov = first + 1;
+        }
+
+        fanout_msg[index].msg_hdr.msg_iov = &fanout_iov[first];
+        fanout_msg[index].msg_hdr.msg_iovlen = num_iov - first;
+    }
+
+    if(NULL != router_current()->transport) {
+        for(index = 0; index < num_neighbors; index++) {
+            rv = router_current()->transport->send(&fanout_addr[index], fanout_msg[index].msg_hdr.msg_iov,
+                    fanout_msg[index].msg_hdr.msg_iovlen, router_current()->transport->arg);
+            count_sent(fanout_slot[index], rv);
+        }
+        return;
+    }
+
+    // sendmmsg stops at the first failing datagram; skip it and carry on
+    while(sent < num_neighbors) {
+        rv = sendmmsg(sockfd, &fanout_msg[sent], num_neighbors - sent, 0);
+        if(-1 == rv) {
+            //printf("Failed to send message to neighbor %d\n", sent);
+            count_sent(fanout_slot[sent], -1);
+            sent++;
+            continue;
+        }
+        if(capture_enabled() == TRUE) {
+            capture_fanout(sent, rv);
+        }
+        for(index = sent; index < sent + rv; index++) {
+            count_sent(fanout_slot[index], fanout_msg[index].msg_len);
+        }
+        sent += rv;
+    }
+}
+
+/********************************************************************************
+*   Name:   count_sent
+*   Desc:   counts a datagram sent to the neighbor in slot, or a failure if
+*           bytes is negative. NO_SLOT for an address that is no neighbor.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void count_sent(int slot, ssize_t bytes)
+{
+    if(bytes < 0) {
+        router_current()->metrics.send_failures++;
+        return;
+    }
+    if(slot == NO_SLOT) {
+        return;
+    }
+
+    router_current()->neighbors[slot].metrics.packets_out++;
+    router_current()->neighbors[slot].metrics.bytes_out += bytes;
+}
+
+/********************************************************************************
+*   Name:   flatten_iov
+*   Desc:   copies the pieces of a datagram into one buffer
+*   Ret:    bytes copied
+*   Ref:    None
+********************************************************************************/
+static size_t flatten_iov(char *buffer, const struct iovec *iov, int iovlen)
+{
+    size_t size_count = 0;
+    int index;
+
+    for(index = 0; index < iovlen; index++) {
+        memcpy(buffer + size_count, iov[index].iov_base, iov[index].iov_len);
+        size_count += iov[index].iov_len;
+    }
+
+    return size_count;
+}
+
+/********************************************************************************
+*   Name:   capture_fanout
+*   Desc:   records count datagrams of the fan-out batch, starting at first
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void capture_fanout(int first, int count)
+{
+    struct sockaddr_in local;
+    int index;
+
+    capture_local_address(&local);
+    for(index = first; index < first + count; index++) {
+        capture_datagram(&local, (struct sockaddr_in*) fanout_msg[index].msg_hdr.msg_name,
+                fanout_msg[index].msg_hdr.msg_iov, fanout_msg[index].msg_hdr.msg_iovlen);
+    }
+}
+
+/********************************************************************************
+*   Name:   Send Message
+*   Desc:   sends the advertisement to the given address, one datagram per
+*           segment
+*   Ret:    bytes sent of the last segment, or -1 on failure
+*   Ref:    None
+********************************************************************************/
+int send_message(uint32_t ip_addr, uint16_t port) {
 
-        // Read node information.
+    /***************************************
+    * Declarations
+    ***************************************/
+    int rv = -1;
+    int sockfd2;
+    int row, slot = NO_SLOT;
+    struct sockaddr_in neighbor_router2;
+    const char *message=NULL;
+    size_t msg_size, pos, size;
+    struct iovec iov;
+
+    memset(&neighbor_router2, 0, sizeof(neighbor_router2));
+    neighbor_router2.sin_family = AF_INET;
+    neighbor_router2.sin_addr.s_addr = ip_addr;
+    neighbor_router2.sin_port = port;    
+
+    message = get_advertisement(&msg_size);
+
+    row = find_entry_by_ip(ip_addr, port);
+    if(row != FAILURE) {
+        slot = find_neighbor(router_current()->routing_table.entry[row].id);
+    }
+
+    sockfd2 = -1;
+    if(NULL == router_current()->transport) {
+        sockfd2 = get_send_socket();
+        if(-1 == sockfd2) {
+            return -1;
+        }
+    }
+
+    for(pos = 0; pos < msg_size; pos += size) {
+
+        size = segment_size(message + pos);
+        iov.iov_base = (void*) (message + pos);
+        iov.iov_len = size;
+
+        if(NULL != router_current()->transport) {
+            rv = router_current()->transport->send(&neighbor_router2, &iov, 1, router_current()->transport->arg);
+            count_sent(slot, rv);
+            continue;
+        }
+
+        //printf("Sending update message to: %s %d\n", inet_ntoa(neighbor_router2.sin_addr), neighbor_router2.sin_port);
+        rv = sendto(sockfd2, message + pos, size, 0, (struct sockaddr*) &neighbor_router2, sizeof(neighbor_router2));
+        count_sent(slot, rv);
+        if(rv < 0) {
+            return rv;
+        }
 
-        //printf("Entry %d\n", index+1);
+        if(capture_enabled() == TRUE) {
+            struct sockaddr_in local;
 
-        memcpy(&incoming_message[index].ip_addr, msg+size_count, sizeof(incoming_message[index].ip_addr));    
-        size_count += sizeof(incoming_message[index].ip_addr);
-        ip_addr.s_addr = incoming_message[index].ip_addr;
-        //printf("ip addr: %s\n", inet_ntoa(ip_addr));
-   
-        memcpy(&incoming_message[index].port, msg+size_count, sizeof(incoming_message[index].port)); 
-        incoming_message[index].port = ntohs(incoming_message[index].port);
-        size_count += sizeof(incoming_message[index].port);
-        //printf("port: %"PRIu16"\n", incoming_message[index].port);
+            capture_local_address(&local);
+            capture_datagram(&local, &neighbor_router2, &iov, 1);
+        }
+    }
 
-        size_count += sizeof(incoming_message[index].pad);
+    return rv;
+}
 
-        memcpy(&incoming_message[index].id, msg+size_count, sizeof(incoming_message[index].id)); 
-        incoming_message[index].id = ntohs(incoming_message[index].id);
-        size_count += sizeof(incoming_message[index].id);
-        //printf("id: %"PRIu16"\n", incoming_message[index].id);
+/********************************************************************************
+*   Name:   Get message and update
+*   Desc:   drains every pending update message from the socket in recvmmsg
+*           batches and applies each one to the routing table
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void get_message_and_update(int sock_in) {
 
-        memcpy(&incoming_message[index].cost, msg+size_count, sizeof(incoming_message[index].cost)); 
-        incoming_message[index].cost = ntohs(incoming_message[index].cost);
-        size_count += sizeof(incoming_message[index].cost);
-        //printf("cost: %"PRIu16"\n", incoming_message[index].cost);
+    int index=0;
+    int received=0;
 
-        //printf("\n");
+    if(NULL == recv_batch) {
+        recv_batch = (char*) malloc(RECV_BATCH*MAX_DATAGRAM_SIZE);
+        if(NULL == recv_batch) {
+            fprintf(stderr, "Failed to allocate receive batch\n");
+            exit(EXIT_FAILURE);
+        }
+        for(index = 0; index < RECV_BATCH; index++) {
+            recv_iov[index].iov_base = recv_batch + index*MAX_DATAGRAM_SIZE;
+            recv_iov[index].iov_len = MAX_DATAGRAM_SIZE;
+            recv_msg[index].msg_hdr.msg_iov = &recv_iov[index];
+            recv_msg[index].msg_hdr.msg_iovlen = 1;
+            recv_msg[index].msg_hdr.msg_name = &recv_addr[index];
+        }
+    }
+
+    do {
+        // recvmmsg overwrites the lengths; everything else stays set up
+        for(index = 0; index < RECV_BATCH; index++) {
+            recv_msg[index].msg_hdr.msg_namelen = sizeof(recv_addr[index]);
+        }
+
+        //printf("\nGetting messages... \n");
+        received = recvmmsg(sock_in, recv_msg, RECV_BATCH, MSG_DONTWAIT, NULL);
+        if(received <= 0) {
+            break;
+        }
+
+        if(capture_enabled() == TRUE) {
+            struct sockaddr_in local;
+            struct iovec iov;
+
+            capture_local_address(&local);
+            for(index = 0; index < received; index++) {
+                iov.iov_base = recv_iov[index].iov_base;
+                iov.iov_len = recv_msg[index].msg_len;
+                capture_datagram(&recv_addr[index], &local, &iov, 1);
+            }
+        }
+
+        for(index = 0; index < received; index++) {
+            process_update_message((char*) recv_iov[index].iov_base, recv_msg[index].msg_len);
+        }
+
+        // A short batch means the socket is empty
+    } while(received == RECV_BATCH);
+}
+
+/********************************************************************************
+*   Name:   parse_update_header
+*   Desc:   reads an update message header and checks that the entries it
+*           declares were all received
+*   Ret:    number of entries, COMPACT_MARK for a v2 message, or Failure for
+*           a short, truncated or malformed message
+*   Ref:    None
+********************************************************************************/
+int parse_update_header(const char *msg, ssize_t msg_len, uint32_t *source_ip_addr, uint16_t *source_port) {
+
+    uint16_t num_updates;
+
+    if(msg_len < (ssize_t) sizeof(struct update_header)) {
+        return FAILURE;
+    }
+
+    memcpy(&num_updates, msg + offsetof(struct update_header, num_updates), sizeof(num_updates));
+    num_updates = ntohs(num_updates);
+
+    // Never read past what was actually received
+    if(num_updates == COMPACT_MARK) {
+        if(SUCCESS != check_compact_message(msg + sizeof(struct update_header), msg_len - sizeof(struct update_header))) {
+            return FAILURE;
+        }
+    }
+    else if(num_updates > (msg_len - sizeof(struct update_header)) / sizeof(struct updates)) {
+        return FAILURE;
+    }
+
+    memcpy(source_port, msg + offsetof(struct update_header, source_port), sizeof(*source_port));
+    *source_port = ntohs(*source_port);
+
+    memcpy(source_ip_addr, msg + offsetof(struct update_header, source_ip_addr), sizeof(*source_ip_addr));
+
+    return num_updates;
+}
+
+/********************************************************************************
+*   Name:   process_update_message
+*   Desc:   applies one received datagram, timing it and counting rejects
+*   Ret:    Success or Failure if the message was malformed or from a stranger
+*   Ref:    None
+********************************************************************************/
+int process_update_message(const char *msg, ssize_t msg_len) {
+
+    uint64_t start = metrics_now_ns();
+    int rv;
+
+    rv = apply_update_message(msg, msg_len);
+    if(rv != SUCCESS) {
+        router_current()->metrics.rejected++;
+    }
+
+    histogram_record(&router_current()->metrics.packet_time, metrics_now_ns() - start);
+    return rv;
+}
+
+/********************************************************************************
+*   Name:   apply_update_message
+*   Desc:   decodes one update message and updates routing table. A segment
+*           of a larger advertisement is applied on its own, as it arrives.
+*   Ret:    Success or Failure if the message was malformed or from a stranger
+*   Ref:    None
+********************************************************************************/
+static int apply_update_message(const char *msg, ssize_t msg_len) {
+
+    int num_updates;
+    uint16_t source_port;
+    uint32_t source_ip_addr; 
+    const char *entries;
+    int offered;
+    
+    uint16_t neighbor_id=0; 
+
+    int slot=0;
+    int neighbor_index=0;
+
+    num_updates = parse_update_header(msg, msg_len, &source_ip_addr, &source_port);
+    if(num_updates == FAILURE) {
+        return FAILURE;
     }
 
     /**********************************************************************************
@@ -611,51 +1724,70 @@ void get_message_and_update(int sock_in) {
     ***********************************************************************************/
     
     // Is the sender already in routing table?
-    for(index = 0; index < num_updates; index++) {
-        if(incoming_message[index].ip_addr == source_ip_addr) {   
-            // This is the neighbor!
-            cse4589_print_and_log("RECEIVED A MESSAGE FROM SERVER %d\n", incoming_message[index].id);
-            neighbor_id = incoming_message[index].id;
-            neighbor_index = find_entry_by_id(neighbor_id);
+    neighbor_index = find_entry_by_ip(source_ip_addr, source_port);
+    if(neighbor_index == FAILURE) {
+        return FAILURE;
+    }
 
-            // Update counter to 0
-            this_router.routing_table.additional_info[neighbor_index].counter = 0;
-        }
-        
-        if(incoming_message[index].id == this_router.id) {
-            // This packet is self!
-            self_index = index;
-        }
+    // This is the neighbor!
+    neighbor_id = router_current()->routing_table.entry[neighbor_index].id;
+    slot = find_neighbor(neighbor_id);
+    if(slot == FAILURE || router_current()->neighbors[slot].link_cost == INF) {
+        // Not linked to us, or the link was disabled
+        return FAILURE;
     }
+    LOG_INFO("RECEIVED A MESSAGE FROM SERVER %d\n", neighbor_id);
 
-    // Show message on screen and log
-    for(index = 0; index < num_updates; index++) {
-        cse4589_print_and_log("%­15d%­15d\n", incoming_message[index].id, incoming_message[index].cost);
+    router_current()->neighbors[slot].metrics.packets_in++;
+    router_current()->neighbors[slot].metrics.bytes_in += msg_len;
+
+    // Only the neighbor's own datagrams count as hearing from it
+    router_current()->neighbors[slot].counter = 0;
+    set_neighbor_alive(slot, TRUE);
+
+    entries = msg + sizeof(struct update_header);
+    if(num_updates == COMPACT_MARK) {
+        if(apply_compact_update(slot, entries, msg_len - sizeof(struct update_header)) == TRUE) {
+            router_current()->num_packets++;
+        }
+        return SUCCESS;
     }
 
-    // The neighbor can reach me at the cost k, if it is better than what i already know, update!
-    if(incoming_message[self_index].cost <= this_router.routing_table.entry[neighbor_index].cost) {
-        // Update
-        update_link_routing_table_entry(this_router.routing_table.entry[neighbor_index].id, this_router.id, incoming_message[self_index].cost);
+    // Segments without the sender's own row leave its offer as it was
+    offered = offered_version(entries, num_updates, neighbor_id);
+    if(offered != FAILURE) {
+        set_neighbor_accepts(slot, offered);
     }
 
-    // For other entries
-     for(index = 0; index < num_updates; index++) {
-        if(incoming_message[index].id != self_id || incoming_message[index].id != this_router.id) {
+    // Entries are read straight from the datagram, in one pass
+    apply_neighbor_update(slot, entries, num_updates);
 
-            // Incoming message has better cost. Update the tuples.
-            entry_index = find_entry_by_id(incoming_message[index].id);
-            if(this_router.routing_table.entry[entry_index].cost > incoming_message[index].cost + this_router.routing_table.entry[neighbor_index].cost) {
+    router_current()->num_packets++;
+    return SUCCESS;
+}
 
-                update_link_routing_table_entry(incoming_message[index].id, neighbor_id, incoming_message[index].cost + this_router.routing_table.entry[neighbor_index].cost);
-            }
+/********************************************************************************
+*   Name:   offered_version
+*   Desc:   the wire version a v1 sender offers, carried in the padding of its
+*           own entry, which decoders that predate v2 never read
+*   Ret:    WIRE_V1 or WIRE_V2, FAILURE if the message lacks the sender's entry
+*   Ref:    None
+********************************************************************************/
+static int offered_version(const char *entries, int count, uint16_t sender_id)
+{
+    const char *entry = entries;
+    uint16_t id, pad;
+    int index;
 
-            // Update counter to 0 regardless
-            this_router.routing_table.additional_info[entry_index].counter = 0;
+    for(index = 0; index < count; index++, entry += sizeof(struct updates)) {
+        memcpy(&id, entry + offsetof(struct updates, id), sizeof(id));
+        if(ntohs(id) == sender_id) {
+            memcpy(&pad, entry + offsetof(struct updates, pad), sizeof(pad));
+            return ntohs(pad) == WIRE_V2 ? WIRE_V2 : WIRE_V1;
         }
     }
 
-    num_packets++;
+    return FAILURE;
 }
 
 /********************************************************************************
@@ -737,13 +1869,13 @@ void kill_connection(int target_index)
 {
     int index=0;
 
-    for(index=0; index < update_index; index++) {
+    for(index=0; index < router_current()->num_entries; index++) {
 
         if(index == target_index) {
 
-            // Set cost to INF, nexthop to -1, cost to INF and counter to -1
-            update_link_routing_table_entry(this_router.routing_table.entry[index].id, -1, INF);
-            this_router.routing_table.additional_info[target_index].counter = -1; 
+            // Set cost to INF, drop the nexthop and mark the counter dead
+            update_link_routing_table_entry(router_current()->routing_table.entry[index].id, -1, INF);
+            mark_neighbor_dead(router_current()->routing_table.entry[index].id);
             break;
         }
     }
@@ -0,0 +1,634 @@
+/********************************************************************************
+*   FILE:   topology.c
+*   DESC:   Topology file parser. The file is mapped and scanned once in place;
+*           nothing is copied or tokenized. Entries are handed to callbacks so
+*           read_topology can feed the routing table's bulk-load path and
+*           other users (benchmarks, reloads) can consume the same stream.
+*           The file is watched with inotify and reloads apply only what
+*           changed since the live table was built.
+*
+*           Format, one item per line, blank lines ignored:
+*               <number of routers>
+*               <number of neighbors>
+*               <id> <a.b.c.d> <port>           (number of routers lines)
+*               <id> <neighbor id> <cost>       (number of neighbors lines)
+********************************************************************************/
+#include <fcntl.h>
+#include <sys/inotify.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "header.h"
+
+struct topology_cursor {
+    const char *pos;
+    const char *end;
+    int line;
+};
+
+/********************************************************************************
+*   Name:   topology_error
+*   Desc:   reports a parse error at the cursor's line
+*   Ret:    FAILURE
+*   Ref:    None
+********************************************************************************/
+static int topology_error(const struct topology_cursor *cursor, const char *expected)
+{
+    fprintf(stderr, "Topology line %d: expected %s\n", cursor->line, expected);
+    return FAILURE;
+}
+
+/********************************************************************************
+*   Name:   skip_blank_lines
+*   Desc:   moves to the first character of the next non-blank line
+*   Ret:    TRUE if there is one, FALSE at end of file
+*   Ref:    None
+********************************************************************************/
+static int skip_blank_lines(struct topology_cursor *cursor)
+{
+    while(cursor->pos < cursor->end) {
+        if(*cursor->pos == '\n') {
+            cursor->line++;
+        }
+        else if(*cursor->pos != ' ' && *cursor->pos != '\t' && *cursor->pos != '\r') {
+            return TRUE;
+        }
+        cursor->pos++;
+    }
+
+    return FALSE;
+}
+
+/********************************************************************************
+*   Name:   parse_number
+*   Desc:   reads an unsigned decimal after optional spaces
+*   Ret:    Success or Failure if there is no number or it exceeds max
+*   Ref:    None
+********************************************************************************/
+static int parse_number(struct topology_cursor *cursor, uint32_t max, uint32_t *value)
+{
+    const char *pos = cursor->pos;
+    uint32_t number = 0;
+
+    while(pos < cursor->end && (*pos == ' ' || *pos == '\t')) {
+        pos++;
+    }
+    if(pos == cursor->end || (unsigned) (*pos - '0') > 9) {
+        return FAILURE;
+    }
+
+    while(pos < cursor->end && (unsigned) (*pos - '0') <= 9) {
+        number = number*10 + (*pos - '0');
+        if(number > max) {
+            return FAILURE;
+        }
+        pos++;
+    }
+
+    cursor->pos = pos;
+    *value = number;
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   parse_ip
+*   Desc:   reads a dotted quad after optional spaces
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+static int parse_ip(struct topology_cursor *cursor, uint32_t *ip_addr)
+{
+    uint32_t octet, host_order = 0;
+    int index;
+
+    for(index = 0; index < 4; index++) {
+        if(index > 0) {
+            if(cursor->pos == cursor->end || *cursor->pos != '.') {
+                return FAILURE;
+            }
+            cursor->pos++;
+            // No spaces inside an address
+            if(cursor->pos == cursor->end || (unsigned) (*cursor->pos - '0') > 9) {
+                return FAILURE;
+            }
+        }
+        if(SUCCESS != parse_number(cursor, 255, &octet)) {
+            return FAILURE;
+        }
+        host_order = (host_order << 8) | octet;
+    }
+
+    *ip_addr = htonl(host_order);
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   end_of_line
+*   Desc:   consumes trailing spaces and the line break
+*   Ret:    Success or Failure if anything else is left on the line
+*   Ref:    None
+********************************************************************************/
+static int end_of_line(struct topology_cursor *cursor)
+{
+    while(cursor->pos < cursor->end && (*cursor->pos == ' ' || *cursor->pos == '\t' || *cursor->pos == '\r')) {
+        cursor->pos++;
+    }
+    if(cursor->pos == cursor->end) {
+        return SUCCESS;
+    }
+    if(*cursor->pos != '\n') {
+        return FAILURE;
+    }
+
+    cursor->pos++;
+    cursor->line++;
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   parse_topology
+*   Desc:   parses a whole topology held in memory, calling the handler for
+*           every router, once after the last router, and for every link
+*   Ret:    Success or Failure; errors are reported with their line number
+*   Ref:    None
+********************************************************************************/
+int parse_topology(const char *data, size_t size, const struct topology_handler *handler)
+{
+    struct topology_cursor cursor = { data, data + size, 1 };
+    uint32_t num_routers, num_neighbors, id, neighbor_id, port, cost, ip_addr;
+    uint32_t index;
+
+    if(TRUE != skip_blank_lines(&cursor) || SUCCESS != parse_number(&cursor, INT_MAX, &num_routers) || SUCCESS != end_of_line(&cursor)) {
+        return topology_error(&cursor, "number of routers");
+    }
+    if(TRUE != skip_blank_lines(&cursor) || SUCCESS != parse_number(&cursor, INT_MAX, &num_neighbors) || SUCCESS != end_of_line(&cursor)) {
+        return topology_error(&cursor, "number of neighbors");
+    }
+
+    if(NULL != handler->routers_begin) {
+        handler->routers_begin(num_routers, handler->arg);
+    }
+
+    for(index = 0; index < num_routers; index++) {
+        if(TRUE != skip_blank_lines(&cursor) ||
+           SUCCESS != parse_number(&cursor, UINT16_MAX, &id) ||
+           SUCCESS != parse_ip(&cursor, &ip_addr) ||
+           SUCCESS != parse_number(&cursor, UINT16_MAX, &port) ||
+           SUCCESS != end_of_line(&cursor)) {
+            return topology_error(&cursor, "<id> <ip address> <port>");
+        }
+        handler->router(id, ip_addr, port, handler->arg);
+    }
+
+    if(NULL != handler->routers_end) {
+        handler->routers_end(handler->arg);
+    }
+
+    for(index = 0; index < num_neighbors; index++) {
+        if(TRUE != skip_blank_lines(&cursor) ||
+           SUCCESS != parse_number(&cursor, UINT16_MAX, &id) ||
+           SUCCESS != parse_number(&cursor, UINT16_MAX, &neighbor_id) ||
+           SUCCESS != parse_number(&cursor, UINT16_MAX, &cost) ||
+           SUCCESS != end_of_line(&cursor)) {
+            return topology_error(&cursor, "<id> <neighbor id> <cost>");
+        }
+        handler->link(id, neighbor_id, cost, handler->arg);
+    }
+
+    return SUCCESS;
+}
+
+/********************************************************************************
+*   Name:   read_topology_stream
+*   Desc:   reads the rest of a topology stream into a heap buffer
+*   Ret:    file contents, NULL on failure; free when done
+*   Ref:    None
+********************************************************************************/
+static char *read_topology_stream(FILE *tofile, size_t *size)
+{
+    char *data = NULL, *grown;
+    size_t capacity = 0, length = 0, got;
+
+    do {
+        if(length == capacity) {
+            capacity = capacity ? 2*capacity : 65536;
+            grown = (char*) realloc(data, capacity);
+            if(NULL == grown) {
+                free(data);
+                return NULL;
+            }
+            data = grown;
+        }
+        got = fread(data + length, 1, capacity - length, tofile);
+        length += got;
+    } while(got > 0);
+
+    *size = length;
+    return data;
+}
+
+/********************************************************************************
+*   Name:   map_topology
+*   Desc:   maps a topology file read-only; files that cannot be mapped (pipes)
+*           are read into memory instead
+*   Ret:    file contents, NULL on failure; release with unmap_topology
+*   Ref:    None
+********************************************************************************/
+const char *map_topology(FILE *tofile, size_t *size, int *mapped)
+{
+    struct stat st;
+    char *data;
+    int fd = fileno(tofile);
+
+    if(0 == fstat(fd, &st) && S_ISREG(st.st_mode)) {
+        // mmap cannot map an empty file; let it fall through to the read path
+        if(st.st_size > 0) {
+            data = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(MAP_FAILED != data) {
+                madvise(data, st.st_size, MADV_SEQUENTIAL);
+                *size = st.st_size;
+                *mapped = TRUE;
+                return data;
+            }
+        }
+    }
+
+    *mapped = FALSE;
+    return read_topology_stream(tofile, size);
+}
+
+/********************************************************************************
+*   Name:   unmap_topology
+*   Desc:   releases what map_topology returned
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+void unmap_topology(const char *data, size_t size, int mapped)
+{
+    if(mapped == TRUE) {
+        munmap((void*) data, size);
+    }
+    else {
+        free((void*) data);
+    }
+}
+
+/********************************************************************************
+*   Name:   load_routers_begin / load_router / load_routers_end / load_link
+*   Desc:   read_topology's handler: bulk-load every router, sort once, then
+*           set up the links
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void load_routers_begin(uint32_t num_routers, void *arg)
+{
+    (void) arg;
+
+    // A capacity hint only; a bad count is caught as the lines run out
+    if(num_routers <= ID_SPACE) {
+        grow_routing_table(router_current()->num_entries + num_routers);
+    }
+}
+
+static void load_router(uint16_t id, uint32_t ip_addr, uint16_t port, void *arg)
+{
+    (void) arg;
+
+    if(ip_addr == router_current()->ip_addr) {
+        router_current()->id = id;
+        router_current()->port = port;
+        append_routing_table_entry(id, ip_addr, port, 0, router_current()->id);
+    }
+    else {
+        append_routing_table_entry(id, ip_addr, port, INF, INVALID_ROUTER_ID);
+    }
+}
+
+static void load_routers_end(void *arg)
+{
+    (void) arg;
+
+    sort_routing_table();
+}
+
+static void load_link(uint16_t id, uint16_t neighbor_id, uint16_t cost, void *arg)
+{
+    (void) arg;
+
+    // Only this router's own links are configuration, as on reload
+    if(id == router_current()->id) {
+        update_link_routing_table_entry(neighbor_id, id, cost);
+    }
+}
+
+/********************************************************************************
+*   Name:   read_topology
+*   Desc:   Reads topology file and adds entries to routing table
+*   Ret:    Success or Failure
+*   Ref:    None
+********************************************************************************/
+int read_topology(FILE *tofile)
+{
+    static const struct topology_handler loader = {
+        load_routers_begin, load_router, load_routers_end, load_link, NULL
+    };
+    const char *data;
+    size_t size;
+    int mapped, rv;
+
+    data = map_topology(tofile, &size, &mapped);
+    if(NULL == data) {
+        fprintf(stderr, "Failed to read topology file\n");
+        return FAILURE;
+    }
+
+    rv = parse_topology(data, size, &loader);
+
+    unmap_topology(data, size, mapped);
+    return rv;
+}
+
+/**************************************
+* Reload
+*
+* A reload parses the whole file before touching anything, then applies
+* only what differs from the live table. Links go through the same path
+* as the update command, so unchanged neighbors keep their vectors and
+* counters. Routers dropped from the file keep their rows; they simply
+* become unreachable once nobody advertises them.
+**************************************/
+struct topology_diff {
+	struct destination *routers;        // every router line, in file order
+	int num_routers;
+	int capacity;
+	uint16_t *link_cost;                // neighbor id -> cost in the file, INF if unlisted
+	uint32_t self_ip;                   // this router's address, to find its line
+	int self_id;                        // INVALID_ROUTER_ID until found
+	uint16_t self_port;
+	int failed;                         // TRUE if memory ran out while parsing
+};
+
+static char *topology_path;              // file given with -t, for reloads
+
+/********************************************************************************
+*   Name:   diff_router / diff_link
+*   Desc:   reload's handler: collects the file without changing the table
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void diff_router(uint16_t id, uint32_t ip_addr, uint16_t port, void *arg)
+{
+    struct topology_diff *diff = (struct topology_diff*) arg;
+    struct destination *grown;
+
+    if(diff->failed == TRUE) {
+        return;
+    }
+    if(diff->num_routers == diff->capacity) {
+        diff->capacity = diff->capacity ? 2*diff->capacity : RTABLE_INIT_SIZE;
+        grown = (struct destination*) realloc(diff->routers, diff->capacity*sizeof(struct destination));
+        if(NULL == grown) {
+            diff->failed = TRUE;
+            return;
+        }
+        diff->routers = grown;
+    }
+
+    diff->routers[diff->num_routers].ip_addr = ip_addr;
+    diff->routers[diff->num_routers].port = port;
+    diff->routers[diff->num_routers].id = id;
+    diff->num_routers++;
+
+    if(ip_addr == diff->self_ip) {
+        diff->self_id = id;
+        diff->self_port = port;
+    }
+}
+
+static void diff_link(uint16_t id, uint16_t neighbor_id, uint16_t cost, void *arg)
+{
+    struct topology_diff *diff = (struct topology_diff*) arg;
+
+    // Only this router's own links are configuration
+    if(id == diff->self_id) {
+        diff->link_cost[neighbor_id] = cost;
+    }
+}
+
+/********************************************************************************
+*   Name:   apply_router_diff
+*   Desc:   adds routers new to the file and moves those whose address changed
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void apply_router_diff(const struct topology_diff *diff)
+{
+    struct destination *entry;
+    int index, row, moved = FALSE;
+
+    for(index = 0; index < diff->num_routers; index++) {
+        entry = &diff->routers[index];
+        row = find_entry_by_id(entry->id);
+        if(row == FAILURE) {
+            add_routing_table_entry(entry->id, entry->ip_addr, entry->port, INF, INVALID_ROUTER_ID);
+            continue;
+        }
+        if(router_current()->routing_table.entry[row].ip_addr != entry->ip_addr || router_current()->routing_table.entry[row].port != entry->port) {
+            router_current()->routing_table.entry[row].ip_addr = entry->ip_addr;
+            router_current()->routing_table.entry[row].port = entry->port;
+            moved = TRUE;
+        }
+    }
+
+    if(moved == TRUE) {
+        rebuild_routing_table_index();
+        invalidate_advertisement();
+    }
+}
+
+/********************************************************************************
+*   Name:   apply_link_diff
+*   Desc:   removes links missing from the file, as disable does, then adds
+*           new ones and applies changed costs. Links whose cost is unchanged
+*           are skipped, and so are links taken down with the disable command:
+*           only an update brings those back.
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void apply_link_diff(const struct topology_diff *diff)
+{
+    int slot, id;
+
+    for(slot = 0; slot < router_current()->num_neighbors; slot++) {
+        id = router_current()->neighbors[slot].id;
+        if(router_current()->neighbors[slot].link_cost != INF && diff->link_cost[id] == INF) {
+            update_link_routing_table_entry(id, router_current()->id, INF);
+            mark_neighbor_dead(id);
+        }
+    }
+
+    for(id = 0; id < ID_SPACE; id++) {
+        if(diff->link_cost[id] == INF || id == router_current()->id) {
+            continue;
+        }
+        slot = find_neighbor(id);
+        if(slot != FAILURE && router_current()->neighbors[slot].disabled == TRUE) {
+            continue;
+        }
+        if(slot == FAILURE || router_current()->neighbors[slot].link_cost != diff->link_cost[id]) {
+            update_link_routing_table_entry(id, router_current()->id, diff->link_cost[id]);
+        }
+    }
+}
+
+/********************************************************************************
+*   Name:   reload_topology
+*   Desc:   reads the topology file again and applies the difference. The file
+*           is read rather than mapped: it may be rewritten while we parse it,
+*           and a mapping of a truncated file faults.
+*   Ret:    Success or Failure; on failure the table is left untouched
+*   Ref:    None
+********************************************************************************/
+int reload_topology()
+{
+    static const struct topology_handler differ = {
+        NULL, diff_router, NULL, diff_link, NULL
+    };
+    struct topology_handler handler = differ;
+    struct topology_diff diff;
+    FILE *tofile;
+    char *data;
+    size_t size;
+    int index, rv;
+
+    if(NULL == topology_path || NULL == (tofile = fopen(topology_path, "r"))) {
+        fprintf(stderr, "Failed to open topology file for reload\n");
+        return FAILURE;
+    }
+    data = read_topology_stream(tofile, &size);
+    fclose(tofile);
+    if(NULL == data) {
+        fprintf(stderr, "Failed to read topology file\n");
+        return FAILURE;
+    }
+
+    memset(&diff, 0, sizeof(diff));
+    diff.self_ip = router_current()->ip_addr;
+    diff.self_id = INVALID_ROUTER_ID;
+    diff.failed = FALSE;
+    diff.link_cost = (uint16_t*) malloc(ID_SPACE*sizeof(uint16_t));
+    if(NULL == diff.link_cost) {
+        free(data);
+        return FAILURE;
+    }
+    for(index = 0; index < ID_SPACE; index++) {
+        diff.link_cost[index] = INF;
+    }
+    handler.arg = &diff;
+
+    rv = parse_topology(data, size, &handler);
+    free(data);
+
+    if(rv == SUCCESS && diff.failed == TRUE) {
+        fprintf(stderr, "Out of memory reloading topology\n");
+        rv = FAILURE;
+    }
+    // The socket is bound and neighbors know us by id; those need a restart
+    if(rv == SUCCESS && (diff.self_id != router_current()->id || diff.self_port != router_current()->port)) {
+        fprintf(stderr, "Topology reload cannot change this router's id or port\n");
+        rv = FAILURE;
+    }
+
+    if(rv == SUCCESS) {
+        apply_router_diff(&diff);
+        apply_link_diff(&diff);
+    }
+
+    free(diff.routers);
+    free(diff.link_cost);
+    return rv;
+}
+
+/********************************************************************************
+*   Name:   handle_topology_event
+*   Desc:   drains the inotify descriptor and reloads if the topology file
+*           was written or replaced
+*   Ret:    Nothing
+*   Ref:    None
+********************************************************************************/
+static void handle_topology_event(int fd, void *arg)
+{
+    char events[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    const struct inotify_event *event;
+    const char *name = (const char*) arg;
+    ssize_t length;
+    char *pos;
+    int changed = FALSE;
+
+    while((length = read(fd, events, sizeof(events))) > 0) {
+        for(pos = events; pos < events + length; pos += sizeof(struct inotify_event) + event->len) {
+            event = (const struct inotify_event*) pos;
+            if(event->len > 0 && 0 == strcmp(event->name, name)) {
+                changed = TRUE;
+            }
+        }
+    }
+
+    if(changed == TRUE) {
+        reload();
+    }
+}
+
+/********************************************************************************
+*   Name:   watch_topology
+*   Desc:   remembers the topology file for reloads and watches it. The
+*           directory is watched, not the file, so editors that save by
+*           renaming a new file over the old one are seen too.
+*   Ret:    Success or Failure; the reload command works either way
+*   Ref:    None
+********************************************************************************/
+int watch_topology(const char *path)
+{
+    static char *watched_name;
+    char *directory, *slash;
+    int fd;
+
+    free(topology_path);
+    topology_path = strdup(path);
+    directory = strdup(path);
+    if(NULL == topology_path || NULL == directory) {
+        free(directory);
+        return FAILURE;
+    }
+
+    slash = strrchr(directory, '/');
+    if(NULL == slash) {
+        watched_name = topology_path;
+        strcpy(directory, ".");
+    }
+    else {
+        watched_name = topology_path + (slash - directory) + 1;
+        // Keep "/" itself for files in the root directory
+        slash[slash == directory ? 1 : 0] = '\0';
+    }
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if(fd < 0) {
+        perror("inotify_init1");
+        free(directory);
+        return FAILURE;
+    }
+    if(inotify_add_watch(fd, directory, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        perror("inotify_add_watch");
+        close(fd);
+        free(directory);
+        return FAILURE;
+    }
+    free(directory);
+
+    if(SUCCESS != event_loop_add_fd(fd, handle_topology_event, watched_name)) {
+        close(fd);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}